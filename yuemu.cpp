@@ -1,643 +1,1547 @@
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "yuemu.hpp"
 
-Yuemu::Yuemu(std::string fpath) {
-    read_file_to_memory(fpath);
-    run();
+// hart i starts at the entry pc like the others, with its id in r255 so the program can tell them apart
+Yuemu::Yuemu(const YuemuOptions& options) : options(options), devices(std::max(1u, options.harts), &std::cout) {
+    for (uint32_t i=0; i<std::max(1u, options.harts); i++) {
+        Hart* hart = new Hart(i, mem, std::max(1u, options.ret_stack_capacity));
+        hart->regs[255] = i;
+        if (options.jit) {
+            JitHelpers helpers = {jit_load, jit_store, jit_push_ret, jit_pop_ret};
+            hart->jit.reset(new Jit(helpers));
+        }
+        harts.emplace_back(hart);
+    }
+    if (options.record_interval > 0 && harts.size() == 1) {
+        recorder.reset(new Recorder(options.record_interval));
+        devices.set_recording(true);
+    }
+    if (!options.host_counters_file.empty()) {
+        host_counters.reset(new HostCounters(options.host_sample_period));
+    }
 }
 
-void Yuemu::run() {
-    // TODO unsigned and signed types are mixed up for register array and maybe memory map
-    std::cout << "Running program\n";
-    while (pc != read_instr_count) {
-        uint32_t instr = mem[pc]; // fetch
-        uint32_t opcode_category = instr >> 28 & 0xF;
-        uint32_t opcode_id = instr >> 24 & 0xF;
-
-        switch (opcode_category) {
-            case 0x0: { // memory
-                switch (opcode_id) {
-                    case 0x0: { // load immediate
-                        uint32_t rd = instr >> 16 & 0xFF; // 8 bits
-                        uint32_t val = instr & 0xFFFF; // 16 bits
-
-                        // sign extend
-                        if ((val >> 15 & 0b1) == 1) { // if negative
-                            val = sign_extend(val, 16);
-                        }
-
-                        regs[rd] = val;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "loadm: rd=" << rd << ", val=" << to_signed(val) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x1: { // load register indirect
-                        uint32_t rd = instr >> 16 & 0xFF; // 8 bits
-                        uint32_t raddr = instr >> 8 & 0xFF; // 8 bits
-                        regs[rd] = mem[regs[raddr]];
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "loadr: rd=" << rd << ", raddr=" << raddr << "\n";
-                            std::cout << "+> value_of_addr=" << regs[raddr] << ", value_at_addr=" << mem[regs[raddr]] << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x2: { // storen
-                        uint32_t raddr = instr >> 16 & 0xFF; // 8 bits
-                        uint32_t rs = instr >> 8 & 0xFF; // 8 bits
-                        mem[regs[raddr]] = regs[rs];
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "storen: raddr=" << raddr << ", rs=" << rs << "\n";
-                            std::cout << "+> value_at_rs=" << to_signed(regs[rs]) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x3: { // stored 0000_0011_16-bits-addr_8-bits-rs
-                        uint32_t addr = instr >> 8 & 0xFFFF; // 16 bits
-                        uint32_t rs = instr & 0xFF; // 8 bits
-                        mem[addr] = regs[rs];
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "stored: addr=" << addr << ", rs=" << rs << "\n";
-                            std::cout << "+> value_at_rs=" << to_signed(regs[rs]) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x4: { // load direct 0000_0100_8-bits-rd_16-bits-addr
-                        uint32_t rd = instr >> 16 & 0xFF; // 8 bits
-                        uint32_t addr = instr & 0xFFFF; // 16 bits
-                        regs[rd] = mem[addr];
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "loadd: rd=" << rd << ", raddr=" << addr << "\n";
-                            std::cout << "+> value_at_addr=" << mem[addr] << "\n";
-                        }
-                        break;
-                    }
-
-                    default: {
-                        std::cerr << "Error: invalid instruction: 0x" << get_instr_as_hex(instr) << "\n";
-                        return;
-                    }
+bool Yuemu::load_program(std::string fpath) {
+    HostCounters::Scope phase(host_counters.get(), HostCounters::LOAD);
+    return read_file_to_memory(fpath) && open_aot();
+}
+
+void Yuemu::set_stop_pc(uint32_t new_stop_pc) {
+    stop_pc = new_stop_pc;
+    has_stop_pc = true;
+}
+
+Yuemu::StopReason Yuemu::run_until(uint32_t pc, uint64_t max_instructions) {
+    uint32_t old_stop_pc = stop_pc;
+    bool had_stop_pc = has_stop_pc;
+    set_stop_pc(pc);
+    StopReason reason = run(max_instructions);
+    stop_pc = old_stop_pc;
+    has_stop_pc = had_stop_pc;
+    return reason;
+}
+
+void Yuemu::add_breakpoint(uint32_t pc) {
+    if (std::find(breakpoints.begin(), breakpoints.end(), pc) != breakpoints.end()) {
+        return;
+    }
+    breakpoints.push_back(pc);
+    for (auto& hart : harts) {
+        hart->block_cache.set_breakpoint(pc, true);
+    }
+}
+
+bool Yuemu::remove_breakpoint(uint32_t pc) {
+    auto it = std::find(breakpoints.begin(), breakpoints.end(), pc);
+    if (it == breakpoints.end()) {
+        return false;
+    }
+    breakpoints.erase(it);
+    for (auto& hart : harts) {
+        hart->block_cache.set_breakpoint(pc, false);
+    }
+    return true;
+}
+
+// setting a watchpoint again changes its kinds
+void Yuemu::add_watchpoint(uint32_t addr, uint8_t kinds) {
+    auto it = std::find_if(watchpoints.begin(), watchpoints.end(),
+        [addr](const std::pair<uint32_t, uint8_t>& watch) { return watch.first == addr; });
+    if (it != watchpoints.end()) {
+        it->second = kinds;
+    } else {
+        watchpoints.emplace_back(addr, kinds);
+    }
+    mem.set_watched(addr, true);
+}
+
+// the page stays tagged while another watchpoint is on it
+bool Yuemu::remove_watchpoint(uint32_t addr) {
+    auto it = std::find_if(watchpoints.begin(), watchpoints.end(),
+        [addr](const std::pair<uint32_t, uint8_t>& watch) { return watch.first == addr; });
+    if (it == watchpoints.end()) {
+        return false;
+    }
+    watchpoints.erase(it);
+    bool page_watched = std::any_of(watchpoints.begin(), watchpoints.end(),
+        [addr](const std::pair<uint32_t, uint8_t>& watch) { return watch.first >> Memory::OFFSET_BITS == addr >> Memory::OFFSET_BITS; });
+    mem.set_watched(addr, page_watched);
+    return true;
+}
+
+// the run loop only asks for accesses to a watched page
+bool Yuemu::watch_hit(Hart& hart, uint32_t addr, uint8_t kind) {
+    for (const auto& watch : watchpoints) {
+        if (watch.first == addr && (watch.second & kind) != 0) {
+            hart.watch_addr = addr;
+            hart.watch_write = kind == WATCH_WRITE;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Threaded dispatch jumps straight from one handler to the next through a
+// table of label addresses, the switch is the portable fallback
+#if defined(__GNUC__) && !defined(YUEMU_SWITCH_DISPATCH)
+#define YUEMU_THREADED_DISPATCH 1
+#else
+#define YUEMU_THREADED_DISPATCH 0
+#endif
+
+// sets up what the first run needs and the blocks for the current stop pc
+void Yuemu::prepare_run() {
+    // the trace covers every run of this instance, the file is closed with it
+    if (!options.trace_file.empty() && trace_writer == nullptr) {
+        trace_writer.reset(new TraceWriter());
+        if (!trace_writer->open(options.trace_file, halt_pc)) {
+            *err << "Error: can't open trace file: " << options.trace_file << "\n";
+        }
+    }
+
+    if (!files_opened) {
+        devices.open_files(options.input_file, options.output_file, *err);
+        files_opened = true;
+    }
+
+    if (options.profile && profiler == nullptr) {
+        profiler.reset(new Profiler(code_start, code_bytes, harts.size() == 1));
+        profiler->set_symbols(&symbols);
+    }
+
+    if (options.timing && timing == nullptr) {
+        timing.reset(new TimingModel(options.timing_config, harts.size()));
+    }
+
+    // a restored snapshot brings its pages without the watch tags
+    for (const auto& watch : watchpoints) {
+        mem.set_watched(watch.first, true);
+    }
+
+    // without a stop pc blocks are only cut at the halt address
+    bool fuse = options.fuse && options.trace_level < 10 && trace_writer == nullptr && profiler == nullptr && timing == nullptr
+        && recorder == nullptr && watchpoints.empty();
+    for (auto& hart : harts) {
+        hart->block_cache.set_stop_pcs(halt_pc, has_stop_pc ? stop_pc : halt_pc);
+        hart->block_cache.set_fusion(fuse);
+    }
+}
+
+Yuemu::StopReason Yuemu::run(uint64_t max_instructions) {
+    HostCounters::Scope phase(host_counters.get(), HostCounters::EXECUTE);
+    prepare_run();
+
+    if (!started) {
+        *out << "Running program\n";
+        started = true;
+    }
+
+    if (harts.size() == 1) {
+        Hart& hart = *harts[0];
+        StopReason reason = run_hart(hart, max_instructions);
+        devices.flush_console();
+        if (reason == StopReason::END) {
+            *out << "End of program\n";
+            dump_memory();
+        } else if (reason == StopReason::FINISHED) {
+            *out << "Finished running program\n";
+            dump_memory();
+        } else if (reason == StopReason::INVALID) {
+            *err << "Error: invalid instruction: 0x" << get_instr_as_hex(hart.invalid_instr) << "\n";
+        } else if (reason == StopReason::STACK_OVERFLOW) {
+            *err << "Error: return stack overflow at pc " << hart.pc << "\n";
+        }
+        if (hart.halted()) {
+            print_reports();
+        }
+        return reason;
+    }
+
+    // a hart that has halted stays halted, one stopped at the stop pc, a
+    // breakpoint or a watchpoint sits out the rest of this run
+    std::vector<Hart*> active;
+    for (auto& hart : harts) {
+        if (!hart->halted()) {
+            active.push_back(hart.get());
+        }
+    }
+
+    // tracing, profiling and timing need a single writer so those runs always go in lock-step
+    bool tracing = options.trace_level >= 10 || trace_writer != nullptr || profiler != nullptr || timing != nullptr;
+    uint64_t quantum = options.lockstep_quantum;
+    if (quantum == 0 && tracing) {
+        quantum = 1;
+    }
+
+    if (quantum == 0) {
+        std::vector<std::thread> threads;
+        for (size_t i=1; i<active.size(); i++) {
+            threads.emplace_back([this, hart = active[i], max_instructions] {
+                run_hart(*hart, max_instructions);
+            });
+        }
+        if (!active.empty()) {
+            run_hart(*active[0], max_instructions);
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    } else {
+        // every hart gets quantum instructions in turn, in hart order, so
+        // the interleaving only depends on the program
+        std::vector<uint64_t> left(active.size(), max_instructions);
+        bool progress = true;
+        while (progress) {
+            progress = false;
+            for (size_t i=0; i<active.size(); i++) {
+                Hart& hart = *active[i];
+                if (left[i] == 0 || hart.halted()) {
+                    continue;
+                }
+                if (options.trace_level >= 10) {
+                    *out << "[hart " << hart.id << "]\n";
+                }
+                uint64_t before = hart.executed;
+                StopReason reason = run_hart(hart, std::min(quantum, left[i]));
+                left[i] -= hart.executed - before;
+                if (reason == StopReason::BUDGET) {
+                    progress = true;
+                } else if (hart.stopped()) {
+                    left[i] = 0;
                 }
-                break;
             }
+        }
+    }
 
-            case 0x1: { // arithmetic
-                switch (opcode_id) {
-                    case 0x0: { // add
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        uint32_t val1 = regs[rs1];
-                        uint32_t val2 = regs[rs2];
-                        uint32_t res = val1 + val2;
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "add: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x1: { // subtract
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        int32_t val1 = regs[rs1];
-                        int32_t val2 = regs[rs2];
-                        int32_t res = val1 - val2;
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "sub: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x2: { // mul
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        uint32_t val1 = regs[rs1];
-                        uint32_t val2 = regs[rs2];
-                        uint32_t res = val1 * val2;
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "mul: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x3: { // div
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        uint32_t val1 = regs[rs1];
-                        uint32_t val2 = regs[rs2];
-                        uint32_t res = val1 / val2;
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "div: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
-
-                    default: {
-                        std::cerr << "Error: invalid instruction: 0x" << get_instr_as_hex(instr) << "\n";
-                        return;
-                    }
-                    
-                }
-                break;
+    devices.flush_console();
+
+    bool all_halted = true;
+    bool any_budget = false;
+    Hart* first_stopped = nullptr;
+    for (Hart* hart : active) {
+        all_halted = all_halted && hart->halted();
+        any_budget = any_budget || hart->reason == StopReason::BUDGET;
+        if (first_stopped == nullptr && hart->stopped()) {
+            first_stopped = hart;
+        }
+    }
+
+    if (all_halted) {
+        for (auto& hart : harts) {
+            *out << "Hart " << hart->id << ": ";
+            if (hart->reason == StopReason::END) {
+                *out << "End of program\n";
+            } else if (hart->reason == StopReason::FINISHED) {
+                *out << "Finished running program\n";
+            } else if (hart->reason == StopReason::STACK_OVERFLOW) {
+                *out << "Return stack overflow at pc " << hart->pc << "\n";
+            } else {
+                *out << "Invalid instruction: 0x" << get_instr_as_hex(hart->invalid_instr) << "\n";
             }
+        }
+        dump_memory();
+        print_reports();
+    }
 
-            case 0x2: { // control
-                switch (opcode_id) {
-                    case 0x0: { // jump unconditionally immediate // TODO not tested
-                        int32_t val = instr & 0xFFFFFF; // 24 bits address offset
-
-                        // sign extend
-                        if ((val >> 15 & 0b1) == 1) { // if negative
-                            val = sign_extend(val, 16);
-                        }
-
-                        pc += val;
-                        skip_auto_pc_incr = true;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "jump: val=" << val << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x1: { // jump unconditionally direct // TODO not tested
-                        uint32_t rs = instr >> 16 & 0xFF;
-
-                        pc += (int32_t) regs[rs];
-                        skip_auto_pc_incr = true;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "jumpdir: rs=" << rs << "\n";
-                            std::cout << "+> value_at_rs=" << to_signed(regs[rs]) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x2: { // jump if immediate 0010_0010_16-bits-val_8-bits-rcond
-                        int32_t val = instr >> 8 & 0xFFFF;
-                        uint32_t rcond = instr & 0xFF;
-
-                        // sign extend
-                        if ((val >> 15 & 0b1) == 1) { // if negative
-                            val = sign_extend(val, 16);
-                        }
-
-                        int32_t cond = regs[rcond];
-                        bool cond_bool = (cond != 0) ? true : false;
-
-                        if (cond_bool) {
-                            pc += val;
-                            skip_auto_pc_incr = true;
-                        }
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "jumpif: val=" << val << ", rcond=" << rcond << "\n";
-                            std::cout << "+> cond=" << cond << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x3: { // jump if direct 0010_0011_8-bits-rs_8-bits-skip_8-bits-rcond // TODO not tested
-                        uint32_t rs = instr >> 16 & 0xFF;
-                        uint32_t rcond = instr & 0xFF;
-
-                        int32_t cond = regs[rcond];
-                        bool cond_bool = (cond != 0) ? true : false;
-
-                        if (cond_bool) {
-                            pc += (int32_t) regs[rs];
-                            skip_auto_pc_incr = true;
-                        }
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "jumpif: rs=" << rs << ", rcond=" << rcond << "\n";
-                            std::cout << "+> value_at_rs=" << to_signed(regs[rs]) << ", cond=" << cond << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x4: { // return
-                        if (ret_stack.empty()) {
-                            if (DEBUG_LEVEL >= 10) {
-                                std::cout << "ret\n";
-                                std::cout << "+> return stack empty, ignoring\n"; 
-                            }
-                        } else {
-                            uint32_t ret_addr = ret_stack.top();
-                            pc = ret_addr;
-                            skip_auto_pc_incr = true;
-                            ret_stack.pop();
-
-                            if (DEBUG_LEVEL >= 10) {
-                                std::cout << "ret\n";
-                                std::cout << "+> pc = " << ret_addr << "\n";
-                            }
-                        }
-                        break;
-                    }
-
-                    case 0x5: { // end
-                        std::cout << "End of program\n";
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "\nMemory map after 0x0100\n----------------\n";
-                            for (auto it=mem.begin(); it!=mem.end(); ++it) {
-                                if (it->first >= 0x100) {
-                                    std::cout << "Address: " << it->first << ", Value: " << to_signed(it->second) << "\n";
-                                }
-                            }
-                        }
-
-                        return;
-                        // break; // not necessary
-                    }
-
-                    case 0x6: { // branch unconditionally immediate
-                        int32_t val = instr & 0xFFFFFF; // 24 bits address offset
-
-                        // sign extend
-                        if ((val >> 23 & 0b1) == 1) { // if negative
-                            val = sign_extend(val, 24);
-                        }
-
-                        ret_stack.push(pc + 4);
-                        pc += val;
-                        skip_auto_pc_incr = true;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "br: val=" << val << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x7: { // branch if immediate
-                        int32_t val = instr >> 8 & 0xFFFF;
-                        uint32_t rcond = instr & 0xFF;
-
-                        // sign extend
-                        if ((val >> 15 & 0b1) == 1) { // if negative
-                            val = sign_extend(val, 16);
-                        }
-
-                        int32_t cond = regs[rcond];
-                        bool cond_bool = (cond != 0) ? true : false;
-
-                        if (cond_bool) {
-                            ret_stack.push(pc + 4);
-                            pc += val;
-                            skip_auto_pc_incr = true;
-                        }
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "brif: val=" << val << ", rcond=" << rcond << "\n";
-                            std::cout << "+> cond=" << cond << "\n";
-                        }
-                        break;
-                    }
-
-                    default: {
-                        std::cerr << "Error: invalid instruction: 0x" << get_instr_as_hex(instr) << "\n";
-                        return;
-                    }
-                }
+    if (any_budget) {
+        return StopReason::BUDGET;
+    } else if (first_stopped != nullptr) {
+        return first_stopped->reason;
+    }
+    return harts[0]->reason;
+}
+
+uint64_t Yuemu::instructions_executed() const {
+    uint64_t total = 0;
+    for (const auto& hart : harts) {
+        total += hart->executed;
+    }
+    return total;
+}
+
+Yuemu::StopReason Yuemu::run_hart(Hart& hart, uint64_t max_instructions) {
+    if (recorder != nullptr) {
+        return run_recorded(hart, max_instructions);
+    }
+    hart.budget = max_instructions;
+    hart.run_budget = max_instructions;
+    StopReason reason;
+    if (trace_writer != nullptr && trace_writer->is_open()) {
+        reason = run_loop<TRACE_BINARY>(hart);
+    } else if (options.trace_level >= 11) {
+        reason = run_loop<11>(hart);
+    } else if (options.trace_level >= 10) {
+        reason = run_loop<10>(hart);
+    } else if (profiler != nullptr) {
+        reason = run_loop<PROFILE>(hart);
+    } else if (timing != nullptr) {
+        reason = run_loop<TIMING>(hart);
+    } else if (!watchpoints.empty()) {
+        reason = run_loop<WATCH>(hart);
+    } else {
+        reason = run_loop<0>(hart);
+    }
+    hart.executed += max_instructions - hart.budget;
+    hart.reason = reason;
+    return reason;
+}
+
+// Runs in slices that end at every checkpoint and where a replay catches up
+// with the end of the recording, the first run starts the recording
+Yuemu::StopReason Yuemu::run_recorded(Hart& hart, uint64_t max_instructions) {
+    if (!recorder->started()) {
+        recorder->checkpoint(hart, devices);
+    }
+    StopReason reason;
+    uint64_t left = max_instructions;
+    do {
+        bool replaying = hart.executed < recorder->end();
+        uint64_t slice = std::min(left, recorder->next_checkpoint() - hart.executed);
+        if (replaying) {
+            slice = std::min(slice, recorder->end() - hart.executed);
+        }
+        devices.set_replaying(replaying);
+        hart.budget = slice;
+        hart.run_budget = slice;
+        reason = run_loop<RECORD>(hart);
+        uint64_t done = slice - hart.budget;
+        hart.executed += done;
+        hart.reason = reason;
+        left -= done;
+        recorder->advance(hart.executed);
+        if (hart.executed == recorder->next_checkpoint()) {
+            recorder->checkpoint(hart, devices);
+        }
+    } while (reason == StopReason::BUDGET && left > 0);
+    devices.set_replaying(false);
+    return reason;
+}
+
+bool Yuemu::seek(uint64_t index) {
+    if (recorder == nullptr) {
+        return false;
+    }
+    prepare_run();
+    Hart& hart = *harts[0];
+    if (!recorder->started()) {
+        recorder->checkpoint(hart, devices);
+    }
+    if (index < recorder->start()) {
+        return false;
+    }
+    if (index < hart.executed) {
+        recorder->rewind(index, hart, mem, devices);
+    }
+
+    // neither the stop pc nor breakpoints or watchpoints stop a seek
+    bool had_stop_pc = has_stop_pc;
+    has_stop_pc = false;
+    while (index > hart.executed && !hart.halted()) {
+        StopReason reason = run_recorded(hart, index - hart.executed);
+        if (reason != StopReason::BREAKPOINT && reason != StopReason::WATCHPOINT) {
+            break;
+        }
+    }
+    has_stop_pc = had_stop_pc;
+    devices.flush_console();
+
+    if (!hart.halted()) {
+        hart.reason = StopReason::STOP_PC;
+    }
+    return hart.executed == index;
+}
+
+// Looks for the stop pc, breakpoints and watchpoints one checkpoint interval
+// at a time, newest first: each interval is replayed from its checkpoint up to
+// where the last one began and the last stop in it wins.
+Yuemu::StopReason Yuemu::reverse_continue() {
+    if (recorder == nullptr) {
+        return StopReason::BUDGET;
+    }
+    prepare_run();
+    Hart& hart = *harts[0];
+    if (!recorder->started()) {
+        recorder->checkpoint(hart, devices);
+    }
+
+    uint64_t target = hart.executed;
+    while (has_stop_pc || !breakpoints.empty() || !watchpoints.empty()) {
+        uint64_t from = recorder->checkpoint_before(target);
+        if (from == target) {
+            break;
+        }
+        recorder->rewind(from, hart, mem, devices);
+        uint64_t found = UINT64_MAX;
+        StopReason found_reason = StopReason::BUDGET;
+        while (hart.executed < target) {
+            run_recorded(hart, target - hart.executed);
+            if (!hart.stopped()) {
                 break;
             }
+            if (hart.executed < target) {
+                found = hart.executed;
+                found_reason = hart.reason;
+            }
+        }
+        if (found != UINT64_MAX) {
+            seek(found);
+            // seek() leaves the hart as if at the stop pc, a watchpoint stop is after its instruction though
+            hart.reason = found_reason == StopReason::WATCHPOINT ? StopReason::WATCHPOINT : StopReason::STOP_PC;
+            return found_reason;
+        }
+        target = from;
+    }
+    seek(recorder->start());
+    return StopReason::BUDGET;
+}
 
-            case 0x3: { // logical
-                switch (opcode_id) {
-                    case 0x0: { // and
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        uint32_t val1 = regs[rs1];
-                        uint32_t val2 = regs[rs2];
-                        uint32_t res = val1 & val2;
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "and: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x1: { // or
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        uint32_t val1 = regs[rs1];
-                        uint32_t val2 = regs[rs2];
-                        uint32_t res = val1 | val2;
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "or: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x2: { // nand
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        uint32_t val1 = regs[rs1];
-                        uint32_t val2 = regs[rs2];
-                        uint32_t res = ~(val1 & val2);
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "nand: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x3: { // nor
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        uint32_t val1 = regs[rs1];
-                        uint32_t val2 = regs[rs2];
-                        uint32_t res = ~(val1 | val2);
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "nor: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x4: { // xor
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        uint32_t val1 = regs[rs1];
-                        uint32_t val2 = regs[rs2];
-                        uint32_t res = val1 ^ val2;
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "xor: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
-
-                    default: {
-                        std::cerr << "Error: invalid instruction: 0x" << get_instr_as_hex(instr) << "\n";
-                        return;
-                    }
-                }
-                break;
+// Stores from one hart can hit code another hart has translated. The writer
+// stores first and then looks at the other caches, translation publishes its
+// range first and then reads the code, with a full fence in between on both
+// sides at least one of them sees the other.
+void Yuemu::notify_harts(const Hart& writer, uint32_t addr) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (auto& hart : harts) {
+        if (hart.get() != &writer && hart->block_cache.may_cover(addr)) {
+            hart->block_cache.request_flush();
+        }
+    }
+}
+
+// a file read writes guest memory like a run of stores, code it overwrote is dropped the same way
+bool Yuemu::device_store(Hart& hart, uint32_t addr, uint32_t val) {
+    if (recorder != nullptr && recorder->started() && addr == Devices::FILE_READ) {
+        uint32_t read_addr;
+        uint32_t count = devices.pending_read(read_addr);
+        for (uint32_t i=0; i<count; i++) {
+            recorder->journal(mem, read_addr + i);
+        }
+    }
+    uint32_t written_addr = 0;
+    uint32_t written = devices.store(addr, val, mem, written_addr);
+    bool code_changed = false;
+    for (uint32_t i=0; i<written; i++) {
+        if (harts.size() > 1) {
+            notify_harts(hart, written_addr + i);
+        }
+        code_changed = hart.block_cache.invalidate(written_addr + i) || code_changed;
+    }
+    return code_changed;
+}
+
+// Each trace level gets its own copy of the loop, the quiet one (0) has all
+// tracing compiled out. 10 prints every instruction, 11 adds the registers,
+// TRACE_BINARY only hands a record per instruction to the trace writer and
+// PROFILE only bumps the profiler's counters, TIMING only feeds every
+// fetch, load and store to the timing model and RECORD only journals stores.
+// WATCH only checks loads and stores against the watchpoints, which RECORD
+// does as well once there are any.
+template <int TRACE_LEVEL>
+Yuemu::StopReason Yuemu::run_loop(Hart& hart) {
+    // TODO unsigned and signed types are mixed up for register array and maybe memory map
+    unsigned int& pc = hart.pc;
+    uint32_t* const regs = hart.regs;
+    ReturnStack& ret_stack = hart.ret_stack;
+    BlockCache& block_cache = hart.block_cache;
+    Jit* const jit = hart.jit.get();
+    const AotModule* const aot = this->aot.get();
+
+    Block* block = nullptr;
+    const DecodedOp* op;
+    JitContext jit_ctx = {regs, this, &hart, nullptr};
+
+#if YUEMU_THREADED_DISPATCH
+    static void* const dispatch_table[] = {
+        #define YUEMU_OP_LABEL(name, ...) &&op_##name,
+        YUEMU_OPS(YUEMU_OP_LABEL)
+        #undef YUEMU_OP_LABEL
+    };
+
+    // the host counters' samples tell the handlers apart by their labels
+    if constexpr (TRACE_LEVEL == 0) {
+        if (host_counters != nullptr) {
+            host_counters->set_handlers(dispatch_table, OP_COUNT);
+        }
+    }
+
+    #define HANDLER(name) op_##name
+    #define DISPATCH() goto *dispatch_table[(int) op->op]
+#else
+    #define HANDLER(name) case Op::name
+    #define DISPATCH() goto dispatch
+#endif
+
+    // moves on to the next instruction of the current block
+    #define NEXT() \
+        do { \
+            if constexpr (TRACE_LEVEL >= 11) { \
+                print_registers(hart, pc - 4); \
+            } \
+            op++; \
+            DISPATCH(); \
+        } while (0)
+
+    // moves past both instructions of a fused pair
+    #define NEXT_PAIR() \
+        do { \
+            op += 2; \
+            DISPATCH(); \
+        } while (0)
+
+    // pc of the instruction at op
+    #define OP_PC() (block->start_pc + 4 * (uint32_t) (op - block->ops.data()))
+
+    // hands the instruction at op to the binary trace, the profiler or the timing model
+    #define TRACE_RECORD(value, addr) \
+        do { \
+            if constexpr (TRACE_LEVEL == TRACE_BINARY) { \
+                size_t index = op - block->ops.data(); \
+                trace_writer->record(block->start_pc + 4 * index, block->words[index], value, addr); \
+            } else if constexpr (TRACE_LEVEL == PROFILE) { \
+                profiler->count(OP_PC(), block->words[op - block->ops.data()]); \
+            } else if constexpr (TRACE_LEVEL == TIMING) { \
+                timing->fetch(hart.id, OP_PC()); \
+            } \
+        } while (0)
+
+    // counts conditional branches for the profiler
+    #define PROFILE_BRANCH(taken) \
+        do { \
+            if constexpr (TRACE_LEVEL == PROFILE) { \
+                profiler->branch(OP_PC(), taken); \
+            } \
+        } while (0)
+
+    // hands a load or store to the profiler or the timing model
+    #define RECORD_ACCESS(kind, addr) \
+        do { \
+            if constexpr (TRACE_LEVEL == PROFILE) { \
+                profiler->kind(addr); \
+            } else if constexpr (TRACE_LEVEL == TIMING) { \
+                timing->kind(hart.id, addr); \
+            } \
+        } while (0)
+
+    // follows br, brif and ret through the call tree, after the instruction was counted
+    #define PROFILE_CALL(target) \
+        do { \
+            if constexpr (TRACE_LEVEL == PROFILE) { \
+                profiler->call(OP_PC(), target); \
+            } \
+        } while (0)
+
+    #define PROFILE_RETURN() \
+        do { \
+            if constexpr (TRACE_LEVEL == PROFILE) { \
+                profiler->ret(); \
+            } \
+        } while (0)
+
+    // hands the word a store is about to overwrite to the undo journal, file
+    // reads journal their own words in device_store
+    #define JOURNAL_STORE(addr) \
+        do { \
+            if constexpr (TRACE_LEVEL == RECORD) { \
+                if (!Devices::is_device(addr)) { \
+                    recorder->journal(mem, addr); \
+                } \
+            } \
+        } while (0)
+
+    // loads through a register can reach the devices, direct loads can't
+    #define LOAD(addr, load_pc) \
+        (Devices::is_device(addr) \
+            ? devices.load(hart.id, addr, hart.executed + hart.run_budget - hart.budget - (block->end_pc - (load_pc)) / 4) \
+            : mem.read(addr))
+
+    // leaves the block early, after a store overwrote part of it, the
+    // instructions it skips go back to the budget
+    #define LEAVE_BLOCK() \
+        do { \
+            if constexpr (TRACE_LEVEL >= 11) { \
+                print_registers(hart, pc - 4); \
+            } \
+            hart.budget += (block->end_pc - pc) / 4; \
+            goto block_exit; \
+        } while (0)
+
+    // stops right after a load or store that hit a watchpoint, only accesses
+    // to a page tagged as watched look any further
+    #define WATCH_ACCESS(kind, addr) \
+        do { \
+            if constexpr (TRACE_LEVEL == WATCH || TRACE_LEVEL == RECORD) { \
+                if ((TRACE_LEVEL == WATCH || !watchpoints.empty()) && mem.watched(addr) && watch_hit(hart, addr, kind)) { \
+                    hart.budget += (block->end_pc - pc) / 4; \
+                    return StopReason::WATCHPOINT; \
+                } \
+            } \
+        } while (0)
+
+    // leaves the block through the control instruction that ends it, the
+    // register dump has always shown the new pc for taken jumps
+    #define EXIT_BLOCK(pc_debug) \
+        do { \
+            if constexpr (TRACE_LEVEL >= 11) { \
+                print_registers(hart, pc_debug); \
+            } \
+            goto block_exit; \
+        } while (0)
+
+    // a hart that stopped at the stop pc or a breakpoint runs the instruction
+    // there on its own, unpatched, before looking again
+    if (hart.reason != StopReason::STOP_PC && hart.reason != StopReason::BREAKPOINT) goto block_exit;
+    if (pc == halt_pc) goto finished;
+    if (hart.budget == 0) {
+        return hart.reason;
+    }
+    block_cache.translate_one(pc, hart.single_step, false);
+    block = &hart.single_step;
+    goto block_run;
+
+block_exit:
+    if (pc == halt_pc) goto finished;
+    if (has_stop_pc && pc == stop_pc) {
+        return StopReason::STOP_PC;
+    }
+    block_cache.handle_flush_request();
+    {
+        // the single step block is rebuilt every time, it never links
+        bool linkable = block != nullptr && block != &hart.single_step;
+        Block* next = linkable ? block->successor(pc) : nullptr;
+        if (next == nullptr) {
+            next = block_cache.lookup(pc);
+            if (linkable) {
+                block->link(pc, next);
+            }
+        }
+        block = next;
+        block_cache.release_retired();
+    }
+
+    // the budget is charged a whole block at a time, a block that doesn't
+    // fit any more runs one instruction at a time
+    if (block->instr_count() > hart.budget) {
+        if (hart.budget == 0) {
+            return StopReason::BUDGET;
+        }
+        block_cache.translate_one(pc, hart.single_step);
+        block = &hart.single_step;
+    }
+block_run:
+    hart.budget -= block->instr_count();
+
+    // compiled blocks hand back the next pc, they can't trace so they only run quietly.
+    // Translated code is taken on the first run, the JIT compiles what it doesn't cover.
+    if (TRACE_LEVEL == 0 && (jit != nullptr || aot != nullptr)) {
+        if (block->jit_code == nullptr) {
+            ++block->exec_count;
+            if (aot != nullptr && block->exec_count == 1) {
+                block->jit_code = aot->lookup(*block);
+            } else if (jit != nullptr && block->exec_count == Jit::HOT_THRESHOLD) {
+                block->jit_code = jit->compile(*block);
+            }
+        }
+        if (block->jit_code != nullptr) {
+            jit_ctx.block = block;
+            pc = block->jit_code(&jit_ctx);
+            if (!block->valid) {
+                hart.budget += (block->end_pc - pc) / 4;
+            }
+            // only the br or brif that ends the block can push
+            if (ret_stack.overflowed()) {
+                pc = block->end_pc - 4;
+                return StopReason::STACK_OVERFLOW;
             }
+            goto block_exit;
+        }
+    }
+
+    op = block->ops.data();
+
+#if YUEMU_THREADED_DISPATCH
+    DISPATCH();
+    {
+#else
+dispatch:
+    switch (op->op) {
+#endif
+        HANDLER(LOADI): { // load immediate
+            uint32_t rd = op->rd;
+            uint32_t val = op->imm;
+            regs[rd] = val;
+            TRACE_RECORD(val, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "loadm: rd=" << rd << ", val=" << to_signed(val) << "\n";
+            }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(LOADR): { // load register indirect
+            uint32_t rd = op->rd;
+            uint32_t raddr = op->rs1;
+            uint32_t addr = regs[raddr];
+            regs[rd] = LOAD(addr, pc);
+            TRACE_RECORD(regs[rd], addr);
+            RECORD_ACCESS(load, addr);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "loadr: rd=" << rd << ", raddr=" << raddr << "\n";
+                *out << "+> value_of_addr=" << regs[raddr] << ", value_at_addr=" << mem.read(regs[raddr]) << "\n";
+            }
+            pc += 4;
+            WATCH_ACCESS(WATCH_READ, addr);
+            NEXT();
+        }
+
+        HANDLER(STOREN): { // store to the address held in a register
+            uint32_t raddr = op->rs1;
+            uint32_t rs = op->rs2;
+            JOURNAL_STORE(regs[raddr]);
+            bool code_changed = store(hart, regs[raddr], regs[rs]);
+            TRACE_RECORD(regs[rs], regs[raddr]);
+            RECORD_ACCESS(store, regs[raddr]);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "storen: raddr=" << raddr << ", rs=" << rs << "\n";
+                *out << "+> value_at_rs=" << to_signed(regs[rs]) << "\n";
+            }
+            pc += 4;
+            WATCH_ACCESS(WATCH_WRITE, regs[raddr]);
+            if (code_changed && !block->valid) {
+                LEAVE_BLOCK();
+            }
+            NEXT();
+        }
+
+        HANDLER(STORED): { // store direct
+            uint32_t addr = op->imm;
+            uint32_t rs = op->rs2;
+            JOURNAL_STORE(addr);
+            bool code_changed = store(hart, addr, regs[rs]);
+            TRACE_RECORD(regs[rs], addr);
+            RECORD_ACCESS(store, addr);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "stored: addr=" << addr << ", rs=" << rs << "\n";
+                *out << "+> value_at_rs=" << to_signed(regs[rs]) << "\n";
+            }
+            pc += 4;
+            WATCH_ACCESS(WATCH_WRITE, addr);
+            if (code_changed && !block->valid) {
+                LEAVE_BLOCK();
+            }
+            NEXT();
+        }
+
+        HANDLER(LOADD): { // load direct
+            uint32_t rd = op->rd;
+            uint32_t addr = op->imm;
+            regs[rd] = mem.read(addr);
+            TRACE_RECORD(regs[rd], addr);
+            RECORD_ACCESS(load, addr);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "loadd: rd=" << rd << ", raddr=" << addr << "\n";
+                *out << "+> value_at_addr=" << mem.read(addr) << "\n";
+            }
+            pc += 4;
+            WATCH_ACCESS(WATCH_READ, addr);
+            NEXT();
+        }
+
+        HANDLER(ADD): {
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            uint32_t val1 = regs[rs1];
+            uint32_t val2 = regs[rs2];
+            uint32_t res = val1 + val2;
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "add: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(SUB): {
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            int32_t val1 = regs[rs1];
+            int32_t val2 = regs[rs2];
+            int32_t res = val1 - val2;
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "sub: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(MUL): {
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            uint32_t val1 = regs[rs1];
+            uint32_t val2 = regs[rs2];
+            uint32_t res = val1 * val2;
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "mul: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(DIV): {
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
 
-            case 0x4: { // shift
-                switch (opcode_id) {
-                    case 0x0: { // lshift
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        uint32_t val1 = regs[rs1];
-                        uint32_t val2 = regs[rs2];
-                        uint32_t res = val1 << val2;
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "lshift: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x1: { // rshift
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        uint32_t val1 = regs[rs1];
-                        uint32_t val2 = regs[rs2];
-                        uint32_t res = val1 >> val2;
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "rshift: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
+            uint32_t val1 = regs[rs1];
+            uint32_t val2 = regs[rs2];
+            uint32_t res = val1 / val2;
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "div: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(JUMP): { // jump unconditionally immediate // TODO not tested
+            int32_t val = op->imm;
+            pc += val;
+            TRACE_RECORD(pc, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "jump: val=" << val << "\n";
+            }
+            EXIT_BLOCK(pc);
+        }
+
+        HANDLER(JUMPDIR): { // jump unconditionally direct // TODO not tested
+            uint32_t rs = op->rs1;
+            pc += (int32_t) regs[rs];
+            TRACE_RECORD(pc, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "jumpdir: rs=" << rs << "\n";
+                *out << "+> value_at_rs=" << to_signed(regs[rs]) << "\n";
+            }
+            EXIT_BLOCK(pc);
+        }
+
+        HANDLER(JUMPIF): { // jump if immediate
+            int32_t val = op->imm;
+            uint32_t rcond = op->rs2;
+
+            int32_t cond = regs[rcond];
+            if (cond != 0) {
+                pc += val;
+            } else {
+                pc += 4;
+            }
+
+            TRACE_RECORD(pc, 0);
+            PROFILE_BRANCH(cond != 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "jumpif: val=" << val << ", rcond=" << rcond << "\n";
+                *out << "+> cond=" << cond << "\n";
+            }
+            EXIT_BLOCK((cond != 0) ? pc : pc - 4);
+        }
+
+        HANDLER(JUMPIFDIR): { // jump if direct // TODO not tested
+            uint32_t rs = op->rs1;
+            uint32_t rcond = op->rs2;
+
+            int32_t cond = regs[rcond];
+            if (cond != 0) {
+                pc += (int32_t) regs[rs];
+            } else {
+                pc += 4;
+            }
+
+            TRACE_RECORD(pc, 0);
+            PROFILE_BRANCH(cond != 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "jumpif: rs=" << rs << ", rcond=" << rcond << "\n";
+                *out << "+> value_at_rs=" << to_signed(regs[rs]) << ", cond=" << cond << "\n";
+            }
+            EXIT_BLOCK((cond != 0) ? pc : pc - 4);
+        }
+
+        HANDLER(RET): {
+            if (ret_stack.empty()) {
+                pc += 4;
+                TRACE_RECORD(pc, 1);
+
+                if constexpr (TRACE_LEVEL >= 10) {
+                    *out << "ret\n";
+                    *out << "+> return stack empty, ignoring\n"; 
                 }
-                break;
+                EXIT_BLOCK(pc - 4);
+            } else {
+                uint32_t ret_addr = ret_stack.top();
+                pc = ret_addr;
+                ret_stack.pop();
+                TRACE_RECORD(pc, 0);
+                PROFILE_RETURN();
+
+                if constexpr (TRACE_LEVEL >= 10) {
+                    *out << "ret\n";
+                    *out << "+> pc = " << ret_addr << "\n";
+                }
+                EXIT_BLOCK(pc);
+            }
+        }
+
+        HANDLER(END): {
+            TRACE_RECORD(0, 0);
+            return StopReason::END;
+        }
+
+        HANDLER(BR): { // branch unconditionally immediate
+            int32_t val = op->imm;
+            if (!ret_stack.push(pc + 4)) {
+                return StopReason::STACK_OVERFLOW;
+            }
+            pc += val;
+            TRACE_RECORD(pc, 0);
+            PROFILE_CALL(pc);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "br: val=" << val << "\n";
             }
+            EXIT_BLOCK(pc);
+        }
+
+        HANDLER(BRIF): { // branch if immediate
+            int32_t val = op->imm;
+            uint32_t rcond = op->rs2;
 
-            case 0x5: { // comparison
-                switch (opcode_id) {
-                    case 0x0: { // less than
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        int32_t val1 = regs[rs1];
-                        int32_t val2 = regs[rs2];
-                        bool res_bool = val1 < val2;
-                        int32_t res = res_bool ? 1 : 0;
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "lt: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x1: { // less than or equal to
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        int32_t val1 = regs[rs1];
-                        int32_t val2 = regs[rs2];
-                        bool res_bool = val1 <= val2;
-                        int32_t res = res_bool ? 1 : 0;
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "lte: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x2: { // greater than
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        int32_t val1 = regs[rs1];
-                        int32_t val2 = regs[rs2];
-                        bool res_bool = val1 > val2;
-                        int32_t res = res_bool ? 1 : 0;
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "gt: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x3: { // greater than or equal to
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        int32_t val1 = regs[rs1];
-                        int32_t val2 = regs[rs2];
-                        bool res_bool = val1 >= val2;
-                        int32_t res = res_bool ? 1 : 0;
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "gte: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
-
-                    case 0x4: { // equal to
-                        uint32_t rd = instr >> 16 & 0xFF;
-                        uint32_t rs1 = instr >> 8 & 0xFF;
-                        uint32_t rs2 = instr & 0xFF;
-
-                        int32_t val1 = regs[rs1];
-                        int32_t val2 = regs[rs2];
-                        bool res_bool = val1 == val2;
-                        int32_t res = res_bool ? 1 : 0;
-                        regs[rd] = res;
-
-                        if (DEBUG_LEVEL >= 10) {
-                            std::cout << "eq: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
-                            std::cout << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
-                        }
-                        break;
-                    }
+            int32_t cond = regs[rcond];
+            if (cond != 0) {
+                if (!ret_stack.push(pc + 4)) {
+                    return StopReason::STACK_OVERFLOW;
                 }
-                break;            
+                pc += val;
+            } else {
+                pc += 4;
             }
 
-            default: {
-                std::cerr << "Error: invalid instruction: 0x" << get_instr_as_hex(instr) << "\n";
-                return;
+            TRACE_RECORD(pc, 0);
+            PROFILE_BRANCH(cond != 0);
+            if (cond != 0) {
+                PROFILE_CALL(pc);
             }
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "brif: val=" << val << ", rcond=" << rcond << "\n";
+                *out << "+> cond=" << cond << "\n";
+            }
+            EXIT_BLOCK((cond != 0) ? pc : pc - 4);
         }
 
-        uint32_t pc_debug = pc;
-        if (!skip_auto_pc_incr) {
+        HANDLER(AND): {
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            uint32_t val1 = regs[rs1];
+            uint32_t val2 = regs[rs2];
+            uint32_t res = val1 & val2;
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "and: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
             pc += 4;
+            NEXT();
         }
-        skip_auto_pc_incr = false;
 
-        if (DEBUG_LEVEL >= 11) {
-            std::cout << "########\n";
-            std::cout << "PC: " << pc_debug << ", Instruction Count: " << read_instr_count << "\n";
-            std::cout << "First 8 registers:\n";
-            std::cout << "[0]: " << to_signed(regs[0]) << "\n";
-            std::cout << "[1]: " << to_signed(regs[1]) << "\n";
-            std::cout << "[2]: " << to_signed(regs[2]) << "\n";
-            std::cout << "[3]: " << to_signed(regs[3]) << "\n";
-            std::cout << "[4]: " << to_signed(regs[4]) << "\n";
-            std::cout << "[5]: " << to_signed(regs[5]) << "\n";
-            std::cout << "[6]: " << to_signed(regs[6]) << "\n";
-            std::cout << "[7]: " << to_signed(regs[7]) << "\n";
-            std::cout << "########\n";
+        HANDLER(OR): {
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            uint32_t val1 = regs[rs1];
+            uint32_t val2 = regs[rs2];
+            uint32_t res = val1 | val2;
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "or: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
+            pc += 4;
+            NEXT();
         }
-        
-    }
 
-    std::cout << "Finished running program\n";
+        HANDLER(NAND): {
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            uint32_t val1 = regs[rs1];
+            uint32_t val2 = regs[rs2];
+            uint32_t res = ~(val1 & val2);
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "nand: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(NOR): {
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            uint32_t val1 = regs[rs1];
+            uint32_t val2 = regs[rs2];
+            uint32_t res = ~(val1 | val2);
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "nor: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(XOR): {
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            uint32_t val1 = regs[rs1];
+            uint32_t val2 = regs[rs2];
+            uint32_t res = val1 ^ val2;
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "xor: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(LSHIFT): {
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            uint32_t val1 = regs[rs1];
+            uint32_t val2 = regs[rs2];
+            uint32_t res = val1 << val2;
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "lshift: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(RSHIFT): {
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            uint32_t val1 = regs[rs1];
+            uint32_t val2 = regs[rs2];
+            uint32_t res = val1 >> val2;
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "rshift: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(LT): { // less than
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            int32_t val1 = regs[rs1];
+            int32_t val2 = regs[rs2];
+            int32_t res = val1 < val2 ? 1 : 0;
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "lt: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(LTE): { // less than or equal to
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            int32_t val1 = regs[rs1];
+            int32_t val2 = regs[rs2];
+            int32_t res = val1 <= val2 ? 1 : 0;
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "lte: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(GT): { // greater than
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            int32_t val1 = regs[rs1];
+            int32_t val2 = regs[rs2];
+            int32_t res = val1 > val2 ? 1 : 0;
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "gt: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(GTE): { // greater than or equal to
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            int32_t val1 = regs[rs1];
+            int32_t val2 = regs[rs2];
+            int32_t res = val1 >= val2 ? 1 : 0;
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
 
-    if (DEBUG_LEVEL >= 10) {
-        std::cout << "\nMemory map after 0x0100\n----------------\n";
-        for (auto it=mem.begin(); it!=mem.end(); ++it) {
-            if (it->first >= 0x100) {
-                std::cout << "Address: " << it->first << ", Value: " << to_signed(it->second) << "\n";
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "gte: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
             }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(EQ): { // equal to
+            uint32_t rd = op->rd;
+            uint32_t rs1 = op->rs1;
+            uint32_t rs2 = op->rs2;
+
+            int32_t val1 = regs[rs1];
+            int32_t val2 = regs[rs2];
+            int32_t res = val1 == val2 ? 1 : 0;
+            regs[rd] = res;
+            TRACE_RECORD(res, 0);
+
+            if constexpr (TRACE_LEVEL >= 10) {
+                *out << "eq: rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+                *out << "+> val1=" << to_signed(val1) << ", val2=" << to_signed(val2) << ", res=" << to_signed(res) << "\n";
+            }
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(NOP): { // unknown shift and comparison ids
+            TRACE_RECORD(0, 0);
+            pc += 4;
+            NEXT();
+        }
+
+        HANDLER(BLOCK_END): {
+            goto block_exit;
+        }
+
+        HANDLER(INVALID): {
+            TRACE_RECORD(0, 0);
+            hart.invalid_instr = op->imm;
+            return StopReason::INVALID;
+        }
+
+        HANDLER(BREAKPOINT): { // the instruction under it hasn't run, it goes back to the budget with the rest
+            hart.budget += (block->end_pc - pc) / 4;
+            return StopReason::BREAKPOINT;
+        }
+
+        // Fused pairs, op[1] is the second instruction. Blocks only hold them
+        // when nothing traces or profiles, so they never record anything.
+        #define COMPARE_JUMPIF(cmp) \
+            { \
+                int32_t val1 = regs[op->rs1]; \
+                int32_t val2 = regs[op->rs2]; \
+                int32_t res = val1 cmp val2 ? 1 : 0; \
+                regs[op->rd] = res; \
+                pc += (res != 0) ? 4 + (int32_t) op[1].imm : 8; \
+                EXIT_BLOCK(pc); \
+            }
+
+        HANDLER(LT_JUMPIF): COMPARE_JUMPIF(<)
+        HANDLER(LTE_JUMPIF): COMPARE_JUMPIF(<=)
+        HANDLER(GT_JUMPIF): COMPARE_JUMPIF(>)
+        HANDLER(GTE_JUMPIF): COMPARE_JUMPIF(>=)
+        HANDLER(EQ_JUMPIF): COMPARE_JUMPIF(==)
+        #undef COMPARE_JUMPIF
+
+        #define LOADI_ALU(expr) \
+            { \
+                regs[op->rd] = op->imm; \
+                uint32_t val1 = regs[op[1].rs1]; \
+                uint32_t val2 = regs[op[1].rs2]; \
+                regs[op[1].rd] = expr; \
+                pc += 8; \
+                NEXT_PAIR(); \
+            }
+
+        HANDLER(LOADI_ADD): LOADI_ALU(val1 + val2)
+        HANDLER(LOADI_SUB): LOADI_ALU(val1 - val2)
+        HANDLER(LOADI_MUL): LOADI_ALU(val1 * val2)
+        HANDLER(LOADI_AND): LOADI_ALU(val1 & val2)
+        HANDLER(LOADI_OR): LOADI_ALU(val1 | val2)
+        HANDLER(LOADI_XOR): LOADI_ALU(val1 ^ val2)
+        HANDLER(LOADI_LSHIFT): LOADI_ALU(val1 << val2)
+        HANDLER(LOADI_RSHIFT): LOADI_ALU(val1 >> val2)
+        #undef LOADI_ALU
+
+        HANDLER(ADD_LOADR): {
+            uint32_t addr = regs[op->rs1] + regs[op->rs2];
+            regs[op->rd] = addr;
+            regs[op[1].rd] = LOAD(addr, pc + 4);
+            pc += 8;
+            NEXT_PAIR();
+        }
+
+        HANDLER(ADD_STOREN): {
+            uint32_t addr = regs[op->rs1] + regs[op->rs2];
+            regs[op->rd] = addr;
+            bool code_changed = store(hart, addr, regs[op[1].rs2]);
+            pc += 8;
+            if (code_changed && !block->valid) {
+                LEAVE_BLOCK();
+            }
+            NEXT_PAIR();
         }
     }
+
+    #undef EXIT_BLOCK
+    #undef WATCH_ACCESS
+    #undef LEAVE_BLOCK
+    #undef LOAD
+    #undef JOURNAL_STORE
+    #undef PROFILE_RETURN
+    #undef PROFILE_CALL
+    #undef RECORD_ACCESS
+    #undef PROFILE_BRANCH
+    #undef TRACE_RECORD
+    #undef OP_PC
+    #undef NEXT_PAIR
+    #undef NEXT
+    #undef DISPATCH
+    #undef HANDLER
+
+finished:
+    return StopReason::FINISHED;
 }
 
-void Yuemu::read_file_to_memory(std::string fpath) {
-    std::cout << "Reading program: " << fpath << "\n";
-    std::ifstream bin_file(fpath);
+void Yuemu::print_registers(const Hart& hart, uint32_t pc_debug) {
+    const uint32_t* regs = hart.regs;
+    *out << "########\n";
+    *out << "PC: " << pc_debug;
+    std::string symbol = symbols.describe(pc_debug);
+    if (!symbol.empty()) {
+        *out << " (" << symbol << ")";
+    }
+    *out << ", Instruction Count: " << halt_pc << "\n";
+    *out << "First 8 registers:\n";
+    *out << "[0]: " << to_signed(regs[0]) << "\n";
+    *out << "[1]: " << to_signed(regs[1]) << "\n";
+    *out << "[2]: " << to_signed(regs[2]) << "\n";
+    *out << "[3]: " << to_signed(regs[3]) << "\n";
+    *out << "[4]: " << to_signed(regs[4]) << "\n";
+    *out << "[5]: " << to_signed(regs[5]) << "\n";
+    *out << "[6]: " << to_signed(regs[6]) << "\n";
+    *out << "[7]: " << to_signed(regs[7]) << "\n";
+    *out << "########\n";
+}
 
-    for (int32_t i=0; !bin_file.eof(); i+=4) {
-        char cb3, cb2, cb1, cb0;
-        bin_file.get(cb3);
-        bin_file.get(cb2);
-        bin_file.get(cb1);
-        bin_file.get(cb0);
-        unsigned char b3, b2, b1, b0;
-        b3 = (unsigned char) cb3;
-        b2 = (unsigned char) cb2;
-        b1 = (unsigned char) cb1;
-        b0 = (unsigned char) cb0;
+void Yuemu::print_memory_map() {
+    *out << "\nMemory map after 0x0100\n----------------\n";
+    mem.for_each_word([this](uint32_t addr, uint32_t val) {
+        if (addr >= 0x100) {
+            *out << "Address: " << addr << ", Value: " << to_signed(val) << "\n";
+        }
+    });
+}
 
-        uint32_t instr = 0;
-        instr += b3 << 24;
-        instr += b2 << 16;
-        instr += b1 << 8;
-        instr += b0;
+// a dump holds what the program wrote, printing the map walks every word ever written
+void Yuemu::dump_memory() {
+    HostCounters::Scope phase(host_counters.get(), HostCounters::DUMP);
+    if (options.dump_file.empty()) {
+        print_memory_map();
+    } else if (save_dump(options.dump_file)) {
+        *out << "\nMemory dump written to " << options.dump_file << "\n";
+    }
+}
 
-        mem[read_instr_count] = instr;
-        read_instr_count += 4;
+// prints the hotspot report once every hart has halted and writes the counts out
+void Yuemu::print_reports() {
+    HostCounters::Scope phase(host_counters.get(), HostCounters::DUMP);
+    if (host_counters != nullptr && !host_counters->write(options.host_counters_file, instructions_executed())) {
+        *err << "Error: can't write host counters file: " << options.host_counters_file << "\n";
+    }
+    if (timing != nullptr) {
+        timing->print_report(*out);
+    }
+    if (profiler == nullptr) {
+        return;
+    }
+    profiler->print_report(*out);
+    if (!options.profile_file.empty() && !profiler->write(options.profile_file)) {
+        *err << "Error: can't write profile file: " << options.profile_file << "\n";
+    }
+    if (!options.callgraph_file.empty() && !profiler->write_folded(options.callgraph_file)) {
+        *err << "Error: can't write call graph file: " << options.callgraph_file << "\n";
+    }
+}
+
+bool Yuemu::read_file_to_memory(std::string fpath) {
+    *out << "Reading program: " << fpath << "\n";
+
+#if defined(__unix__)
+    int fd = open(fpath.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        *err << "Error: can't open program file: " << fpath << "\n";
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    uint64_t size = st.st_size;
+
+    bool ok;
+    if (size == 0 || size > 0xFFFFFFFC) {
+        ok = load_image(nullptr, size); // only reports the bad size
+    } else {
+        void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            *err << "Error: can't map program file: " << fpath << "\n";
+            ok = false;
+        } else {
+            madvise(data, size, MADV_SEQUENTIAL);
+            ok = load_image((const uint8_t*) data, size);
+            munmap(data, size);
+        }
+    }
+    close(fd);
+#else
+    std::ifstream bin_file(fpath, std::ios::binary | std::ios::ate);
+    if (!bin_file) {
+        *err << "Error: can't open program file: " << fpath << "\n";
+        return false;
+    }
+    uint64_t size = bin_file.tellg();
+
+    bool ok;
+    if (size == 0 || size > 0xFFFFFFFC) {
+        ok = load_image(nullptr, size);
+    } else {
+        std::vector<char> data(size);
+        bin_file.seekg(0);
+        bin_file.read(data.data(), size);
+        ok = load_image((const uint8_t*) data.data(), size);
+    }
+#endif
+
+    if (!ok) {
+        return false;
+    }
+    *out << "Finished reading program\n\n";
+    return true;
+}
+
+// a raw image is a stream of big-endian words loaded from address 0, its
+// size is also where the program halts so it has to fit the address space
+bool Yuemu::load_image(const uint8_t* image, uint64_t size) {
+    if (image != nullptr && Executable::is_executable(image, size)) {
+        return load_executable(image, size);
+    }
+    if (size % 4 != 0) {
+        *err << "Error: program size " << size << " is not a multiple of 4 bytes\n";
+        return false;
+    } else if (size > 0xFFFFFFFC) {
+        *err << "Error: program is too large for the 32-bit address space\n";
+        return false;
+    }
+
+    if (size > 0) {
+        mem.write_program_words(0, image, size / 4);
+    }
+    halt_pc = size;
+    code_start = 0;
+    code_bytes = size;
+
+    if (options.trace_level >= 10) {
+        for (uint32_t addr=0; addr<halt_pc; addr+=4) {
+            *out << "Read instruction: " << get_instr_as_hex(mem.read(addr)) << "\n";
+        }
+    }
+    return true;
+}
+
+// the segments go from the image straight into guest memory, zero segments
+// are left to the zero page
+bool Yuemu::load_executable(const uint8_t* image, uint64_t size) {
+    Executable exe;
+    if (!exe.parse(image, size, *err)) {
+        return false;
+    }
 
-        if (DEBUG_LEVEL >= 10) {
-            std::cout << "Read instruction: " << get_instr_as_hex(instr) << "\n";
+    for (const Executable::Segment& segment : exe.segments) {
+        if (segment.words == 0) {
+            continue;
         }
+        if (segment.kind == Executable::SegmentKind::CODE) {
+            mem.write_program_words(segment.addr, segment.data, segment.words);
+        } else if (segment.kind == Executable::SegmentKind::DATA) {
+            mem.write_data_words(segment.addr, segment.data, segment.words);
+        }
+    }
+
+    halt_pc = exe.halt_pc;
+    std::pair<uint32_t, uint64_t> code = exe.code_range();
+    code_start = code.first;
+    code_bytes = code.second - code.first;
+    for (auto& hart : harts) {
+        hart->pc = exe.entry;
+    }
+    symbols = std::move(exe.symbols);
+
+    if (options.trace_level >= 10) {
+        for (const Executable::Segment& segment : exe.segments) {
+            for (uint32_t i=0; segment.kind == Executable::SegmentKind::CODE && i<segment.words; i++) {
+                *out << "Read instruction: " << get_instr_as_hex(mem.read(segment.addr + 4 * i)) << "\n";
+            }
+        }
+    }
+    return true;
+}
+
+// compiled blocks don't keep pc up to date, the instruction counter stops at the start of the block
+uint32_t Yuemu::jit_load(JitContext* ctx, uint32_t addr) {
+    Yuemu* self = static_cast<Yuemu*>(ctx->emu);
+    if (Devices::is_device(addr)) {
+        Hart* hart = static_cast<Hart*>(ctx->hart);
+        return self->devices.load(hart->id, addr, hart->executed + hart->run_budget - hart->budget - ctx->block->instr_count());
     }
-    std::cout << "Finished reading program\n\n";
+    return self->mem.read(addr);
+}
 
-    read_instr_count -= 4;
-    bin_file.close();
+uint32_t Yuemu::jit_store(JitContext* ctx, uint32_t addr, uint32_t val) {
+    Yuemu* self = static_cast<Yuemu*>(ctx->emu);
+    Hart* hart = static_cast<Hart*>(ctx->hart);
+    return self->store(*hart, addr, val) && !ctx->block->valid;
+}
+
+// a full stack is noticed by the run loop once the compiled block returns
+void Yuemu::jit_push_ret(JitContext* ctx, uint32_t ret_addr) {
+    Hart* hart = static_cast<Hart*>(ctx->hart);
+    hart->ret_stack.push(ret_addr);
+}
+
+uint32_t Yuemu::jit_pop_ret(JitContext* ctx, uint32_t pc_if_empty) {
+    Hart* hart = static_cast<Hart*>(ctx->hart);
+    if (hart->ret_stack.empty()) {
+        return pc_if_empty;
+    }
+    uint32_t ret_addr = hart->ret_stack.top();
+    hart->ret_stack.pop();
+    return ret_addr;
 }
 
 std::string Yuemu::get_instr_as_hex(uint32_t instr_int) {
@@ -659,18 +1563,7 @@ std::string Yuemu::get_instr_as_hex(uint32_t instr_int) {
 }
 
 uint32_t Yuemu::sign_extend(uint32_t val, uint32_t no_of_bits) {
-    uint32_t sign_bit = val >> (no_of_bits - 1) & 0b1;
-    if (sign_bit == 1) {
-        if (no_of_bits == 16) {
-            val += 0xFFFF0000;
-        } else if (no_of_bits == 24) {
-            val += 0xFF000000;
-        } else {
-            std::cout << "TODO implement sign extension for all bit lengths\n";
-        }
-    }
-    // no need to sign extend positive values
-    return val; 
+    return ::sign_extend(val, no_of_bits);
 }
 
 int32_t Yuemu::to_signed(uint32_t val) {
@@ -1,27 +1,217 @@
+#pragma once
+
 #include <cstdint>
+#include <iostream>
+#include <memory>
 #include <string>
-#include <map>
-#include <stack>
+#include <utility>
+#include <vector>
+
+#include "yuemu_aot.hpp"
+#include "yuemu_devices.hpp"
+#include "yuemu_dump.hpp"
+#include "yuemu_hart.hpp"
+#include "yuemu_host_counters.hpp"
+#include "yuemu_image.hpp"
+#include "yuemu_memory.hpp"
+#include "yuemu_profile.hpp"
+#include "yuemu_replay.hpp"
+#include "yuemu_timing.hpp"
+#include "yuemu_trace.hpp"
+
+struct YuemuOptions {
+    bool jit = false; // compile hot blocks to native code
+    std::string aot_file; // runs the blocks a translated program covers from this shared object, see AotModule
+    bool fuse = true; // run common instruction pairs as one op, never while tracing or profiling
+    int trace_level = 0; // 10 traces every instruction, 11 also dumps registers
+    std::string trace_file; // records a binary trace here instead when set
+    bool profile = false; // counts executions per opcode, pc, branch and memory page
+    std::string profile_file; // also writes the counts here when set
+    std::string callgraph_file; // also writes the call tree here as folded stacks when set, a single hart only
+    bool timing = false; // runs every fetch, load and store through a cache model and estimates cycles
+    TimingConfig timing_config;
+    uint32_t harts = 1; // hardware threads sharing the guest memory
+    uint64_t lockstep_quantum = 0; // round-robin the harts on one thread this many instructions at a time, 0 runs each on its own thread
+    uint32_t ret_stack_capacity = ReturnStack::DEFAULT_CAPACITY; // return addresses each hart can hold
+    std::string input_file; // words the file device reads, see Devices
+    std::string output_file; // words the file device writes
+    std::string dump_file; // writes the written pages here instead of printing the memory map when the harts halt, see MemoryDump
+    std::string host_counters_file; // counts host cycles, instructions, branch and cache misses per phase and writes them here as JSON, see HostCounters
+    uint64_t host_sample_period = 0; // with host counters, also samples which run loop handler the host is in this often
+    uint64_t record_interval = 0; // records the run for seek() and the reverse steps, a checkpoint every this many instructions, a single hart only
+};
 
 class Yuemu {
     public:
-        Yuemu(std::string fpath);
-    
-    private:
-        const int DEBUG_LEVEL = 10;
+        using StopReason = ::StopReason;
+
+        Yuemu(const YuemuOptions& options = YuemuOptions());
+
+        // either loads a program image or restores a snapshot, false on errors
+        bool load_program(std::string fpath);
+        bool restore_snapshot(const std::string& path);
+
+        // loads a program image that is already in host memory, same formats as
+        // the files: a raw image or an executable, see Executable
+        bool load_image(const uint8_t* image, uint64_t size);
+
+        // the symbols of the loaded executable, empty for raw images
+        const SymbolTable& get_symbols() const { return symbols; }
+
+        // saves pc, registers and the return stack of the first hart and every
+        // touched memory page
+        bool save_snapshot(const std::string& path) const;
+
+        // writes every page written since the program was loaded or since the
+        // last dump, see MemoryDump
+        bool save_dump(const std::string& path);
+
+        // translates the loaded program ahead of time into a shared object
+        // for YuemuOptions::aot_file, returns the number of blocks, 0 on errors
+        size_t build_aot(const std::string& so_path);
+
+        // makes run() stop as soon as execution reaches stop_pc, a hart that
+        // stopped there runs on from it the next time. Changing the stop pc
+        // drops the translated blocks.
+        void set_stop_pc(uint32_t stop_pc);
+        void clear_stop_pc() { has_stop_pc = false; }
+
+        // runs every hart for at most max_instructions, a run that stops on
+        // BUDGET picks up where it left off the next time
+        StopReason run(uint64_t max_instructions = UINT64_MAX);
+        uint64_t instructions_executed() const;
+
+        // runs one instruction on every hart
+        StopReason step() { return run(1); }
 
-        unsigned int read_instr_count = 0;
-        unsigned int pc = 0;
-        uint32_t regs[256] = {0};
-        std::map<uint32_t, uint32_t> mem;
-        std::stack<uint32_t> ret_stack;
+        // runs until pc is reached, the stop pc set before is kept for later runs
+        StopReason run_until(uint32_t pc, uint64_t max_instructions = UINT64_MAX);
 
-        bool skip_auto_pc_incr = false;
+        // Record and replay, only when options.record_interval is set. The
+        // position counts the instructions the first hart has executed. seek()
+        // goes back to any position since the recording started at the first
+        // run, or runs forward to a later one, without printing anything. A
+        // hart left at the stop pc by any of them runs on from it the next time.
+        bool recording() const { return recorder != nullptr; }
+        uint64_t position() const { return harts[0]->executed; }
+        bool seek(uint64_t index); // false if the program halts first or nothing records
+        bool reverse_step() { return position() > 0 && seek(position() - 1); }
 
-        void read_file_to_memory(std::string fpath);
-        void run();
+        // goes back to the last time execution reached the stop pc or a
+        // breakpoint or hit a watchpoint and returns why it stopped there, or
+        // to the start of the recording and returns BUDGET
+        StopReason reverse_continue();
+
+        // Breakpoints and watchpoints, set between runs. run() stops on
+        // BREAKPOINT right before the instruction at a breakpoint and on
+        // WATCHPOINT right after an instruction that loaded from or stored to
+        // a watched address, a hart stopped on either runs on from there the
+        // next time. Breakpoints are patched into the translated blocks and
+        // cost nothing elsewhere, changing one drops the blocks it is in.
+        // Watchpoints tag their memory pages and switch quiet runs to a loop
+        // that checks the tag on every access, only accesses to tagged pages
+        // look any further. Traced, profiled and timed runs don't check them,
+        // stores by the file device or write_memory() never hit them.
+        enum WatchKind : uint8_t { WATCH_READ = 1, WATCH_WRITE = 2 };
+        void add_breakpoint(uint32_t pc);
+        bool remove_breakpoint(uint32_t pc); // false if there was none at pc
+        const std::vector<uint32_t>& get_breakpoints() const { return breakpoints; }
+        void add_watchpoint(uint32_t addr, uint8_t kinds); // kinds is WATCH_READ, WATCH_WRITE or both
+        bool remove_watchpoint(uint32_t addr); // false if there was none at addr
+        const std::vector<std::pair<uint32_t, uint8_t>>& get_watchpoints() const { return watchpoints; }
+
+        // the watched address the first hart accessed when it last stopped on
+        // WATCHPOINT, and whether it stored to it
+        uint32_t get_watch_addr() const { return harts[0]->watch_addr; }
+        bool get_watch_write() const { return harts[0]->watch_write; }
+
+        // machine state of the first hart, may be changed between runs
+        bool halted() const { return harts[0]->halted(); }
+        uint32_t get_pc() const { return harts[0]->pc; }
+        void set_pc(uint32_t pc) { harts[0]->pc = pc; }
+        uint32_t get_register(uint8_t reg) const { return harts[0]->regs[reg]; }
+        void set_register(uint8_t reg, uint32_t val) { harts[0]->regs[reg] = val; }
+        uint32_t read_memory(uint32_t addr) const { return mem.read(addr); }
+        void write_memory(uint32_t addr, uint32_t val) {
+            if (recorder != nullptr && recorder->started() && !Devices::is_device(addr)) {
+                recorder->journal(mem, addr);
+            }
+            store(*harts[0], addr, val);
+        }
+
+        // everything the instance prints goes to these streams
+        void set_output(std::ostream& out_stream, std::ostream& err_stream) {
+            out = &out_stream;
+            err = &err_stream;
+            devices.set_console(&out_stream);
+        }
 
         static std::string get_instr_as_hex(uint32_t instr_int);
-        static uint32_t sign_extend(uint32_t val, uint32_t no_of_bits);
         static int32_t to_signed(uint32_t val);
+
+    private:
+        static constexpr int TRACE_BINARY = 1; // run_loop level that records to trace_writer
+        static constexpr int PROFILE = 2; // run_loop level that counts into profiler
+        static constexpr int TIMING = 3; // run_loop level that feeds timing
+        static constexpr int RECORD = 4; // run_loop level that journals stores for recorder
+        static constexpr int WATCH = 5; // run_loop level that checks loads and stores against watchpoints
+
+        const YuemuOptions options;
+        std::ostream* out = &std::cout;
+        std::ostream* err = &std::cerr;
+
+        uint32_t halt_pc = 0; // the end of a raw image, an executable names its own
+        uint32_t code_start = 0; // the loaded code, which the profiler counts per pc
+        uint64_t code_bytes = 0;
+        SymbolTable symbols;
+        uint32_t stop_pc = 0;
+        bool has_stop_pc = false;
+        std::vector<uint32_t> breakpoints;
+        std::vector<std::pair<uint32_t, uint8_t>> watchpoints; // address and kinds, in the order they were set
+        bool started = false;
+        bool files_opened = false;
+        Memory mem;
+        Devices devices;
+        std::vector<std::unique_ptr<Hart>> harts; // harts[0] is the one snapshots and the API see
+        std::unique_ptr<TraceWriter> trace_writer; // only set when recording a binary trace
+        std::unique_ptr<Profiler> profiler; // only set when profiling
+        std::unique_ptr<TimingModel> timing; // only set when timing
+        std::unique_ptr<Recorder> recorder; // only set when recording
+        std::unique_ptr<HostCounters> host_counters; // only set when counting host events
+        std::unique_ptr<AotModule> aot; // only set when running a translated program
+
+        bool read_file_to_memory(std::string fpath);
+        bool load_executable(const uint8_t* image, uint64_t size);
+        bool open_aot(); // after the program is in memory
+        void prepare_run();
+        StopReason run_hart(Hart& hart, uint64_t max_instructions);
+        StopReason run_recorded(Hart& hart, uint64_t max_instructions);
+        template <int TRACE_LEVEL> StopReason run_loop(Hart& hart);
+        bool watch_hit(Hart& hart, uint32_t addr, uint8_t kind);
+        void print_registers(const Hart& hart, uint32_t pc_debug);
+        void print_memory_map();
+        void dump_memory(); // the memory map or the dump file
+        void print_reports(); // timing and profile reports, once every hart halted
+
+        // returns true if the store overwrote code translated by this hart,
+        // the other harts drop their blocks at their next block boundary
+        bool store(Hart& hart, uint32_t addr, uint32_t val) {
+            if (Devices::is_device(addr)) {
+                return device_store(hart, addr, val);
+            }
+            mem.write(addr, val);
+            if (harts.size() > 1) {
+                notify_harts(hart, addr);
+            }
+            return hart.block_cache.invalidate(addr);
+        }
+        void notify_harts(const Hart& writer, uint32_t addr);
+        bool device_store(Hart& hart, uint32_t addr, uint32_t val);
+
+        static uint32_t jit_load(JitContext* ctx, uint32_t addr);
+        static uint32_t jit_store(JitContext* ctx, uint32_t addr, uint32_t val);
+        static void jit_push_ret(JitContext* ctx, uint32_t ret_addr);
+        static uint32_t jit_pop_ret(JitContext* ctx, uint32_t pc_if_empty);
+
+        static uint32_t sign_extend(uint32_t val, uint32_t no_of_bits);
 };
@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <unordered_set>
+
+#if defined(__unix__)
+#include <dlfcn.h>
+#endif
+
+#include "yuemu.hpp"
+#include "yuemu_aot.hpp"
+
+namespace {
+
+// the generated source declares the types it shares with the emulator itself
+const char* const PRELUDE =
+    "#include <cstdint>\n"
+    "\n"
+    "// same layout as in yuemu_jit.hpp and yuemu_aot.hpp\n"
+    "struct JitContext { uint32_t* regs; void* emu; void* hart; void* block; };\n"
+    "typedef uint32_t (*JitCode)(JitContext* ctx);\n"
+    "struct JitHelpers {\n"
+    "    uint32_t (*load)(JitContext* ctx, uint32_t addr);\n"
+    "    uint32_t (*store)(JitContext* ctx, uint32_t addr, uint32_t val);\n"
+    "    void (*push_ret)(JitContext* ctx, uint32_t ret_addr);\n"
+    "    uint32_t (*pop_ret)(JitContext* ctx, uint32_t pc_if_empty);\n"
+    "};\n"
+    "struct AotBlock { uint32_t start_pc; uint32_t instr_count; const uint32_t* words; JitCode code; };\n"
+    "struct AotProgram { uint32_t version; uint32_t entry_pc; uint32_t halt_pc; uint32_t block_count; const AotBlock* blocks; };\n"
+    "\n"
+    "namespace {\n"
+    "\n"
+    "JitHelpers h;\n";
+
+std::string hex(uint32_t val) {
+    std::ostringstream out;
+    out << std::hex << val;
+    return out.str();
+}
+
+std::string u32(uint32_t val) {
+    return std::to_string(val) + "u";
+}
+
+std::string reg(uint8_t r) {
+    return "r[" + std::to_string(r) + "]";
+}
+
+} // namespace
+
+AotModule::~AotModule() {
+#if defined(__unix__)
+    if (handle != nullptr) {
+        dlclose(handle);
+    }
+#endif
+}
+
+// One line per guest instruction, the disassembly goes next to it. Stores
+// leave early when they overwrote the block, like the JIT's code does.
+std::string AotModule::block_source(const Block& block, const SymbolTable& symbols) {
+    std::ostringstream out;
+    std::string symbol = symbols.describe(block.start_pc);
+    if (!symbol.empty()) {
+        out << "// " << symbol << "\n";
+    }
+    out << "uint32_t block_" << hex(block.start_pc) << "(JitContext* ctx) {\n";
+    out << "    uint32_t* const r = ctx->regs;\n";
+
+    uint32_t pc = block.start_pc;
+    for (size_t i=0; i<block.ops.size(); i++) {
+        const DecodedOp& op = block.ops[i];
+        std::string a = reg(op.rs1);
+        std::string b = reg(op.rs2);
+        std::string d = reg(op.rd);
+        std::string next = u32(pc + 4);
+        std::string target = u32(pc + op.imm);
+        std::string line;
+        switch (op.op) {
+            case Op::LOADI: line = d + " = " + u32(op.imm) + ";"; break;
+            case Op::LOADR: line = d + " = h.load(ctx, " + a + ");"; break;
+            case Op::LOADD: line = d + " = h.load(ctx, " + u32(op.imm) + ");"; break;
+            case Op::STOREN: line = "if (h.store(ctx, " + a + ", " + b + ") != 0) return " + next + ";"; break;
+            case Op::STORED: line = "if (h.store(ctx, " + u32(op.imm) + ", " + b + ") != 0) return " + next + ";"; break;
+
+            case Op::ADD: line = d + " = " + a + " + " + b + ";"; break;
+            case Op::SUB: line = d + " = " + a + " - " + b + ";"; break;
+            case Op::MUL: line = d + " = " + a + " * " + b + ";"; break;
+            case Op::DIV: line = d + " = " + a + " / " + b + ";"; break;
+
+            case Op::AND: line = d + " = " + a + " & " + b + ";"; break;
+            case Op::OR: line = d + " = " + a + " | " + b + ";"; break;
+            case Op::NAND: line = d + " = ~(" + a + " & " + b + ");"; break;
+            case Op::NOR: line = d + " = ~(" + a + " | " + b + ");"; break;
+            case Op::XOR: line = d + " = " + a + " ^ " + b + ";"; break;
+
+            // the host masks the shift count like the interpreter's shifts do
+            case Op::LSHIFT: line = d + " = " + a + " << (" + b + " & 31);"; break;
+            case Op::RSHIFT: line = d + " = " + a + " >> (" + b + " & 31);"; break;
+
+            case Op::LT: line = d + " = (int32_t) " + a + " < (int32_t) " + b + ";"; break;
+            case Op::LTE: line = d + " = (int32_t) " + a + " <= (int32_t) " + b + ";"; break;
+            case Op::GT: line = d + " = (int32_t) " + a + " > (int32_t) " + b + ";"; break;
+            case Op::GTE: line = d + " = (int32_t) " + a + " >= (int32_t) " + b + ";"; break;
+            case Op::EQ: line = d + " = " + a + " == " + b + ";"; break;
+
+            case Op::NOP: break;
+
+            case Op::JUMP: line = "return " + target + ";"; break;
+            case Op::JUMPDIR: line = "return " + u32(pc) + " + " + a + ";"; break;
+            case Op::JUMPIF: line = "return " + b + " != 0 ? " + target + " : " + next + ";"; break;
+            case Op::JUMPIFDIR: line = "return " + b + " != 0 ? " + u32(pc) + " + " + a + " : " + next + ";"; break;
+            case Op::RET: line = "return h.pop_ret(ctx, " + next + ");"; break;
+            case Op::BR: line = "h.push_ret(ctx, " + next + "); return " + target + ";"; break;
+            case Op::BRIF:
+                line = "if (" + b + " != 0) { h.push_ret(ctx, " + next + "); return " + target + "; } return " + next + ";";
+                break;
+
+            case Op::BLOCK_END: line = "return " + u32((uint32_t) block.end_pc) + ";"; break;
+
+            // translate() leaves blocks with anything else out
+            default: break;
+        }
+        out << "    " << line << (line.empty() ? "// " : " // ");
+        if (op.op == Op::BLOCK_END) {
+            out << "cut off at " << block.end_pc << "\n";
+        } else {
+            out << pc << ": " << disassemble(block.words[i]) << "\n";
+        }
+        pc += 4;
+    }
+    out << "}\n";
+
+    out << "const uint32_t words_" << hex(block.start_pc) << "[] = {";
+    for (size_t i=0; i<block.instr_count(); i++) {
+        out << (i > 0 ? ", " : "") << "0x" << hex(block.words[i]) << "u";
+    }
+    out << "};\n\n";
+    return out.str();
+}
+
+size_t AotModule::translate(const Memory& mem, uint32_t entry_pc, uint32_t halt_pc, uint32_t code_start, uint64_t code_bytes,
+        const SymbolTable& symbols, const std::string& so_path, std::ostream& err) {
+    if (so_path.find_first_of("'\n") != std::string::npos) {
+        err << "Error: can't build a translated program with a quote in its path: " << so_path << "\n";
+        return 0;
+    }
+
+    // the same block boundaries the run loop gets, fusion stays off
+    BlockCache cache(mem);
+    cache.set_stop_pcs(halt_pc, halt_pc);
+
+    uint64_t code_end = (uint64_t) code_start + code_bytes;
+    std::vector<uint32_t> work;
+    std::unordered_set<uint32_t> seen;
+    auto add = [&](uint64_t pc) {
+        if (pc >= code_start && pc < code_end && pc != halt_pc && seen.insert(pc).second) {
+            work.push_back(pc);
+        }
+    };
+    add(entry_pc);
+    for (const auto& symbol : symbols.all()) {
+        add(symbol.first);
+    }
+
+    // follows every direct target and every fall-through, the address after
+    // a register jump or a ret included since code usually goes on there
+    std::map<uint32_t, const Block*> blocks;
+    while (!work.empty()) {
+        uint32_t pc = work.back();
+        work.pop_back();
+        const Block* block = cache.lookup(pc);
+        const DecodedOp& last = block->ops.back();
+        uint32_t last_pc = block->end_pc - 4;
+        switch (last.op) {
+            case Op::JUMP:
+                add(last_pc + last.imm);
+                break;
+            case Op::JUMPIF:
+            case Op::BR:
+            case Op::BRIF:
+                add(last_pc + last.imm);
+                add(last_pc + 4);
+                break;
+            case Op::JUMPDIR:
+            case Op::JUMPIFDIR:
+            case Op::RET:
+            case Op::BLOCK_END:
+                add(block->end_pc);
+                break;
+            default:
+                break;
+        }
+        if (last.op != Op::END && last.op != Op::INVALID) {
+            blocks[pc] = block;
+        }
+    }
+    if (blocks.empty()) {
+        err << "Error: no block from pc " << entry_pc << " ends in a jump, a branch or a ret, nothing to translate\n";
+        return 0;
+    }
+
+    std::string source_path = so_path + ".cpp";
+    std::ofstream source(source_path);
+    if (!source) {
+        err << "Error: can't write translated source: " << source_path << "\n";
+        return 0;
+    }
+    source << "// Generated by yuemu --aot-build, " << blocks.size() << " blocks\n";
+    source << PRELUDE << "\n";
+    for (const auto& entry : blocks) {
+        source << block_source(*entry.second, symbols);
+    }
+    source << "const AotBlock blocks[] = {\n";
+    for (const auto& entry : blocks) {
+        std::string name = hex(entry.first);
+        source << "    {" << u32(entry.first) << ", " << u32(entry.second->instr_count()) << ", words_" << name << ", block_" << name << "},\n";
+    }
+    source << "};\n\n";
+    source << "const AotProgram program = {" << u32(VERSION) << ", " << u32(entry_pc) << ", " << u32(halt_pc) << ", "
+           << u32(blocks.size()) << ", blocks};\n\n";
+    source << "} // namespace\n\n";
+    source << "extern \"C\" const AotProgram* yuemu_aot_program(const JitHelpers* helpers) {\n";
+    source << "    h = *helpers;\n";
+    source << "    return &program;\n";
+    source << "}\n";
+    source.close();
+    if (!source) {
+        err << "Error: can't write translated source: " << source_path << "\n";
+        return 0;
+    }
+
+    const char* cxx = std::getenv("CXX");
+    std::string command = std::string(cxx != nullptr && *cxx != 0 ? cxx : "c++")
+        + " -O2 -shared -fPIC -o '" + so_path + "' '" + source_path + "'";
+    if (std::system(command.c_str()) != 0) {
+        err << "Error: building the translated program failed: " << command << "\n";
+        return 0;
+    }
+    return blocks.size();
+}
+
+bool AotModule::open(const std::string& so_path, const JitHelpers& helpers, uint32_t halt_pc, std::ostream& err) {
+#if defined(__unix__)
+    // without a slash dlopen would search the library path instead
+    std::string path = so_path.find('/') == std::string::npos ? "./" + so_path : so_path;
+    handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+        err << "Error: can't load translated program: " << dlerror() << "\n";
+        return false;
+    }
+    typedef const AotProgram* (*Entry)(const JitHelpers* helpers);
+    Entry entry = (Entry) dlsym(handle, "yuemu_aot_program");
+    if (entry == nullptr) {
+        err << "Error: not a translated program: " << so_path << "\n";
+        return false;
+    }
+    const AotProgram* loaded = entry(&helpers);
+    if (loaded->version != VERSION) {
+        err << "Error: translated program has version " << loaded->version << ", expected " << VERSION << "\n";
+        return false;
+    }
+    if (loaded->halt_pc != halt_pc) {
+        err << "Error: " << so_path << " was translated from a different program\n";
+        return false;
+    }
+    program = loaded;
+    return true;
+#else
+    (void) helpers;
+    (void) halt_pc;
+    err << "Error: can't load translated program " << so_path << " on this host\n";
+    return false;
+#endif
+}
+
+JitCode AotModule::lookup(const Block& block) const {
+    if (program == nullptr) {
+        return nullptr;
+    }
+    const AotBlock* end = program->blocks + program->block_count;
+    const AotBlock* it = std::lower_bound(program->blocks, end, block.start_pc,
+        [](const AotBlock& b, uint32_t pc) { return b.start_pc < pc; });
+    if (it == end || it->start_pc != block.start_pc || it->instr_count != block.instr_count()) {
+        return nullptr;
+    }
+    for (uint32_t i=0; i<it->instr_count; i++) {
+        if (it->words[i] != block.words[i] || block.ops[i].op == Op::BREAKPOINT) {
+            return nullptr;
+        }
+    }
+    return it->code;
+}
+
+size_t Yuemu::build_aot(const std::string& so_path) {
+    return AotModule::translate(mem, harts[0]->pc, halt_pc, code_start, code_bytes, symbols, so_path, *err);
+}
+
+bool Yuemu::open_aot() {
+    if (options.aot_file.empty()) {
+        return true;
+    }
+    JitHelpers helpers = {jit_load, jit_store, jit_push_ret, jit_pop_ret};
+    aot.reset(new AotModule());
+    if (!aot->open(options.aot_file, helpers, halt_pc, *err)) {
+        aot.reset();
+        return false;
+    }
+    return true;
+}
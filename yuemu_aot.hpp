@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "yuemu_block_cache.hpp"
+#include "yuemu_image.hpp"
+#include "yuemu_jit.hpp"
+#include "yuemu_memory.hpp"
+
+// One translated block as the generated code lists it. Its code runs the
+// block like compiled JIT code does, with the same context and helpers.
+struct AotBlock {
+    uint32_t start_pc;
+    uint32_t instr_count;
+    const uint32_t* words; // the instruction words it was translated from
+    JitCode code;
+};
+
+// What a translated program's shared object hands back from
+// yuemu_aot_program(), blocks in start pc order
+struct AotProgram {
+    uint32_t version;
+    uint32_t entry_pc;
+    uint32_t halt_pc;
+    uint32_t block_count;
+    const AotBlock* blocks;
+};
+
+// Ahead-of-time translation of a whole program to C++. The translator finds
+// the blocks the run loop would build from the entry pc, the symbols and
+// every direct jump, branch and fall-through target it can follow, and writes
+// one C++ function per block that ends in a jump, a branch, a ret or the halt
+// pc. The compiled functions return the next pc like the JIT's code and go
+// through the same helpers for loads, stores and the return stack, so they
+// work on the same registers, memory and devices as the interpreter.
+//
+// Jumps through a register can go anywhere: their targets get no code of
+// their own unless some other path found them, the interpreter runs whatever
+// the translation didn't cover. Blocks that run end or an invalid
+// instruction stay with the interpreter as well.
+//
+// At run time a block only takes translated code made from the same words
+// over the same range, so a stop pc, a breakpoint or code the program
+// overwrote since leave those blocks to the interpreter.
+class AotModule {
+    public:
+        static constexpr uint32_t VERSION = 1;
+
+        AotModule() = default;
+        ~AotModule();
+        AotModule(const AotModule&) = delete;
+        AotModule& operator=(const AotModule&) = delete;
+
+        // writes the C++ source for the program in mem and builds it into a
+        // shared object at so_path with $CXX, c++ without it. The source goes
+        // next to it as so_path + ".cpp". Returns the number of translated
+        // blocks, 0 on errors.
+        static size_t translate(const Memory& mem, uint32_t entry_pc, uint32_t halt_pc, uint32_t code_start, uint64_t code_bytes,
+            const SymbolTable& symbols, const std::string& so_path, std::ostream& err);
+
+        // loads a translated program, the helpers are the ones the JIT calls
+        bool open(const std::string& so_path, const JitHelpers& helpers, uint32_t halt_pc, std::ostream& err);
+
+        // translated code for block, nullptr unless it was made from block's words
+        JitCode lookup(const Block& block) const;
+
+        size_t block_count() const { return program != nullptr ? program->block_count : 0; }
+
+    private:
+        void* handle = nullptr;
+        const AotProgram* program = nullptr;
+
+        static std::string block_source(const Block& block, const SymbolTable& symbols);
+};
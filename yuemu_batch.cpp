@@ -0,0 +1,246 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include "yuemu_batch.hpp"
+
+BatchRunner::BatchRunner(const YuemuOptions& options, unsigned int worker_count, uint64_t slice) : options(options), slice(slice) {
+    if (worker_count == 0) {
+        worker_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned int i=0; i<worker_count; i++) {
+        workers.emplace_back(new Worker());
+    }
+}
+
+bool BatchRunner::load_manifest(const std::string& path) {
+    std::ifstream manifest(path);
+    if (!manifest) {
+        std::cerr << "Error: can't open manifest: " << path << "\n";
+        return false;
+    }
+
+    size_t slash = path.rfind('/');
+    std::string dir = (slash == std::string::npos) ? "" : path.substr(0, slash + 1);
+
+    std::string line;
+    unsigned int line_no = 0;
+    while (std::getline(manifest, line)) {
+        line_no++;
+        line = line.substr(0, line.find('#'));
+
+        std::istringstream tokens(line);
+        std::string token;
+        if (!(tokens >> token)) {
+            continue;
+        }
+
+        BatchEntry entry;
+        entry.program = (token[0] == '/') ? token : dir + token;
+        std::string bad;
+        if (!parse_presets(tokens, entry, bad)) {
+            std::cerr << "Error: invalid input in " << path << " line " << line_no << ": " << bad << "\n";
+            return false;
+        }
+        entries.push_back(entry);
+    }
+    return true;
+}
+
+bool parse_presets(std::istream& tokens, BatchEntry& entry, std::string& bad) {
+    std::string token;
+    while (tokens >> token) {
+        size_t eq = token.find('=');
+        try {
+            if (eq == std::string::npos || eq < 2 || (token[0] != 'r' && token[0] != '@')) {
+                throw std::invalid_argument(token);
+            }
+            uint32_t val = std::stoll(token.substr(eq + 1), nullptr, 0);
+            unsigned long target = std::stoul(token.substr(1, eq - 1), nullptr, 0);
+            if (token[0] == 'r') {
+                if (target > 255) {
+                    throw std::out_of_range(token);
+                }
+                entry.regs.push_back({(uint8_t) target, val});
+            } else {
+                entry.mem.push_back({(uint32_t) target, val});
+            }
+        } catch (const std::exception&) {
+            bad = token;
+            return false;
+        }
+    }
+    return true;
+}
+
+void BatchRunner::run() {
+    results.assign(entries.size(), Result());
+    next_entry = 0;
+    live = 0;
+    remaining = entries.size();
+
+    std::vector<std::thread> threads;
+    for (size_t i=1; i<workers.size(); i++) {
+        threads.emplace_back(&BatchRunner::work, this, i);
+    }
+    work(0);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+void BatchRunner::work(size_t id) {
+    Worker& own = *workers[id];
+
+    while (remaining.load(std::memory_order_acquire) > 0) {
+        // an event after this point wakes the wait below, so none is missed
+        uint64_t seen;
+        {
+            std::lock_guard<std::mutex> guard(idle_lock);
+            seen = events;
+        }
+
+        Task* task = nullptr;
+        if (live.load(std::memory_order_relaxed) < workers.size() * INSTANCES_PER_WORKER) {
+            task = start_next();
+        }
+        if (task == nullptr) {
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                task = own.tasks.front();
+                own.tasks.pop_front();
+            }
+        }
+        if (task == nullptr) {
+            task = steal(id);
+        }
+        if (task == nullptr) {
+            std::unique_lock<std::mutex> guard(idle_lock);
+            idle.wait(guard, [&] { return events != seen; });
+            continue;
+        }
+
+        Yuemu::StopReason reason = task->yuemu->run(slice);
+        results[task->index].slices++;
+        if (reason == Yuemu::StopReason::BUDGET) {
+            {
+                std::lock_guard<std::mutex> guard(own.lock);
+                own.tasks.push_back(task);
+            }
+            wake(false);
+        } else {
+            finish(task, true, reason);
+        }
+    }
+}
+
+// loads the next manifest entry, programs that fail to load finish right away
+BatchRunner::Task* BatchRunner::start_next() {
+    while (true) {
+        size_t index = next_entry.fetch_add(1, std::memory_order_relaxed);
+        if (index >= entries.size()) {
+            return nullptr;
+        }
+        const BatchEntry& entry = entries[index];
+
+        Task* task = new Task();
+        task->index = index;
+        task->yuemu.reset(new Yuemu(options));
+        task->yuemu->set_output(task->output, task->output);
+        live++;
+
+        if (!task->yuemu->load_program(entry.program)) {
+            finish(task, false, Yuemu::StopReason::INVALID);
+            continue;
+        }
+        for (const auto& reg : entry.regs) {
+            task->yuemu->set_register(reg.first, reg.second);
+        }
+        for (const auto& word : entry.mem) {
+            task->yuemu->write_memory(word.first, word.second);
+        }
+        return task;
+    }
+}
+
+BatchRunner::Task* BatchRunner::steal(size_t id) {
+    for (size_t i=1; i<workers.size(); i++) {
+        Worker& victim = *workers[(id + i) % workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            Task* task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+void BatchRunner::finish(Task* task, bool loaded, Yuemu::StopReason reason) {
+    Result& result = results[task->index];
+    result.loaded = loaded;
+    result.reason = reason;
+    result.instructions = task->yuemu->instructions_executed();
+    result.output = task->output.str();
+    delete task;
+
+    live--;
+    remaining.fetch_sub(1, std::memory_order_release);
+    wake(true);
+}
+
+// a requeued instance is work for one sleeping worker, a finished one may let
+// all of them start the next entry or stop
+void BatchRunner::wake(bool all) {
+    {
+        std::lock_guard<std::mutex> guard(idle_lock);
+        events++;
+    }
+    if (all) {
+        idle.notify_all();
+    } else {
+        idle.notify_one();
+    }
+}
+
+bool BatchRunner::print_results(std::ostream& os) const {
+    size_t counts[8] = {0};
+    size_t load_errors = 0;
+
+    for (size_t i=0; i<results.size(); i++) {
+        const Result& result = results[i];
+        os << "=== [" << i << "] " << entries[i].program << ": ";
+        if (result.loaded) {
+            os << reason_name(result.reason) << ", " << result.instructions << " instructions, " << result.slices << " slices\n";
+            counts[(int) result.reason]++;
+        } else {
+            os << "load error\n";
+            load_errors++;
+        }
+        os << result.output;
+    }
+
+    os << "=== " << results.size() << " programs: "
+       << counts[(int) Yuemu::StopReason::FINISHED] << " finished, "
+       << counts[(int) Yuemu::StopReason::END] << " end, "
+       << counts[(int) Yuemu::StopReason::INVALID] << " invalid, "
+       << counts[(int) Yuemu::StopReason::STACK_OVERFLOW] << " stack overflows, "
+       << load_errors << " load errors\n";
+    return load_errors == 0;
+}
+
+const char* BatchRunner::reason_name(Yuemu::StopReason reason) {
+    switch (reason) {
+        case Yuemu::StopReason::END: return "end";
+        case Yuemu::StopReason::FINISHED: return "finished";
+        case Yuemu::StopReason::STOP_PC: return "stop pc";
+        case Yuemu::StopReason::INVALID: return "invalid";
+        case Yuemu::StopReason::BUDGET: return "budget";
+        case Yuemu::StopReason::STACK_OVERFLOW: return "stack overflow";
+        case Yuemu::StopReason::BREAKPOINT: return "breakpoint";
+        case Yuemu::StopReason::WATCHPOINT: return "watchpoint";
+    }
+    return "unknown";
+}
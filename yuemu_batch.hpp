@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "yuemu.hpp"
+
+// One manifest line: a program image and the registers and memory words to
+// preset before it runs.
+struct BatchEntry {
+    std::string program;
+    std::vector<std::pair<uint8_t, uint32_t>> regs;
+    std::vector<std::pair<uint32_t, uint32_t>> mem;
+};
+
+// reads "rN=<value>" and "@<addr>=<value>" tokens into entry's presets until
+// tokens runs out, a malformed token ends up in bad
+bool parse_presets(std::istream& tokens, BatchEntry& entry, std::string& bad);
+
+// Runs many independent programs in one process. Every worker owns a deque
+// of running instances, takes them from the front, runs one time slice and
+// puts them back at the end, so a long program only ever holds a worker for
+// one slice. Idle workers start new instances from the manifest or steal
+// from the back of another worker's deque, and sleep when there is neither
+// until a slice puts an instance back or one finishes.
+class BatchRunner {
+    public:
+        static constexpr uint64_t DEFAULT_SLICE = 1 << 20; // instructions
+        static constexpr unsigned int INSTANCES_PER_WORKER = 4; // live instances per worker at most
+
+        // workers = 0 uses one worker per core
+        BatchRunner(const YuemuOptions& options, unsigned int workers = 0, uint64_t slice = DEFAULT_SLICE);
+
+        // manifest lines are "<program> [rN=<value>]... [@<addr>=<value>]...",
+        // relative program paths start at the manifest's directory and # starts a comment
+        bool load_manifest(const std::string& path);
+
+        void run();
+
+        // prints every instance's status and output in manifest order and a summary,
+        // returns false if a program couldn't be loaded
+        bool print_results(std::ostream& os) const;
+
+    private:
+        struct Task {
+            size_t index;
+            std::unique_ptr<Yuemu> yuemu;
+            std::ostringstream output;
+        };
+
+        struct Result {
+            bool loaded = false;
+            Yuemu::StopReason reason = Yuemu::StopReason::FINISHED;
+            uint64_t instructions = 0;
+            uint32_t slices = 0;
+            std::string output;
+        };
+
+        struct Worker {
+            std::mutex lock;
+            std::deque<Task*> tasks;
+        };
+
+        const YuemuOptions options;
+        const uint64_t slice;
+        std::vector<BatchEntry> entries;
+        std::vector<Result> results;
+        std::vector<std::unique_ptr<Worker>> workers;
+
+        std::atomic<size_t> next_entry{0};
+        std::atomic<size_t> live{0};
+        std::atomic<size_t> remaining{0};
+
+        std::mutex idle_lock;
+        std::condition_variable idle;
+        uint64_t events = 0; // requeued and finished instances, under idle_lock
+
+        void work(size_t id);
+        Task* start_next();
+        Task* steal(size_t id);
+        void finish(Task* task, bool loaded, Yuemu::StopReason reason);
+        void wake(bool all);
+
+        static const char* reason_name(Yuemu::StopReason reason);
+};
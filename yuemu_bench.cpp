@@ -0,0 +1,419 @@
+#include "yuemu_bench.hpp"
+#include "yuemu_image.hpp"
+
+void ProgramBuilder::load_const(uint8_t rd, uint32_t val) {
+    if (val <= 0x7FFF || val >= 0xFFFF8000) {
+        loadi(rd, (int16_t) val);
+        return;
+    }
+
+    if (!eight_loaded) {
+        loadi(EIGHT, 8);
+        eight_loaded = true;
+    }
+    loadi(rd, val >> 24);
+    for (int shift=16; shift>=0; shift-=8) {
+        lshift(rd, rd, EIGHT);
+        loadi(SCRATCH, val >> shift & 0xFF);
+        or_(rd, rd, SCRATCH);
+    }
+}
+
+void ProgramBuilder::patch(uint32_t pc, uint32_t target) {
+    uint32_t& word = words[pc / 4];
+    uint32_t off = target - pc;
+    switch (word >> 24) {
+        case 0x20: // jump
+            word = (word & 0xFF000000) | (off & 0xFFFF);
+            break;
+        case 0x22: // jumpif
+        case 0x27: // brif
+            word = (word & 0xFF0000FF) | (off & 0xFFFF) << 8;
+            break;
+        case 0x26: // br
+            word = (word & 0xFF000000) | (off & 0xFFFFFF);
+            break;
+    }
+}
+
+std::vector<uint8_t> ProgramBuilder::image() const {
+    std::vector<uint8_t> bytes;
+    bytes.reserve(4 * words.size());
+    for (uint32_t word : words) {
+        bytes.push_back(word >> 24);
+        bytes.push_back(word >> 16 & 0xFF);
+        bytes.push_back(word >> 8 & 0xFF);
+        bytes.push_back(word & 0xFF);
+    }
+    return bytes;
+}
+
+// the tables go right after the header, the segment words follow them in
+// the order of the segment table
+std::vector<uint8_t> ProgramBuilder::executable() const {
+    std::vector<uint8_t> bytes;
+    auto put = [&bytes](uint32_t word) {
+        bytes.push_back(word >> 24);
+        bytes.push_back(word >> 16 & 0xFF);
+        bytes.push_back(word >> 8 & 0xFF);
+        bytes.push_back(word & 0xFF);
+    };
+
+    std::string strings;
+    for (const auto& symbol : symbols) {
+        strings += symbol.second;
+        strings.push_back('\0');
+    }
+    while (strings.size() % 4 != 0) {
+        strings.push_back('\0');
+    }
+
+    uint32_t segment_count = 1 + data_segments.size() + zero_segments.size();
+    const char magic[8] = "YUEEXEC";
+    bytes.insert(bytes.end(), magic, magic + 8);
+    put(Executable::VERSION);
+    put(0); // entry
+    put(here()); // halt pc
+    put(segment_count);
+    put(symbols.size());
+    put(strings.size());
+
+    uint32_t offset = Executable::HEADER_BYTES + 16 * segment_count + 8 * symbols.size() + strings.size();
+    put((uint32_t) Executable::SegmentKind::CODE);
+    put(0);
+    put(words.size());
+    put(offset);
+    offset += 4 * words.size();
+    for (const auto& segment : data_segments) {
+        put((uint32_t) Executable::SegmentKind::DATA);
+        put(segment.first);
+        put(segment.second.size());
+        put(offset);
+        offset += 4 * segment.second.size();
+    }
+    for (const auto& segment : zero_segments) {
+        put((uint32_t) Executable::SegmentKind::ZERO);
+        put(segment.first);
+        put(segment.second);
+        put(0);
+    }
+
+    uint32_t name = 0;
+    for (const auto& symbol : symbols) {
+        put(symbol.first);
+        put(name);
+        name += symbol.second.size() + 1;
+    }
+    bytes.insert(bytes.end(), strings.begin(), strings.end());
+
+    for (uint32_t word : words) {
+        put(word);
+    }
+    for (const auto& segment : data_segments) {
+        for (uint32_t word : segment.second) {
+            put(word);
+        }
+    }
+    return bytes;
+}
+
+namespace {
+
+// registers every kernel's loop uses, the bodies work in r10 and up
+constexpr uint8_t COUNTER = 1;
+constexpr uint8_t ONE = 2;
+constexpr uint8_t LIMIT = 3;
+constexpr uint8_t COND = 4;
+
+// each body is unrolled this many times so the loop overhead stays small
+constexpr int UNROLL = 4;
+
+// end_loop stores the body registers r10 to r18 here, so runs can be told apart by their memory
+constexpr uint16_t RESULTS = 0x2000;
+
+// counter = 0, limit = iterations, returns the pc of the loop head
+uint32_t begin_loop(ProgramBuilder& b, uint32_t iterations) {
+    b.loadi(COUNTER, 0);
+    b.loadi(ONE, 1);
+    b.load_const(LIMIT, iterations);
+    return b.here();
+}
+
+// the loop runs at least once, then ends the program
+void end_loop(ProgramBuilder& b, uint32_t head) {
+    b.add(COUNTER, COUNTER, ONE);
+    b.lt(COND, COUNTER, LIMIT);
+    b.jumpif(head, COND);
+    for (uint8_t r=10; r<=18; r++) {
+        b.stored(RESULTS + r - 10, r);
+    }
+    b.end();
+}
+
+ProgramBuilder memory_kernel(const BenchConfig& config) {
+    ProgramBuilder b;
+    b.loadi(20, 0x1000);
+    b.loadi(21, 0x1001);
+    uint32_t head = begin_loop(b, config.iterations);
+    for (int i=0; i<UNROLL; i++) {
+        b.loadi(10, i);
+        b.stored(0x1000 + i, 10);
+        b.loadd(11, 0x1000 + i);
+        b.loadr(12, 20);
+        b.storen(21, 12);
+    }
+    end_loop(b, head);
+    return b;
+}
+
+ProgramBuilder arithmetic_kernel(const BenchConfig& config) {
+    ProgramBuilder b;
+    b.loadi(13, 3);
+    b.load_const(15, 1000000);
+    b.loadi(16, 7);
+    uint32_t head = begin_loop(b, config.iterations);
+    for (int i=0; i<UNROLL; i++) {
+        b.add(10, 10, COUNTER);
+        b.sub(11, 11, ONE);
+        b.mul(12, 12, 13);
+        b.div(14, 15, 16);
+    }
+    end_loop(b, head);
+    return b;
+}
+
+ProgramBuilder logical_kernel(const BenchConfig& config) {
+    ProgramBuilder b;
+    b.loadi(13, 0x55);
+    uint32_t head = begin_loop(b, config.iterations);
+    for (int i=0; i<UNROLL; i++) {
+        b.and_(10, COUNTER, 13);
+        b.or_(11, 10, COUNTER);
+        b.nand(12, 11, 10);
+        b.nor(14, 12, COUNTER);
+        b.xor_(15, 14, 11);
+    }
+    end_loop(b, head);
+    return b;
+}
+
+ProgramBuilder shift_kernel(const BenchConfig& config) {
+    ProgramBuilder b;
+    b.loadi(13, 3);
+    b.loadi(16, 29);
+    uint32_t head = begin_loop(b, config.iterations);
+    for (int i=0; i<UNROLL; i++) {
+        b.lshift(10, COUNTER, 13);
+        b.rshift(11, 10, ONE);
+        b.lshift(12, 11, 16);
+        b.rshift(14, 12, 13);
+    }
+    end_loop(b, head);
+    return b;
+}
+
+ProgramBuilder comparison_kernel(const BenchConfig& config) {
+    ProgramBuilder b;
+    b.load_const(13, config.iterations / 2);
+    uint32_t head = begin_loop(b, config.iterations);
+    for (int i=0; i<UNROLL; i++) {
+        b.lt(10, COUNTER, LIMIT);
+        b.lte(11, COUNTER, 13);
+        b.gt(12, COUNTER, 13);
+        b.gte(14, LIMIT, COUNTER);
+        b.eq(15, 10, 11);
+    }
+    end_loop(b, head);
+    return b;
+}
+
+// every instruction of the body ends a block
+ProgramBuilder control_kernel(const BenchConfig& config) {
+    ProgramBuilder b;
+    b.loadi(13, 4);
+    uint32_t head = begin_loop(b, config.iterations);
+    for (int i=0; i<UNROLL; i++) {
+        b.jump(b.here() + 4);
+        b.jumpdir(13);
+    }
+    end_loop(b, head);
+    return b;
+}
+
+// diamonds on the low counter bits, taken and not taken in different patterns
+ProgramBuilder branch_kernel(const BenchConfig& config) {
+    ProgramBuilder b;
+    b.loadi(13, 1);
+    b.loadi(16, 2);
+    b.loadi(17, 4);
+    b.loadi(18, 8);
+    uint32_t head = begin_loop(b, config.iterations);
+    for (uint8_t mask : {13, 16, 17, 18}) {
+        b.and_(10, COUNTER, mask);
+        b.jumpif(b.here() + 8, 10);
+        b.add(11, 11, ONE);
+    }
+    end_loop(b, head);
+    return b;
+}
+
+// br into a function that calls another one, and a brif on every other trip
+ProgramBuilder call_kernel(const BenchConfig& config) {
+    ProgramBuilder b;
+    b.loadi(13, 1);
+    uint32_t head = begin_loop(b, config.iterations);
+    std::vector<uint32_t> calls_a;
+    std::vector<uint32_t> calls_b;
+    for (int i=0; i<UNROLL; i++) {
+        calls_a.push_back(b.here());
+        b.br(0);
+        b.and_(10, COUNTER, 13);
+        calls_b.push_back(b.here());
+        b.brif(0, 10);
+    }
+    end_loop(b, head);
+
+    uint32_t func_b = b.here();
+    b.add(12, 12, ONE);
+    b.ret();
+
+    uint32_t func_a = b.here();
+    b.add(11, 11, ONE);
+    b.br(func_b);
+    b.ret();
+
+    for (uint32_t pc : calls_a) {
+        b.patch(pc, func_a);
+    }
+    for (uint32_t pc : calls_b) {
+        b.patch(pc, func_b);
+    }
+    return b;
+}
+
+// rewrites the loadi at the end of a hot block every 64 trips, with a storen
+// in that same block, so the block drops out of the cache while it runs
+ProgramBuilder selfmod_kernel(const BenchConfig& config) {
+    ProgramBuilder b;
+    uint32_t to_setup = b.here();
+    b.jump(0);
+
+    uint32_t head = b.here();
+    b.and_(12, COUNTER, 16);
+    uint32_t skip = b.here();
+    b.jumpif(0, 12);
+    b.rshift(12, COUNTER, 18);
+    b.and_(12, 12, 13);
+    b.or_(12, 12, 15); // loadi r10, (counter >> 6) & 0xFF
+    b.storen(14, 12);
+    uint32_t patched = b.here();
+    b.loadi(10, 0);
+    b.add(11, 11, 10);
+    end_loop(b, head);
+    b.patch(skip, patched);
+
+    b.patch(to_setup, b.here());
+    b.loadi(13, 0xFF);
+    b.loadi(14, patched);
+    b.load_const(15, 0x000A0000);
+    b.loadi(16, 63);
+    b.loadi(18, 6);
+    begin_loop(b, config.iterations);
+    b.jump(head);
+    return b;
+}
+
+// two paths picked by the top bit of a linear congruential sequence, no
+// pattern for the successor links or the host's predictors to follow
+ProgramBuilder divergent_kernel(const BenchConfig& config) {
+    ProgramBuilder b;
+    b.load_const(13, 1103515245);
+    b.load_const(16, 12345);
+    b.loadi(17, 31);
+    uint32_t head = begin_loop(b, config.iterations);
+    for (int i=0; i<UNROLL; i++) {
+        b.mul(10, 10, 13);
+        b.add(10, 10, 16);
+        b.rshift(12, 10, 17);
+        uint32_t branch = b.here();
+        b.jumpif(0, 12);
+        b.add(11, 11, ONE);
+        uint32_t join = b.here();
+        b.jump(0);
+        b.patch(branch, b.here());
+        b.sub(14, 14, ONE);
+        b.xor_(15, 15, 10);
+        b.patch(join, b.here());
+    }
+    end_loop(b, head);
+    return b;
+}
+
+// writes and reads back one word in each of sparse_pages guest pages, far
+// above the program
+ProgramBuilder sparse_kernel(const BenchConfig& config) {
+    ProgramBuilder b;
+    b.load_const(13, config.sparse_pages - 1);
+    b.loadi(16, 12); // Memory::OFFSET_BITS, one word per page
+    b.load_const(17, 0x100000);
+    uint32_t head = begin_loop(b, config.iterations);
+    b.and_(10, COUNTER, 13);
+    b.lshift(10, 10, 16);
+    b.add(10, 10, 17);
+    b.storen(10, COUNTER);
+    b.loadr(11, 10);
+    b.add(12, 12, 11);
+    end_loop(b, head);
+    return b;
+}
+
+} // namespace
+
+std::vector<BenchProgram> generate_benchmarks(const BenchConfig& config) {
+    std::vector<BenchProgram> programs = {
+        {"memory", "loadi, stored, loadd, loadr and storen on a few words", memory_kernel(config).image()},
+        {"arithmetic", "add, sub, mul and div", arithmetic_kernel(config).image()},
+        {"logical", "and, or, nand, nor and xor", logical_kernel(config).image()},
+        {"shift", "lshift and rshift", shift_kernel(config).image()},
+        {"comparison", "lt, lte, gt, gte and eq", comparison_kernel(config).image()},
+        {"control", "jump and jumpdir to the next instruction", control_kernel(config).image()},
+        {"branch", "jumpif diamonds taken in alternating patterns", branch_kernel(config).image()},
+        {"call", "br, brif and ret through two levels of functions", call_kernel(config).image()},
+        {"sparse", "storen and loadr spread over many guest pages", sparse_kernel(config).image()},
+        {"selfmod", "storen rewriting an instruction of its own hot block", selfmod_kernel(config).image()},
+        {"divergent", "jumpif on pseudo random bits, two paths that rejoin", divergent_kernel(config).image()},
+    };
+    return programs;
+}
+
+std::vector<uint8_t> table_executable(const BenchConfig& config) {
+    constexpr uint16_t TABLE = 0x3000;
+    constexpr uint16_t SUMS = 0x3010;
+    constexpr uint32_t TABLE_WORDS = 16;
+
+    ProgramBuilder b;
+    b.symbol(b.here(), "main");
+    b.loadi(13, TABLE_WORDS - 1);
+    b.loadi(14, TABLE);
+    b.loadi(15, SUMS);
+    uint32_t head = begin_loop(b, config.iterations);
+    b.symbol(head, "loop");
+    // sum += table[counter % 16], sums[counter % 16] = sum
+    b.and_(16, COUNTER, 13);
+    b.add(17, 16, 14);
+    b.loadr(11, 17);
+    b.add(10, 10, 11);
+    b.add(17, 16, 15);
+    b.storen(17, 10);
+    end_loop(b, head);
+
+    std::vector<uint32_t> table;
+    for (uint32_t i=0; i<TABLE_WORDS; i++) {
+        table.push_back(1000 * i + 7);
+    }
+    b.data(TABLE, table);
+    b.symbol(TABLE, "table");
+    b.zero(SUMS, TABLE_WORDS);
+    b.symbol(SUMS, "sums");
+    return b.executable();
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Assembles a guest program one instruction at a time. Branch targets are
+// absolute pcs, the builder turns them into the pc relative offsets the
+// instructions encode. Forward targets are emitted as 0 and patched later.
+class ProgramBuilder {
+    public:
+        // pc of the next instruction
+        uint32_t here() const { return 4 * words.size(); }
+
+        void loadi(uint8_t rd, int16_t imm) { emit_imm(0x00, rd, (uint16_t) imm); }
+        void loadr(uint8_t rd, uint8_t raddr) { emit(0x01, rd, raddr, 0); }
+        void storen(uint8_t raddr, uint8_t rs) { emit(0x02, raddr, rs, 0); }
+        void stored(uint16_t addr, uint8_t rs) { words.push_back(0x03u << 24 | (uint32_t) addr << 8 | rs); }
+        void loadd(uint8_t rd, uint16_t addr) { emit_imm(0x04, rd, addr); }
+
+        void add(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x10, rd, rs1, rs2); }
+        void sub(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x11, rd, rs1, rs2); }
+        void mul(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x12, rd, rs1, rs2); }
+        void div(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x13, rd, rs1, rs2); }
+
+        void jump(uint32_t target) { words.push_back(0x20u << 24 | (offset(target) & 0xFFFF)); }
+        void jumpdir(uint8_t rs) { emit(0x21, rs, 0, 0); }
+        void jumpif(uint32_t target, uint8_t rcond) { words.push_back(0x22u << 24 | (offset(target) & 0xFFFF) << 8 | rcond); }
+        void ret() { emit(0x24, 0, 0, 0); }
+        void end() { emit(0x25, 0, 0, 0); }
+        void br(uint32_t target) { words.push_back(0x26u << 24 | (offset(target) & 0xFFFFFF)); }
+        void brif(uint32_t target, uint8_t rcond) { words.push_back(0x27u << 24 | (offset(target) & 0xFFFF) << 8 | rcond); }
+
+        void and_(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x30, rd, rs1, rs2); }
+        void or_(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x31, rd, rs1, rs2); }
+        void nand(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x32, rd, rs1, rs2); }
+        void nor(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x33, rd, rs1, rs2); }
+        void xor_(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x34, rd, rs1, rs2); }
+
+        void lshift(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x40, rd, rs1, rs2); }
+        void rshift(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x41, rd, rs1, rs2); }
+
+        void lt(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x50, rd, rs1, rs2); }
+        void lte(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x51, rd, rs1, rs2); }
+        void gt(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x52, rd, rs1, rs2); }
+        void gte(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x53, rd, rs1, rs2); }
+        void eq(uint8_t rd, uint8_t rs1, uint8_t rs2) { emit(0x54, rd, rs1, rs2); }
+
+        // loads any 32-bit value a byte at a time, clobbers SCRATCH
+        void load_const(uint8_t rd, uint32_t val);
+
+        // points the jump, jumpif, br or brif at pc to target
+        void patch(uint32_t pc, uint32_t target);
+
+        const std::vector<uint32_t>& program() const { return words; }
+
+        // the program as a big-endian image, the format load_program() reads
+        std::vector<uint8_t> image() const;
+
+        // words loaded one per address from addr, only executables carry them
+        void data(uint32_t addr, std::vector<uint32_t> values) { data_segments.emplace_back(addr, std::move(values)); }
+        // a range that reads 0, only executables carry it
+        void zero(uint32_t addr, uint32_t count) { zero_segments.emplace_back(addr, count); }
+        // names addr in the symbol table of the executable
+        void symbol(uint32_t addr, std::string name) { symbols.emplace_back(addr, std::move(name)); }
+
+        // the program as a YUEEXEC executable: the code at address 0, then the
+        // data and zero segments and the symbols in the order they were added.
+        // It starts at 0 and halts at the end of the code like a raw image.
+        std::vector<uint8_t> executable() const;
+
+        static constexpr uint8_t SCRATCH = 254;
+        static constexpr uint8_t EIGHT = 253; // holds 8 once load_const has run
+
+    private:
+        std::vector<uint32_t> words;
+        bool eight_loaded = false;
+        std::vector<std::pair<uint32_t, std::vector<uint32_t>>> data_segments;
+        std::vector<std::pair<uint32_t, uint32_t>> zero_segments;
+        std::vector<std::pair<uint32_t, std::string>> symbols;
+
+        // opcode is category << 4 | id, the three register fields are rd, rs1 and rs2
+        void emit(uint32_t opcode, uint8_t rd, uint8_t rs1, uint8_t rs2) {
+            words.push_back(opcode << 24 | (uint32_t) rd << 16 | (uint32_t) rs1 << 8 | rs2);
+        }
+
+        void emit_imm(uint32_t opcode, uint8_t rd, uint16_t imm) {
+            words.push_back(opcode << 24 | (uint32_t) rd << 16 | imm);
+        }
+
+        uint32_t offset(uint32_t target) const { return target - here(); }
+};
+
+// A generated benchmark program
+struct BenchProgram {
+    std::string name;
+    std::string description;
+    std::vector<uint8_t> image;
+};
+
+struct BenchConfig {
+    uint32_t iterations = 1 << 20; // trips around every kernel's loop
+    uint32_t sparse_pages = 1024; // distinct guest pages the sparse kernel writes, a power of two
+};
+
+// Every benchmark kernel in report order. Each one is a counted loop around a
+// body that stresses one kind of instruction, so the loop overhead is the
+// same across kernels.
+std::vector<BenchProgram> generate_benchmarks(const BenchConfig& config);
+
+// Not a benchmark: an executable that sums a table from its data segment into
+// a zero segment, with symbols for its loop and both segments. It ends with
+// the sum of iterations table words in r10, stored at RESULTS like the kernels.
+std::vector<uint8_t> table_executable(const BenchConfig& config);
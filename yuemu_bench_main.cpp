@@ -0,0 +1,224 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__)
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "yuemu.hpp"
+#include "yuemu_bench.hpp"
+
+// Report format, one benchmark per line after the two header lines:
+// # yuemu-bench <FORMAT_VERSION>
+// # name instructions seconds mips ns_per_instr peak_rss_kib
+// seconds is the fastest of the repeated runs, peak_rss_kib covers every run
+// of that benchmark. Columns are only ever added at the end. The version
+// also goes up when the kernels change what they run, so reports with
+// different versions don't compare.
+static constexpr int FORMAT_VERSION = 2;
+
+struct Measurement {
+    bool ok = false;
+    uint64_t instructions = 0;
+    double seconds = 0;
+};
+
+static Measurement measure(const BenchProgram& program, const YuemuOptions& options, unsigned int repeat) {
+    Measurement result;
+    std::ostream discard(nullptr);
+
+    for (unsigned int i=0; i<repeat; i++) {
+        Yuemu yuemu(options);
+        yuemu.set_output(discard, std::cerr);
+        if (!yuemu.load_image(program.image.data(), program.image.size())) {
+            return result;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        Yuemu::StopReason reason = yuemu.run();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        if (reason != Yuemu::StopReason::END) {
+            std::cerr << "Error: benchmark " << program.name << " didn't run to its end instruction\n";
+            return result;
+        }
+        if (i == 0 || elapsed.count() < result.seconds) {
+            result.seconds = elapsed.count();
+        }
+        result.instructions = yuemu.instructions_executed();
+    }
+    result.ok = true;
+    return result;
+}
+
+static long peak_rss_kib() {
+#if defined(__unix__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        return usage.ru_maxrss;
+    }
+#endif
+    return 0;
+}
+
+static bool report(const BenchProgram& program, const YuemuOptions& options, unsigned int repeat) {
+    Measurement m = measure(program, options, repeat);
+    if (!m.ok) {
+        return false;
+    }
+    double mips = m.instructions / m.seconds / 1e6;
+    double ns_per_instr = m.seconds * 1e9 / m.instructions;
+    std::cout << program.name << " " << m.instructions << " "
+              << std::fixed << std::setprecision(6) << m.seconds << " "
+              << std::setprecision(2) << mips << " "
+              << std::setprecision(3) << ns_per_instr << " "
+              << peak_rss_kib() << "\n";
+    std::cout.unsetf(std::ios::floatfield);
+    std::cout.flush();
+    return true;
+}
+
+// each benchmark runs in a child process of its own so its peak RSS isn't
+// hidden by an earlier, bigger one
+static bool run_benchmark(const BenchProgram& program, const YuemuOptions& options, unsigned int repeat) {
+#if defined(__unix__)
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(report(program, options, repeat) ? 0 : 1);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+        std::cerr << "Error: can't start benchmark " << program.name << "\n";
+        return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+    return report(program, options, repeat);
+#endif
+}
+
+int main(int argc, char* argv[]) {
+    YuemuOptions options;
+    BenchConfig config;
+    unsigned int repeat = 3;
+    std::vector<std::string> only;
+    std::string emit_dir;
+    std::string emit_executable;
+    bool list = false;
+
+    for (int i=1; i<argc; i++) {
+        std::string arg(argv[i]);
+        try {
+            if (arg == "--jit") {
+                options.jit = true;
+            } else if (arg == "--no-fuse") {
+                options.fuse = false;
+            } else if (arg.rfind("--iterations=", 0) == 0) {
+                config.iterations = std::stoul(arg.substr(13), nullptr, 0);
+                if (config.iterations == 0) {
+                    throw std::invalid_argument(arg);
+                }
+            } else if (arg.rfind("--pages=", 0) == 0) {
+                // the sparse kernel's addresses have to stay clear of the program
+                config.sparse_pages = std::stoul(arg.substr(8), nullptr, 0);
+                if (config.sparse_pages == 0 || (config.sparse_pages & (config.sparse_pages - 1)) != 0 || config.sparse_pages > (1u << 19)) {
+                    throw std::invalid_argument(arg);
+                }
+            } else if (arg.rfind("--repeat=", 0) == 0) {
+                repeat = std::stoul(arg.substr(9));
+                if (repeat == 0) {
+                    throw std::invalid_argument(arg);
+                }
+            } else if (arg.rfind("--only=", 0) == 0) {
+                only.push_back(arg.substr(7));
+            } else if (arg.rfind("--emit=", 0) == 0) {
+                emit_dir = arg.substr(7);
+            } else if (arg.rfind("--emit-executable=", 0) == 0) {
+                emit_executable = arg.substr(18);
+            } else if (arg == "--list") {
+                list = true;
+            } else {
+                throw std::invalid_argument(arg);
+            }
+        } catch (const std::exception&) {
+            std::cout << "Invalid argument: " << arg << "\n";
+            std::cout << "Usage: yuemu_bench [--jit] [--no-fuse] [--iterations=<n>] [--pages=<power of two>] [--repeat=<n>]\n";
+            std::cout << "                   [--only=<benchmark>]... [--emit=<dir>] [--emit-executable=<path>] [--list]\n";
+            return 1;
+        }
+    }
+
+    // writes the table executable instead of running anything, the loader's test program
+    if (!emit_executable.empty()) {
+        std::vector<uint8_t> image = table_executable(config);
+        std::ofstream file(emit_executable, std::ios::binary);
+        file.write((const char*) image.data(), image.size());
+        if (!file) {
+            std::cerr << "Error: can't write " << emit_executable << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    std::vector<BenchProgram> all = generate_benchmarks(config);
+    for (const std::string& name : only) {
+        bool known = false;
+        for (const BenchProgram& program : all) {
+            known = known || name == program.name;
+        }
+        if (!known) {
+            std::cout << "Unknown benchmark: " << name << ", --list shows them\n";
+            return 1;
+        }
+    }
+
+    std::vector<BenchProgram> programs;
+    for (BenchProgram& program : all) {
+        bool wanted = only.empty();
+        for (const std::string& name : only) {
+            wanted = wanted || name == program.name;
+        }
+        if (wanted) {
+            programs.push_back(std::move(program));
+        }
+    }
+
+    if (list) {
+        for (const BenchProgram& program : programs) {
+            std::cout << program.name << ": " << program.description << "\n";
+        }
+        return 0;
+    }
+
+    // writes the programs as images the emulator can run on its own
+    if (!emit_dir.empty()) {
+        for (const BenchProgram& program : programs) {
+            std::string path = emit_dir + "/" + program.name + ".bin";
+            std::ofstream file(path, std::ios::binary);
+            file.write((const char*) program.image.data(), program.image.size());
+            if (!file) {
+                std::cerr << "Error: can't write " << path << "\n";
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    std::cout << "# yuemu-bench " << FORMAT_VERSION << "\n";
+    std::cout << "# name instructions seconds mips ns_per_instr peak_rss_kib\n";
+    bool ok = true;
+    for (const BenchProgram& program : programs) {
+        ok = run_benchmark(program, options, repeat) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+#include <algorithm>
+
+#include "yuemu_block_cache.hpp"
+
+void BlockCache::set_stop_pcs(uint32_t new_halt_pc, uint32_t new_stop_pc) {
+    if (new_halt_pc != halt_pc || new_stop_pc != stop_pc) {
+        flush();
+        halt_pc = new_halt_pc;
+        stop_pc = new_stop_pc;
+    }
+}
+
+void BlockCache::set_fusion(bool enabled) {
+    if (enabled != fusion) {
+        flush();
+        fusion = enabled;
+    }
+}
+
+void BlockCache::set_breakpoint(uint32_t pc, bool set) {
+    bool changed = set ? breakpoints.insert(pc).second : breakpoints.erase(pc) > 0;
+    if (changed) {
+        invalidate(pc);
+    }
+}
+
+// the op that stands for instr at pc, the original word goes into the block either way
+DecodedOp BlockCache::decode_at(uint32_t pc, uint32_t instr, bool patch) const {
+    if (patch && !breakpoints.empty() && breakpoints.count(pc) != 0) {
+        return {Op::BREAKPOINT, 0, 0, 0, instr};
+    }
+    return decode(instr);
+}
+
+Block* BlockCache::translate(uint32_t pc) {
+    std::unique_ptr<Block> block(new Block());
+    block->start_pc = pc;
+
+    // publish the widest range the block can cover before reading it, a store
+    // from another hart either lands before the reads or sees the range
+    uint64_t limit = std::min<uint64_t>((uint64_t) pc + 4 * MAX_BLOCK_OPS, (uint64_t) UINT32_MAX + 1);
+    if (shared_lo.load(std::memory_order_relaxed) == shared_hi.load(std::memory_order_relaxed)) {
+        shared_lo.store(pc, std::memory_order_relaxed);
+        shared_hi.store(limit, std::memory_order_relaxed);
+    } else {
+        shared_lo.store(std::min<uint64_t>(shared_lo.load(std::memory_order_relaxed), pc), std::memory_order_relaxed);
+        shared_hi.store(std::max<uint64_t>(shared_hi.load(std::memory_order_relaxed), limit), std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    uint64_t addr = pc;
+    while (true) {
+        uint32_t instr = mem.read(addr);
+        DecodedOp op = decode_at(addr, instr, true);
+        block->ops.push_back(op);
+        block->words.push_back(instr);
+        addr += 4;
+
+        if (ends_block(op.op)) {
+            break;
+        }
+
+        // stop before the halt and stop pcs, at the top of the address space and at the length limit
+        if (addr == halt_pc || addr == stop_pc || addr > UINT32_MAX || block->ops.size() == MAX_BLOCK_OPS) {
+            block->ops.push_back({Op::BLOCK_END, 0, 0, 0, 0});
+            block->words.push_back(0);
+            break;
+        }
+    }
+    block->end_pc = addr;
+    if (fusion) {
+        fuse(block->ops);
+    }
+
+    Block* raw = block.get();
+    for (uint64_t g=pc >> GRANULE_BITS; g<=(addr - 1) >> GRANULE_BITS; g++) {
+        blocks_by_granule[g].push_back(raw);
+    }
+
+    if (code_lo == code_hi) {
+        code_lo = pc;
+        code_hi = addr;
+    } else {
+        code_lo = std::min<uint64_t>(code_lo, pc);
+        code_hi = std::max<uint64_t>(code_hi, addr);
+    }
+
+    blocks[pc] = std::move(block);
+    return raw;
+}
+
+void BlockCache::translate_one(uint32_t pc, Block& block, bool patch) const {
+    uint32_t instr = mem.read(pc);
+    DecodedOp op = decode_at(pc, instr, patch);
+    block.start_pc = pc;
+    block.end_pc = (uint64_t) pc + 4;
+    block.ops.assign(1, op);
+    block.words.assign(1, instr);
+    if (!ends_block(op.op)) {
+        block.ops.push_back({Op::BLOCK_END, 0, 0, 0, 0});
+        block.words.push_back(0);
+    }
+    block.next[0] = nullptr;
+    block.next[1] = nullptr;
+    block.exec_count = 0;
+    block.jit_code = nullptr;
+}
+
+bool BlockCache::invalidate_range(uint32_t addr) {
+    auto granule = blocks_by_granule.find(addr >> GRANULE_BITS);
+    if (granule == blocks_by_granule.end()) {
+        return false;
+    }
+
+    std::vector<Block*> hit;
+    for (Block* block : granule->second) {
+        if (addr >= block->start_pc && addr < block->end_pc && (addr - block->start_pc) % 4 == 0) {
+            hit.push_back(block);
+        }
+    }
+    if (hit.empty()) {
+        return false;
+    }
+
+    for (Block* block : hit) {
+        block->valid = false;
+        block->next[0] = nullptr;
+        block->next[1] = nullptr;
+        for (uint64_t g=block->start_pc >> GRANULE_BITS; g<=(block->end_pc - 1) >> GRANULE_BITS; g++) {
+            std::vector<Block*>& list = blocks_by_granule[g];
+            list.erase(std::remove(list.begin(), list.end(), block), list.end());
+        }
+
+        auto it = blocks.find(block->start_pc);
+        retired.push_back(std::move(it->second));
+        blocks.erase(it);
+    }
+
+    // chains may point at the dropped blocks, rebuild them lazily
+    for (auto& entry : blocks) {
+        entry.second->next[0] = nullptr;
+        entry.second->next[1] = nullptr;
+    }
+    return true;
+}
+
+void BlockCache::flush() {
+    for (auto& entry : blocks) {
+        entry.second->valid = false;
+        entry.second->next[0] = nullptr;
+        entry.second->next[1] = nullptr;
+        retired.push_back(std::move(entry.second));
+    }
+    blocks.clear();
+    blocks_by_granule.clear();
+    code_lo = 0;
+    code_hi = 0;
+    shared_lo.store(0, std::memory_order_relaxed);
+    shared_hi.store(0, std::memory_order_relaxed);
+}
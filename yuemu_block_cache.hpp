@@ -0,0 +1,163 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "yuemu_decode.hpp"
+#include "yuemu_memory.hpp"
+
+struct JitContext;
+typedef uint32_t (*JitCode)(JitContext* ctx);
+
+// A straight-line run of decoded instructions. It ends with a control
+// instruction (category 0x2), an invalid instruction, or a BLOCK_END marker
+// when it is cut short at the halt address or the length limit.
+struct Block {
+    uint32_t start_pc;
+    uint64_t end_pc; // address right after the last guest instruction, may be 2^32
+    bool valid = true;
+    std::vector<DecodedOp> ops;
+    std::vector<uint32_t> words; // raw instruction word for each op, 0 for BLOCK_END
+
+    // chained successors: next[0] is the fall-through block at end_pc,
+    // next[1] remembers the most recent other target
+    Block* next[2] = {nullptr, nullptr};
+    uint32_t other_pc = 0;
+
+    // executions so far and the compiled code once the block got hot
+    uint32_t exec_count = 0;
+    JitCode jit_code = nullptr;
+
+    uint64_t instr_count() const {
+        return (end_pc - start_pc) / 4;
+    }
+
+    Block* successor(uint32_t pc) const {
+        if (pc == end_pc) {
+            return next[0];
+        }
+        return (pc == other_pc) ? next[1] : nullptr;
+    }
+
+    void link(uint32_t pc, Block* block) {
+        if (pc == end_pc) {
+            next[0] = block;
+        } else {
+            other_pc = pc;
+            next[1] = block;
+        }
+    }
+};
+
+// Translated blocks keyed by their start pc. Stores that hit an instruction
+// of a cached block drop that block, so self-modifying programs retranslate
+// the code they patch.
+//
+// Breakpoints are patched into the blocks: translation puts a BREAKPOINT op
+// where the instruction at a breakpoint would go, the raw word stays in the
+// block's words. Code without breakpoints runs exactly as without any, and
+// setting or clearing one drops the blocks it lies in.
+//
+// Every hart has its own cache and only its own thread touches it. Stores
+// from other harts can only ask for a flush through request_flush(), which
+// the owner picks up at its next block boundary.
+class BlockCache {
+    public:
+        static constexpr uint32_t MAX_BLOCK_OPS = 256;
+
+        BlockCache(const Memory& mem) : mem(mem) {}
+
+        // blocks stop right before the halt and stop pcs, so the run loop can
+        // check for them between blocks only
+        void set_stop_pcs(uint32_t halt_pc, uint32_t stop_pc);
+
+        // fuses instruction pairs in new blocks, the fused handlers don't trace
+        // or profile so runs that do keep it off
+        void set_fusion(bool enabled);
+
+        Block* lookup(uint32_t pc) {
+            auto it = blocks.find(pc);
+            if (it != blocks.end()) {
+                return it->second.get();
+            }
+            return translate(pc);
+        }
+
+        // fills block with the single instruction at pc, it isn't cached.
+        // Without patch it is the instruction even under a breakpoint, which
+        // is how a hart stopped at one gets past it.
+        void translate_one(uint32_t pc, Block& block, bool patch = true) const;
+
+        // between runs only, while the owning hart is stopped
+        void set_breakpoint(uint32_t pc, bool set);
+
+        // returns true if a cached block covered addr and was dropped
+        bool invalidate(uint32_t addr) {
+            if (addr - code_lo >= code_hi - code_lo) {
+                return false;
+            }
+            return invalidate_range(addr);
+        }
+
+        // true if a block covering addr may be cached, safe to call from any thread
+        bool may_cover(uint32_t addr) const {
+            return addr >= shared_lo.load(std::memory_order_relaxed) && addr < shared_hi.load(std::memory_order_relaxed);
+        }
+
+        // called by other harts after they stored into code this cache may hold
+        void request_flush() {
+            flush_requested.store(true, std::memory_order_relaxed);
+        }
+
+        // drops every block if another hart asked for it, returns true if it did
+        bool handle_flush_request() {
+            if (!flush_requested.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            flush_requested.store(false, std::memory_order_relaxed);
+            flush();
+            return true;
+        }
+
+        // frees dropped blocks once nothing executes from them any more
+        void release_retired() {
+            if (!retired.empty()) {
+                retired.clear();
+            }
+        }
+
+        static bool ends_block(Op op) {
+            return (op >= Op::JUMP && op <= Op::BRIF) || op == Op::INVALID;
+        }
+
+    private:
+        static constexpr uint32_t GRANULE_BITS = 8;
+
+        const Memory& mem;
+        uint32_t halt_pc = 0;
+        uint32_t stop_pc = 0;
+        bool fusion = false;
+        std::unordered_set<uint32_t> breakpoints;
+        std::unordered_map<uint32_t, std::unique_ptr<Block>> blocks;
+        std::unordered_map<uint32_t, std::vector<Block*>> blocks_by_granule;
+        std::vector<std::unique_ptr<Block>> retired;
+
+        // every cached instruction lies in [code_lo, code_hi)
+        uint64_t code_lo = 0;
+        uint64_t code_hi = 0;
+
+        // a superset of [code_lo, code_hi) for other harts, widened before
+        // translation reads the code so their stores can't slip past it
+        std::atomic<uint64_t> shared_lo{0};
+        std::atomic<uint64_t> shared_hi{0};
+        std::atomic<bool> flush_requested{false};
+
+        Block* translate(uint32_t pc);
+        DecodedOp decode_at(uint32_t pc, uint32_t instr, bool patch) const;
+        void flush();
+        bool invalidate_range(uint32_t addr);
+};
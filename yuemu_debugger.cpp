@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include "yuemu_debugger.hpp"
+
+void Debugger::run() {
+    std::string line;
+    std::string last;
+    out << "(yuemu) " << std::flush;
+    while (std::getline(in, line)) {
+        if (line.find_first_not_of(" \t") == std::string::npos) {
+            line = last;
+        }
+        last = line;
+        if (!line.empty() && !execute(line)) {
+            return;
+        }
+        out << "(yuemu) " << std::flush;
+    }
+    out << "\n";
+}
+
+bool Debugger::execute(const std::string& line) {
+    std::istringstream tokens(line);
+    std::string command;
+    tokens >> command;
+    std::string arg;
+    std::string arg2;
+    tokens >> arg >> arg2;
+
+    // a count argument, fallback without one, 0 if it isn't a number
+    auto count = [](const std::string& token, uint64_t fallback) -> uint64_t {
+        if (token.empty()) {
+            return fallback;
+        }
+        try {
+            return std::stoull(token, nullptr, 0);
+        } catch (const std::exception&) {
+            return 0;
+        }
+    };
+
+    if (command == "quit" || command == "q") {
+        return false;
+    } else if (command == "break" || command == "b") {
+        uint32_t pc;
+        if (parse_addr(arg, pc)) {
+            yuemu.add_breakpoint(pc);
+            out << "Breakpoint at " << describe(pc) << "\n";
+        }
+    } else if (command == "watch" || command == "w") {
+        uint32_t addr;
+        uint8_t kinds = arg2 == "r" ? Yuemu::WATCH_READ : arg2 == "w" ? Yuemu::WATCH_WRITE
+            : arg2.empty() || arg2 == "rw" ? Yuemu::WATCH_READ | Yuemu::WATCH_WRITE : 0;
+        if (kinds == 0) {
+            out << "Invalid watch kind: " << arg2 << ", use r, w or rw\n";
+        } else if (parse_addr(arg, addr)) {
+            yuemu.add_watchpoint(addr, kinds);
+            out << "Watchpoint at " << describe(addr) << "\n";
+        }
+    } else if (command == "delete" || command == "d") {
+        uint32_t addr;
+        if (parse_addr(arg, addr)) {
+            bool removed = yuemu.remove_breakpoint(addr);
+            removed = yuemu.remove_watchpoint(addr) || removed;
+            if (!removed) {
+                out << "Nothing set at " << describe(addr) << "\n";
+            }
+        }
+    } else if (command == "list" || command == "l") {
+        for (uint32_t pc : yuemu.get_breakpoints()) {
+            out << "Breakpoint at " << describe(pc) << "\n";
+        }
+        for (const auto& watch : yuemu.get_watchpoints()) {
+            out << "Watchpoint at " << describe(watch.first) << ", "
+                << ((watch.second & Yuemu::WATCH_READ) != 0 ? "r" : "") << ((watch.second & Yuemu::WATCH_WRITE) != 0 ? "w" : "") << "\n";
+        }
+    } else if (command == "continue" || command == "c" || command == "step" || command == "s") {
+        bool step = command[0] == 's';
+        uint64_t n = count(arg, step ? 1 : UINT64_MAX);
+        if (yuemu.halted()) {
+            out << "The program has halted\n";
+        } else if (n == 0) {
+            out << "Invalid count: " << arg << "\n";
+        } else {
+            report(yuemu.run(n));
+        }
+    } else if (command == "rstep" || command == "rs" || command == "rcontinue" || command == "rc") {
+        if (!yuemu.recording()) {
+            out << "Running backwards needs --record\n";
+        } else if (command[1] == 's') {
+            if (!yuemu.reverse_step()) {
+                out << "At the start of the recording\n";
+            }
+            report(Yuemu::StopReason::STOP_PC);
+        } else {
+            Yuemu::StopReason reason = yuemu.reverse_continue();
+            if (reason == Yuemu::StopReason::BUDGET) {
+                out << "Back at the start of the recording\n";
+            }
+            report(reason);
+        }
+    } else if (command == "regs" || command == "r") {
+        uint64_t n = std::min<uint64_t>(count(arg, 8), 256);
+        out << "PC: " << describe(yuemu.get_pc()) << ", Instructions: " << yuemu.instructions_executed() << "\n";
+        for (uint32_t r=0; r<n; r++) {
+            out << "[" << r << "]: " << Yuemu::to_signed(yuemu.get_register(r)) << "\n";
+        }
+    } else if (command == "mem" || command == "m") {
+        uint32_t addr;
+        uint64_t n = count(arg2, 1);
+        if (parse_addr(arg, addr)) {
+            for (uint64_t i=0; i<n; i++) {
+                out << "Address: " << (uint32_t) (addr + i) << ", Value: " << Yuemu::to_signed(yuemu.read_memory(addr + i)) << "\n";
+            }
+        }
+    } else if (command == "disas" || command == "x") {
+        uint32_t pc = yuemu.get_pc();
+        uint64_t n = count(arg2, 8);
+        if (arg.empty() || parse_addr(arg, pc)) {
+            for (uint64_t i=0; i<n; i++) {
+                print_instr(pc + 4 * i);
+            }
+        }
+    } else if (command == "set") {
+        bool is_reg = arg.size() > 1 && arg.size() <= 4 && arg[0] == 'r' && arg.find_first_not_of("0123456789", 1) == std::string::npos
+            && std::stoul(arg.substr(1)) < 256;
+        uint32_t addr = 0;
+        uint32_t val = 0;
+        try {
+            val = std::stoll(arg2, nullptr, 0);
+        } catch (const std::exception&) {
+            out << "Invalid value: " << arg2 << "\n";
+            return true;
+        }
+        if (is_reg) {
+            yuemu.set_register(std::stoul(arg.substr(1)), val);
+        } else if (arg.size() < 2 || arg[0] != '@') {
+            out << "Invalid target: " << arg << ", use r<n> or @<addr>\n";
+        } else if (parse_addr(arg.substr(1), addr)) {
+            yuemu.write_memory(addr, val);
+        }
+    } else {
+        out << "Unknown command: " << command << "\n";
+    }
+    return true;
+}
+
+bool Debugger::parse_addr(const std::string& token, uint32_t& addr) const {
+    if (yuemu.get_symbols().find(token, addr)) {
+        return true;
+    }
+    try {
+        size_t end = 0;
+        unsigned long long val = std::stoull(token, &end, 0);
+        if (end == token.size() && val <= UINT32_MAX) {
+            addr = val;
+            return true;
+        }
+    } catch (const std::exception&) {
+    }
+    out << "Invalid address: " << token << "\n";
+    return false;
+}
+
+// the run already printed why a halted program stopped
+void Debugger::report(Yuemu::StopReason reason) {
+    if (yuemu.halted()) {
+        return;
+    }
+    if (reason == Yuemu::StopReason::BREAKPOINT) {
+        out << "Breakpoint at " << describe(yuemu.get_pc()) << "\n";
+    } else if (reason == Yuemu::StopReason::WATCHPOINT) {
+        out << "Watchpoint: " << (yuemu.get_watch_write() ? "store to " : "load from ") << describe(yuemu.get_watch_addr()) << "\n";
+    }
+    print_instr(yuemu.get_pc());
+}
+
+// => marks the current pc, * a breakpoint
+void Debugger::print_instr(uint32_t pc) {
+    const std::vector<uint32_t>& breakpoints = yuemu.get_breakpoints();
+    bool breakpoint = std::find(breakpoints.begin(), breakpoints.end(), pc) != breakpoints.end();
+    out << (pc == yuemu.get_pc() ? "=> " : "   ") << (breakpoint ? "* " : "  ") << describe(pc) << ": "
+        << disassemble(yuemu.read_memory(pc)) << "\n";
+}
+
+std::string Debugger::describe(uint32_t addr) const {
+    std::string symbol = yuemu.get_symbols().describe(addr);
+    return symbol.empty() ? std::to_string(addr) : std::to_string(addr) + " (" + symbol + ")";
+}
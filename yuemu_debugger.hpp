@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+
+#include "yuemu.hpp"
+
+// Interactive prompt over a loaded instance. It reads one command per line,
+// runs the program in between and shows where the first hart stopped. An
+// address is a number (0x for hex) or a symbol of the executable, a bare
+// command repeats with an empty line.
+//   break <pc>             stops right before the instruction at pc
+//   watch <addr> [r|w|rw]  stops right after an instruction that loads from
+//                          or stores to addr, both by default
+//   delete <pc|addr>       drops the breakpoint or watchpoint there
+//   list                   shows the breakpoints and watchpoints
+//   continue [n]           runs until something stops it, at most n instructions
+//   step [n]               runs n instructions, 1 by default
+//   rstep, rcontinue       the same backwards, with --record
+//   regs [n]               shows pc and the first n registers, 8 by default
+//   mem <addr> [n]         shows n words from addr, 1 by default
+//   disas [pc] [n]         disassembles n instructions from pc, 8 from the current one by default
+//   set r<n>|@<addr> <v>   changes a register or a memory word
+//   quit
+class Debugger {
+    public:
+        Debugger(Yuemu& yuemu, std::istream& in, std::ostream& out) : yuemu(yuemu), in(in), out(out) {}
+
+        // until quit or the end of the input
+        void run();
+
+    private:
+        Yuemu& yuemu;
+        std::istream& in;
+        std::ostream& out;
+
+        bool execute(const std::string& line); // false on quit
+        bool parse_addr(const std::string& token, uint32_t& addr) const;
+        void report(Yuemu::StopReason reason);
+        void print_instr(uint32_t pc);
+        std::string describe(uint32_t addr) const; // "n" or "n (symbol)"
+};
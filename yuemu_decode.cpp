@@ -0,0 +1,265 @@
+#include <cstddef>
+#include <iomanip>
+#include <sstream>
+
+#include "yuemu_decode.hpp"
+
+namespace {
+
+// How a format fills the DecodedOp slots: a slot is instr >> shift & mask, a
+// zero mask leaves it empty. The immediate is sign extended from imm_sign the
+// way sign_extend() does it, an immediate with imm_sign 0 stays as it is.
+struct Operands {
+    uint8_t rd_shift, rd_mask;
+    uint8_t rs1_shift, rs1_mask;
+    uint8_t rs2_shift, rs2_mask;
+    uint8_t imm_shift;
+    uint32_t imm_mask;
+    uint32_t imm_sign;
+};
+
+// instruction fields by the bit they start at
+constexpr uint32_t FIELD_RD = 16;
+constexpr uint32_t FIELD_RS1 = 8;
+constexpr uint32_t FIELD_RS2 = 0;
+constexpr uint32_t NO_FIELD = 32;
+
+// the fields that go into rd, rs1 and rs2, then the immediate: the bit it
+// starts at, its width and how many bits of it are sign extended, 0 for none
+constexpr Operands operands(uint32_t rd, uint32_t rs1, uint32_t rs2,
+                            uint32_t imm_shift = 0, uint32_t imm_bits = 0, uint32_t imm_sign_bits = 0) {
+    Operands o = {};
+    o.rd_shift = rd == NO_FIELD ? 0 : rd;
+    o.rd_mask = rd == NO_FIELD ? 0 : 0xFF;
+    o.rs1_shift = rs1 == NO_FIELD ? 0 : rs1;
+    o.rs1_mask = rs1 == NO_FIELD ? 0 : 0xFF;
+    o.rs2_shift = rs2 == NO_FIELD ? 0 : rs2;
+    o.rs2_mask = rs2 == NO_FIELD ? 0 : 0xFF;
+    o.imm_shift = imm_shift;
+    o.imm_mask = imm_bits == 32 ? 0xFFFFFFFF : (1u << imm_bits) - 1;
+    o.imm_sign = imm_sign_bits == 0 ? 0 : 1u << (imm_sign_bits - 1);
+    return o;
+}
+
+constexpr Operands operands_of(Format format) {
+    switch (format) {
+        case Format::NONE: return operands(NO_FIELD, NO_FIELD, NO_FIELD);
+        case Format::RD_IMM: return operands(FIELD_RD, NO_FIELD, NO_FIELD, 0, 16, 16);
+        case Format::RD_RADDR: return operands(FIELD_RD, FIELD_RS1, NO_FIELD);
+        case Format::RADDR_RS: return operands(NO_FIELD, FIELD_RD, FIELD_RS1);
+        case Format::ADDR_RS: return operands(NO_FIELD, NO_FIELD, FIELD_RS2, 8, 16);
+        case Format::RD_ADDR: return operands(FIELD_RD, NO_FIELD, NO_FIELD, 0, 16);
+        case Format::RD_RS1_RS2: return operands(FIELD_RD, FIELD_RS1, FIELD_RS2);
+        case Format::JUMP_OFFSET: return operands(NO_FIELD, NO_FIELD, NO_FIELD, 0, 24, 16);
+        case Format::RS: return operands(NO_FIELD, FIELD_RD, NO_FIELD);
+        case Format::OFFSET_RCOND: return operands(NO_FIELD, NO_FIELD, FIELD_RS2, 8, 16, 16);
+        case Format::RS_RCOND: return operands(NO_FIELD, FIELD_RD, FIELD_RS2);
+        case Format::BR_OFFSET: return operands(NO_FIELD, NO_FIELD, NO_FIELD, 0, 24, 24);
+        case Format::RAW: return operands(NO_FIELD, NO_FIELD, NO_FIELD, 0, 32);
+    }
+    return operands(NO_FIELD, NO_FIELD, NO_FIELD);
+}
+
+constexpr size_t FORMAT_COUNT = (size_t) Format::RAW + 1;
+
+struct FormatTable {
+    Operands formats[FORMAT_COUNT];
+};
+
+constexpr FormatTable make_format_table() {
+    FormatTable table = {};
+    for (size_t f=0; f<FORMAT_COUNT; f++) {
+        table.formats[f] = operands_of((Format) f);
+    }
+    return table;
+}
+
+constexpr FormatTable format_table = make_format_table();
+
+struct DecodeEntry {
+    Op op;
+    Format format;
+};
+
+struct DecodeTable {
+    DecodeEntry entries[256]; // by opcode byte
+};
+
+constexpr DecodeTable make_decode_table() {
+    DecodeTable table = {};
+    for (uint32_t byte=0; byte<256; byte++) {
+        table.entries[byte] = {Op::INVALID, Format::RAW};
+    }
+    // shift and comparison ids with no instruction have always been ignored
+    for (uint32_t id=0; id<16; id++) {
+        table.entries[0x40 | id] = {Op::NOP, Format::NONE};
+        table.entries[0x50 | id] = {Op::NOP, Format::NONE};
+    }
+    #define YUEMU_ISA_ENTRY(name, opcode, mnemonic, format) table.entries[opcode] = {Op::name, Format::format};
+    YUEMU_ISA(YUEMU_ISA_ENTRY)
+    #undef YUEMU_ISA_ENTRY
+    return table;
+}
+
+constexpr DecodeTable decode_table = make_decode_table();
+
+} // namespace
+
+DecodedOp decode(uint32_t instr) {
+    const DecodeEntry& entry = decode_table.entries[instr >> 24];
+    const Operands& o = format_table.formats[(size_t) entry.format];
+    uint32_t imm = instr >> o.imm_shift & o.imm_mask;
+    return {
+        entry.op,
+        (uint8_t) (instr >> o.rd_shift & o.rd_mask),
+        (uint8_t) (instr >> o.rs1_shift & o.rs1_mask),
+        (uint8_t) (instr >> o.rs2_shift & o.rs2_mask),
+        (imm ^ o.imm_sign) - o.imm_sign,
+    };
+}
+
+std::string disassemble(uint32_t instr) {
+    DecodedOp op = decode(instr);
+    auto reg = [](uint32_t r) { return "r" + std::to_string(r); };
+    std::string text = op_name(op.op);
+
+    switch (decode_table.entries[instr >> 24].format) {
+        case Format::NONE: break;
+        case Format::RD_IMM: text += " " + reg(op.rd) + ", " + std::to_string((int32_t) op.imm); break;
+        case Format::RD_RADDR: text += " " + reg(op.rd) + ", [" + reg(op.rs1) + "]"; break;
+        case Format::RADDR_RS: text += " [" + reg(op.rs1) + "], " + reg(op.rs2); break;
+        case Format::ADDR_RS: text += " [" + std::to_string(op.imm) + "], " + reg(op.rs2); break;
+        case Format::RD_ADDR: text += " " + reg(op.rd) + ", [" + std::to_string(op.imm) + "]"; break;
+        case Format::RD_RS1_RS2: text += " " + reg(op.rd) + ", " + reg(op.rs1) + ", " + reg(op.rs2); break;
+        case Format::JUMP_OFFSET:
+        case Format::BR_OFFSET: text += " " + std::to_string((int32_t) op.imm); break;
+        case Format::RS: text += " " + reg(op.rs1); break;
+        case Format::OFFSET_RCOND: text += " " + std::to_string((int32_t) op.imm) + ", " + reg(op.rs2); break;
+        case Format::RS_RCOND: text += " " + reg(op.rs1) + ", " + reg(op.rs2); break;
+        case Format::RAW: {
+            std::stringstream ss;
+            ss << ".word 0x" << std::uppercase << std::hex << std::setw(8) << std::setfill('0') << instr;
+            text = ss.str();
+            break;
+        }
+    }
+    return text;
+}
+
+const char* op_name(Op op) {
+    static const char* const names[] = {
+        #define YUEMU_ISA_NAME(name, opcode, mnemonic, format) mnemonic,
+        YUEMU_ISA(YUEMU_ISA_NAME)
+        #undef YUEMU_ISA_NAME
+        "nop", "block_end", "invalid", "breakpoint",
+        "lt+jumpif", "lte+jumpif", "gt+jumpif", "gte+jumpif", "eq+jumpif",
+        "loadi+add", "loadi+sub", "loadi+mul", "loadi+and", "loadi+or", "loadi+xor", "loadi+lshift", "loadi+rshift",
+        "add+loadr", "add+storen",
+    };
+    return names[(int) op];
+}
+
+const char* op_category(Op op) {
+    static const char* const categories[] = {"memory", "arithmetic", "control", "logical", "shift", "comparison"};
+    static const int opcodes[] = {
+        #define YUEMU_ISA_OPCODE(name, opcode, mnemonic, format) opcode,
+        YUEMU_ISA(YUEMU_ISA_OPCODE)
+        #undef YUEMU_ISA_OPCODE
+    };
+    if (unfused(op) != op) {
+        return "fused";
+    }
+    size_t i = (size_t) op;
+    return i < sizeof(opcodes) / sizeof(opcodes[0]) ? categories[opcodes[i] >> 4] : "other";
+}
+
+namespace {
+
+// the fused op for first followed by second, or first's own op when they don't pair up
+Op fused(const DecodedOp& first, const DecodedOp& second) {
+    switch (first.op) {
+        case Op::LT:
+        case Op::LTE:
+        case Op::GT:
+        case Op::GTE:
+        case Op::EQ: {
+            if (second.op != Op::JUMPIF || second.rs2 != first.rd) {
+                break;
+            }
+            switch (first.op) {
+                case Op::LT: return Op::LT_JUMPIF;
+                case Op::LTE: return Op::LTE_JUMPIF;
+                case Op::GT: return Op::GT_JUMPIF;
+                case Op::GTE: return Op::GTE_JUMPIF;
+                default: return Op::EQ_JUMPIF;
+            }
+        }
+
+        case Op::LOADI: {
+            if (second.rs1 != first.rd && second.rs2 != first.rd) {
+                break;
+            }
+            switch (second.op) {
+                case Op::ADD: return Op::LOADI_ADD;
+                case Op::SUB: return Op::LOADI_SUB;
+                case Op::MUL: return Op::LOADI_MUL;
+                case Op::AND: return Op::LOADI_AND;
+                case Op::OR: return Op::LOADI_OR;
+                case Op::XOR: return Op::LOADI_XOR;
+                case Op::LSHIFT: return Op::LOADI_LSHIFT;
+                case Op::RSHIFT: return Op::LOADI_RSHIFT;
+                default: break;
+            }
+            break;
+        }
+
+        case Op::ADD: {
+            if (second.rs1 != first.rd) {
+                break;
+            }
+            if (second.op == Op::LOADR) {
+                return Op::ADD_LOADR;
+            }
+            if (second.op == Op::STOREN) {
+                return Op::ADD_STOREN;
+            }
+            break;
+        }
+
+        default: break;
+    }
+    return first.op;
+}
+
+} // namespace
+
+void fuse(std::vector<DecodedOp>& ops) {
+    for (size_t i=0; i+1<ops.size(); i++) {
+        Op op = fused(ops[i], ops[i + 1]);
+        if (op != ops[i].op) {
+            ops[i].op = op;
+            i++; // the second op of a pair doesn't start another one
+        }
+    }
+}
+
+Op unfused(Op op) {
+    switch (op) {
+        case Op::LT_JUMPIF: return Op::LT;
+        case Op::LTE_JUMPIF: return Op::LTE;
+        case Op::GT_JUMPIF: return Op::GT;
+        case Op::GTE_JUMPIF: return Op::GTE;
+        case Op::EQ_JUMPIF: return Op::EQ;
+        case Op::LOADI_ADD:
+        case Op::LOADI_SUB:
+        case Op::LOADI_MUL:
+        case Op::LOADI_AND:
+        case Op::LOADI_OR:
+        case Op::LOADI_XOR:
+        case Op::LOADI_LSHIFT:
+        case Op::LOADI_RSHIFT: return Op::LOADI;
+        case Op::ADD_LOADR:
+        case Op::ADD_STOREN: return Op::ADD;
+        default: return op;
+    }
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The instruction set, one line per instruction: the operation it decodes to,
+// its opcode byte (category << 4 | id), its mnemonic and where its operands
+// are, see Format. The Op enum, the decode table, the dispatch table and the
+// disassembler are all generated from this list.
+#define YUEMU_ISA(X) \
+    X(LOADI, 0x00, "loadi", RD_IMM) \
+    X(LOADR, 0x01, "loadr", RD_RADDR) \
+    X(STOREN, 0x02, "storen", RADDR_RS) \
+    X(STORED, 0x03, "stored", ADDR_RS) \
+    X(LOADD, 0x04, "loadd", RD_ADDR) \
+    X(ADD, 0x10, "add", RD_RS1_RS2) \
+    X(SUB, 0x11, "sub", RD_RS1_RS2) \
+    X(MUL, 0x12, "mul", RD_RS1_RS2) \
+    X(DIV, 0x13, "div", RD_RS1_RS2) \
+    X(JUMP, 0x20, "jump", JUMP_OFFSET) \
+    X(JUMPDIR, 0x21, "jumpdir", RS) \
+    X(JUMPIF, 0x22, "jumpif", OFFSET_RCOND) \
+    X(JUMPIFDIR, 0x23, "jumpifdir", RS_RCOND) \
+    X(RET, 0x24, "ret", NONE) \
+    X(END, 0x25, "end", NONE) \
+    X(BR, 0x26, "br", BR_OFFSET) \
+    X(BRIF, 0x27, "brif", OFFSET_RCOND) \
+    X(AND, 0x30, "and", RD_RS1_RS2) \
+    X(OR, 0x31, "or", RD_RS1_RS2) \
+    X(NAND, 0x32, "nand", RD_RS1_RS2) \
+    X(NOR, 0x33, "nor", RD_RS1_RS2) \
+    X(XOR, 0x34, "xor", RD_RS1_RS2) \
+    X(LSHIFT, 0x40, "lshift", RD_RS1_RS2) \
+    X(RSHIFT, 0x41, "rshift", RD_RS1_RS2) \
+    X(LT, 0x50, "lt", RD_RS1_RS2) \
+    X(LTE, 0x51, "lte", RD_RS1_RS2) \
+    X(GT, 0x52, "gt", RD_RS1_RS2) \
+    X(GTE, 0x53, "gte", RD_RS1_RS2) \
+    X(EQ, 0x54, "eq", RD_RS1_RS2)
+
+// Every operation the decoder can produce, in dispatch table order: the
+// instruction set, then the ops that don't have an opcode of their own.
+// Users take the name and ignore the rest.
+#define YUEMU_OPS(X) \
+    YUEMU_ISA(X) \
+    X(NOP) X(BLOCK_END) X(INVALID) X(BREAKPOINT) \
+    X(LT_JUMPIF) X(LTE_JUMPIF) X(GT_JUMPIF) X(GTE_JUMPIF) X(EQ_JUMPIF) \
+    X(LOADI_ADD) X(LOADI_SUB) X(LOADI_MUL) X(LOADI_AND) X(LOADI_OR) X(LOADI_XOR) X(LOADI_LSHIFT) X(LOADI_RSHIFT) \
+    X(ADD_LOADR) X(ADD_STOREN)
+
+enum class Op : uint8_t {
+    #define YUEMU_OP_ENUM(name, ...) name,
+    YUEMU_OPS(YUEMU_OP_ENUM)
+    #undef YUEMU_OP_ENUM
+};
+
+constexpr size_t OP_COUNT = 0
+    #define YUEMU_OP_COUNT(name, ...) + 1
+    YUEMU_OPS(YUEMU_OP_COUNT)
+    #undef YUEMU_OP_COUNT
+    ;
+
+// Where an instruction keeps its operands: rd is bits 23:16, rs1 15:8 and
+// rs2 7:0 of the word, immediates take the bits the registers don't.
+// The names list the operands in disassembly order.
+enum class Format : uint8_t {
+    NONE,
+    RD_IMM,       // rd, 16 bit signed imm
+    RD_RADDR,     // rd, rs1=raddr
+    RADDR_RS,     // rs1=raddr from the rd field, rs2=rs from the rs1 field
+    ADDR_RS,      // imm=16 bit address in bits 23:8, rs2=rs
+    RD_ADDR,      // rd, imm=16 bit address
+    RD_RS1_RS2,
+    JUMP_OFFSET,  // imm=24 bit offset, sign extended from bit 15 as it has always been
+    RS,           // rs1=rs from the rd field
+    OFFSET_RCOND, // imm=16 bit signed offset in bits 23:8, rs2=rcond
+    RS_RCOND,     // rs1=rs from the rd field, rs2=rcond
+    BR_OFFSET,    // imm=24 bit signed offset
+    RAW,          // imm=the whole word
+};
+
+// An instruction with its fields already extracted and immediates sign extended.
+// Register operands use the same slots for every format, see Format.
+// INVALID keeps the raw instruction word in imm for error reporting.
+// BLOCK_END is never decoded, it marks a block that was cut short.
+// BREAKPOINT isn't either, it takes the place of the instruction under a
+// breakpoint, see BlockCache. The fused ops after it aren't, see fuse().
+struct DecodedOp {
+    Op op;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint32_t imm;
+};
+
+// sign extends the low bits of val, as many as bits says, the rest is ignored
+constexpr uint32_t sign_extend(uint32_t val, uint32_t bits) {
+    uint32_t sign = 1u << (bits - 1);
+    uint32_t mask = sign | (sign - 1);
+    return ((val & mask) ^ sign) - sign;
+}
+
+template <uint32_t BITS>
+constexpr uint32_t sign_extend(uint32_t val) {
+    static_assert(BITS > 0 && BITS <= 32, "sign_extend takes 1 to 32 bits");
+    return sign_extend(val, BITS);
+}
+
+// One lookup in a table indexed by the opcode byte. Shift and comparison ids
+// past the last instruction have always decoded to a nop, every other unknown
+// opcode decodes to INVALID.
+DecodedOp decode(uint32_t instr);
+
+// the instruction in assembler syntax, e.g. "add r1, r2, r3" or "jumpif -8, r4"
+std::string disassemble(uint32_t instr);
+
+// the instruction category of an operation: "memory", "arithmetic", "control",
+// "logical", "shift" or "comparison", "fused" for a fused pair and "other"
+// for the ops that aren't instructions
+const char* op_category(Op op);
+
+// assembler mnemonic of an operation, jumpif direct shows up as "jumpifdir",
+// a fused pair as both mnemonics joined by a '+'
+const char* op_name(Op op);
+
+// Turns the first op of every pair our compiler emits back to back into a
+// fused op that runs both: a comparison and the jumpif on its result, a
+// loadi and the ALU op reading it, an add and the loadr or storen using the
+// sum as the address. The second op stays where it was with its own fields,
+// so ops still line up with their pcs; the fused handler reads it from there
+// and skips it. Both register writes still happen.
+void fuse(std::vector<DecodedOp>& ops);
+
+// the op a fused op starts with, any other op unchanged
+Op unfused(Op op);
@@ -0,0 +1,198 @@
+#include <algorithm>
+
+#include "yuemu_devices.hpp"
+
+Devices::Devices(uint32_t harts, std::ostream* console)
+    : console(console),
+      latched_high(harts, 0),
+      start(std::chrono::steady_clock::now()) {
+    console_buffer.reserve(CONSOLE_BUFFER);
+}
+
+Devices::~Devices() {
+    flush_console();
+}
+
+void Devices::set_console(std::ostream* new_console) {
+    std::lock_guard<std::mutex> guard(lock);
+    write_console();
+    console = new_console;
+}
+
+bool Devices::open_files(const std::string& input_path, const std::string& output_path, std::ostream& err) {
+    bool ok = true;
+    if (!input_path.empty()) {
+        input.open(input_path, std::ios::binary | std::ios::ate);
+        if (!input) {
+            err << "Error: can't open input file: " << input_path << "\n";
+            ok = false;
+        } else {
+            input_words = (uint64_t) input.tellg() / 4;
+            input.seekg(0);
+        }
+    }
+    if (!output_path.empty()) {
+        output.open(output_path, std::ios::binary | std::ios::trunc);
+        if (!output) {
+            err << "Error: can't open output file: " << output_path << "\n";
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+uint32_t Devices::load(uint32_t hart, uint32_t addr, uint64_t retired) {
+    std::lock_guard<std::mutex> guard(lock);
+    switch (addr) {
+        case INSTRET_LO:
+            latched_high[hart] = retired >> 32;
+            return (uint32_t) retired;
+        case TIME_LO: {
+            uint64_t us = read_clock(retired);
+            latched_high[hart] = us >> 32;
+            return (uint32_t) us;
+        }
+        case INSTRET_HI:
+        case TIME_HI:
+            return latched_high[hart];
+        case FILE_ADDR: return transfer_addr;
+        case FILE_COUNT: return transfer_count;
+        case FILE_LEFT: return (uint32_t) std::min<uint64_t>(input_words - input_pos, UINT32_MAX);
+        default: return 0;
+    }
+}
+
+uint32_t Devices::store(uint32_t addr, uint32_t val, Memory& mem, uint32_t& written_addr) {
+    std::lock_guard<std::mutex> guard(lock);
+    switch (addr) {
+        case CONSOLE_PUTC: {
+            char c = (char) val;
+            if (!replaying) {
+                put(&c, 1);
+            }
+            break;
+        }
+        case CONSOLE_PUTINT: {
+            std::string text = std::to_string((int32_t) val);
+            if (!replaying) {
+                put(text.data(), text.size());
+            }
+            break;
+        }
+        case CONSOLE_FLUSH:
+            write_console();
+            break;
+        case FILE_ADDR:
+            transfer_addr = val;
+            break;
+        case FILE_COUNT:
+            transfer_count = val;
+            break;
+        case FILE_READ:
+            written_addr = transfer_addr;
+            return read_file(mem);
+        case FILE_WRITE:
+            write_file(mem);
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+Devices::State Devices::save_state() {
+    std::lock_guard<std::mutex> guard(lock);
+    return State{latched_high, input_pos, transfer_addr, transfer_count};
+}
+
+void Devices::restore_state(const State& state) {
+    std::lock_guard<std::mutex> guard(lock);
+    latched_high = state.latched_high;
+    transfer_addr = state.transfer_addr;
+    transfer_count = state.transfer_count;
+    if (input.is_open() && state.input_pos != input_pos) {
+        input.clear();
+        input.seekg((std::streamoff) state.input_pos * 4);
+    }
+    input_pos = state.input_pos;
+}
+
+// a replayed read gets the value the recording logged for the same instruction
+uint64_t Devices::read_clock(uint64_t retired) {
+    if (replaying) {
+        auto logged = std::lower_bound(clock_log.begin(), clock_log.end(), std::make_pair(retired, uint64_t(0)));
+        if (logged != clock_log.end() && logged->first == retired) {
+            return logged->second;
+        }
+    }
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    if (recording && !replaying) {
+        clock_log.emplace_back(retired, us);
+    }
+    return us;
+}
+
+void Devices::flush_console() {
+    std::lock_guard<std::mutex> guard(lock);
+    write_console();
+}
+
+void Devices::put(const char* data, size_t len) {
+    if (console_buffer.size() + len > CONSOLE_BUFFER) {
+        write_console();
+    }
+    console_buffer.append(data, len);
+}
+
+void Devices::write_console() {
+    if (!console_buffer.empty() && console != nullptr) {
+        console->write(console_buffer.data(), console_buffer.size());
+        console->flush();
+    }
+    console_buffer.clear();
+}
+
+uint32_t Devices::pending_read(uint32_t& addr) {
+    std::lock_guard<std::mutex> guard(lock);
+    addr = transfer_addr;
+    return read_count();
+}
+
+// transfers stop short of the device range, the words they moved are left in FILE_COUNT
+uint32_t Devices::read_count() const {
+    uint64_t room = is_device(transfer_addr) ? 0 : BASE - transfer_addr;
+    return (uint32_t) std::min<uint64_t>({transfer_count, room, input_words - input_pos});
+}
+
+uint32_t Devices::read_file(Memory& mem) {
+    uint32_t count = read_count();
+
+    std::vector<uint8_t> bytes((size_t) count * 4);
+    input.read((char*) bytes.data(), bytes.size());
+    for (uint32_t i=0; i<count; i++) {
+        const uint8_t* b = &bytes[4 * i];
+        mem.write(transfer_addr + i, (uint32_t) b[0] << 24 | (uint32_t) b[1] << 16 | (uint32_t) b[2] << 8 | b[3]);
+    }
+    input_pos += count;
+    transfer_count = count;
+    return count;
+}
+
+uint32_t Devices::write_file(const Memory& mem) {
+    uint64_t room = is_device(transfer_addr) ? 0 : BASE - transfer_addr;
+    uint32_t count = output.is_open() ? (uint32_t) std::min<uint64_t>(transfer_count, room) : 0;
+
+    std::vector<uint8_t> bytes((size_t) count * 4);
+    for (uint32_t i=0; i<count; i++) {
+        uint32_t word = mem.read(transfer_addr + i);
+        bytes[4 * i] = word >> 24;
+        bytes[4 * i + 1] = word >> 16;
+        bytes[4 * i + 2] = word >> 8;
+        bytes[4 * i + 3] = word;
+    }
+    if (!replaying) {
+        output.write((const char*) bytes.data(), bytes.size());
+    }
+    transfer_count = count;
+    return count;
+}
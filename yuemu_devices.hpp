@@ -0,0 +1,123 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "yuemu_memory.hpp"
+
+// Host devices behind the top 64Ki addresses. Loads and stores there never
+// reach guest memory; every other address costs the run loop one compare.
+// Direct loads and stores only reach 16-bit addresses, so only loadr and
+// storen can get here.
+//
+//   console   0xFFFF0000  write: the low byte as a character
+//             0xFFFF0001  write: the value as a signed decimal number
+//             0xFFFF0002  write: flush what the console holds so far
+//   counters  0xFFFF0010  read: instructions this hart retired before the load, low word
+//             0xFFFF0011  read: the high word of the last low word this hart read
+//             0xFFFF0012  read: host microseconds since the machine was made, low word
+//             0xFFFF0013  read: the high word of the last low word this hart read
+//   file      0xFFFF0020  read/write: guest address of the next transfer
+//             0xFFFF0021  read/write: word count of the next transfer, reads back
+//                         the words the last transfer moved
+//             0xFFFF0022  write: moves words from the input file to guest memory
+//             0xFFFF0023  write: moves words from guest memory to the output file
+//             0xFFFF0024  read: words left in the input file
+//
+// The files hold big-endian words like program images. Any other address in
+// the range reads as 0 and ignores writes. The console collects output and
+// hands it to the host in CONSOLE_BUFFER sized writes, when the program
+// flushes it and whenever the machine stops running.
+class Devices {
+    public:
+        static constexpr uint32_t BASE = 0xFFFF0000;
+
+        static constexpr uint32_t CONSOLE_PUTC = BASE + 0x00;
+        static constexpr uint32_t CONSOLE_PUTINT = BASE + 0x01;
+        static constexpr uint32_t CONSOLE_FLUSH = BASE + 0x02;
+        static constexpr uint32_t INSTRET_LO = BASE + 0x10;
+        static constexpr uint32_t INSTRET_HI = BASE + 0x11;
+        static constexpr uint32_t TIME_LO = BASE + 0x12;
+        static constexpr uint32_t TIME_HI = BASE + 0x13;
+        static constexpr uint32_t FILE_ADDR = BASE + 0x20;
+        static constexpr uint32_t FILE_COUNT = BASE + 0x21;
+        static constexpr uint32_t FILE_READ = BASE + 0x22;
+        static constexpr uint32_t FILE_WRITE = BASE + 0x23;
+        static constexpr uint32_t FILE_LEFT = BASE + 0x24;
+
+        static constexpr size_t CONSOLE_BUFFER = 1 << 16; // bytes
+
+        static bool is_device(uint32_t addr) { return addr >= BASE; }
+
+        Devices(uint32_t harts, std::ostream* console);
+        ~Devices();
+        Devices(const Devices&) = delete;
+        Devices& operator=(const Devices&) = delete;
+
+        // flushes what the old console holds first
+        void set_console(std::ostream* console);
+
+        // empty paths leave that direction unconnected, transfers on it move nothing
+        bool open_files(const std::string& input_path, const std::string& output_path, std::ostream& err);
+
+        uint32_t load(uint32_t hart, uint32_t addr, uint64_t retired);
+
+        // returns the number of words a file read wrote to guest memory starting
+        // at written_addr, 0 for every other store
+        uint32_t store(uint32_t addr, uint32_t val, Memory& mem, uint32_t& written_addr);
+
+        void flush_console();
+
+        // the guest words a store to FILE_READ would write now, starting at addr
+        uint32_t pending_read(uint32_t& addr);
+
+        // Record and replay, see Recorder. While recording every clock read is
+        // logged with the index of the instruction that made it, the only
+        // input that comes out differently the second time. Replaying hands
+        // the logged values back and keeps writes that already happened from
+        // reaching the console and the output file again.
+        struct State {
+            std::vector<uint32_t> latched_high;
+            uint64_t input_pos;
+            uint32_t transfer_addr;
+            uint32_t transfer_count;
+        };
+        State save_state();
+        void restore_state(const State& state); // moves the input file back to its read position
+        void set_recording(bool on) { recording = on; }
+        void set_replaying(bool on) { replaying = on; }
+        size_t clock_reads() const { return clock_log.size(); }
+
+    private:
+        std::mutex lock; // harts on their own threads share the devices
+        std::ostream* console;
+        std::string console_buffer;
+
+        std::vector<uint32_t> latched_high; // per hart
+        const std::chrono::steady_clock::time_point start;
+
+        std::ifstream input;
+        std::ofstream output;
+        uint64_t input_words = 0;
+        uint64_t input_pos = 0; // words read so far
+        uint32_t transfer_addr = 0;
+        uint32_t transfer_count = 0;
+
+        bool recording = false;
+        bool replaying = false;
+        std::vector<std::pair<uint64_t, uint64_t>> clock_log; // instruction index and microseconds, in index order
+
+        uint64_t read_clock(uint64_t retired);
+
+        void put(const char* data, size_t len);
+        void write_console();
+        uint32_t read_count() const;
+        uint32_t read_file(Memory& mem);
+        uint32_t write_file(const Memory& mem);
+};
@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "yuemu.hpp"
+#include "yuemu_dump.hpp"
+
+namespace {
+
+struct DumpPageHeader {
+    uint32_t base;
+    uint32_t word_count; // words that follow, one per present bit
+    uint64_t present[Memory::PAGE_WORDS / 64];
+};
+
+} // namespace
+
+bool Yuemu::save_dump(const std::string& path) {
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        *err << "Error: can't open dump file: " << path << "\n";
+        return false;
+    }
+
+    std::vector<uint32_t> bases = mem.take_dirty_pages();
+
+    DumpHeader header = {};
+    std::memcpy(header.magic, "YUEDUMP", 8);
+    header.version = MemoryDump::VERSION;
+    header.page_count = bases.size();
+    header.instructions = instructions_executed();
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+
+    std::vector<uint32_t> words;
+    for (uint32_t base : bases) {
+        DumpPageHeader page = {};
+        page.base = base;
+        std::memcpy(page.present, mem.page_present(base), sizeof(page.present));
+
+        const uint32_t* page_words = mem.page_words(base);
+        words.clear();
+        for (uint32_t w=0; w<Memory::PAGE_WORDS/64; w++) {
+            uint64_t bits = page.present[w];
+            while (bits != 0) {
+                words.push_back(page_words[w * 64 + __builtin_ctzll(bits)]);
+                bits &= bits - 1;
+            }
+        }
+        page.word_count = words.size();
+        ok = ok && std::fwrite(&page, sizeof(page), 1, file) == 1;
+        ok = ok && std::fwrite(words.data(), 4, words.size(), file) == words.size();
+    }
+
+    ok = (std::fclose(file) == 0) && ok;
+    if (!ok) {
+        *err << "Error: can't write dump file: " << path << "\n";
+    }
+    return ok;
+}
+
+bool MemoryDump::load(const std::string& path, std::ostream& err) {
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        err << "Error: can't open dump file: " << path << "\n";
+        return false;
+    }
+
+    DumpHeader header;
+    if (std::fread(&header, sizeof(header), 1, file) != 1 || std::memcmp(header.magic, "YUEDUMP", 8) != 0) {
+        err << "Error: not a yuemu dump file: " << path << "\n";
+        std::fclose(file);
+        return false;
+    }
+    if (header.version != VERSION) {
+        err << "Error: unsupported dump version " << header.version << "\n";
+        std::fclose(file);
+        return false;
+    }
+
+    instructions = header.instructions;
+    bool ok = true;
+    std::vector<uint32_t> values;
+    for (uint32_t i=0; i<header.page_count && ok; i++) {
+        DumpPageHeader page;
+        ok = std::fread(&page, sizeof(page), 1, file) == 1 && page.word_count <= Memory::PAGE_WORDS
+            && page.base % Memory::PAGE_WORDS == 0;
+        values.resize(ok ? page.word_count : 0);
+        ok = ok && std::fread(values.data(), 4, values.size(), file) == values.size();
+        if (!ok) {
+            break;
+        }
+
+        Words& words = pages[page.base];
+        words.clear();
+        size_t next = 0;
+        for (uint32_t w=0; w<Memory::PAGE_WORDS/64 && ok; w++) {
+            uint64_t bits = page.present[w];
+            while (bits != 0) {
+                if (next == values.size()) {
+                    ok = false;
+                    break;
+                }
+                words.emplace_back(page.base + w * 64 + __builtin_ctzll(bits), values[next++]);
+                bits &= bits - 1;
+            }
+        }
+        ok = ok && next == values.size();
+    }
+    std::fclose(file);
+
+    if (!ok) {
+        err << "Error: invalid dump file: " << path << "\n";
+    }
+    return ok;
+}
+
+void MemoryDump::merge(const MemoryDump& later) {
+    for (const auto& page : later.pages) {
+        pages[page.first] = page.second;
+    }
+    instructions = later.instructions;
+}
+
+void MemoryDump::print(std::ostream& os) const {
+    os << "\nMemory map after 0x0100\n----------------\n";
+    for (const auto& page : pages) {
+        for (const auto& word : page.second) {
+            if (word.first >= 0x100) {
+                os << "Address: " << word.first << ", Value: " << (int32_t) word.second << "\n";
+            }
+        }
+    }
+}
+
+// both pages are in address order, so one merge walk pairs up the words
+size_t MemoryDump::print_diff(const MemoryDump& newer, std::ostream& os, bool all) const {
+    static const Words none;
+    std::vector<uint32_t> bases;
+    for (const auto& page : newer.pages) {
+        bases.push_back(page.first);
+    }
+    if (all) {
+        for (const auto& page : pages) {
+            if (newer.pages.count(page.first) == 0) {
+                bases.push_back(page.first);
+            }
+        }
+        std::sort(bases.begin(), bases.end());
+    }
+
+    size_t lines = 0;
+    for (uint32_t base : bases) {
+        auto found_new = newer.pages.find(base);
+        const Words& new_words = found_new == newer.pages.end() ? none : found_new->second;
+        auto found = pages.find(base);
+        const Words& old_words = found == pages.end() ? none : found->second;
+        size_t o = 0, n = 0;
+        while (o < old_words.size() || n < new_words.size()) {
+            if (n == new_words.size() || (o < old_words.size() && old_words[o].first < new_words[n].first)) {
+                os << "Address: " << old_words[o].first << ", Value: " << (int32_t) old_words[o].second << " (dropped)\n";
+                o++;
+                lines++;
+            } else if (o == old_words.size() || new_words[n].first < old_words[o].first) {
+                os << "Address: " << new_words[n].first << ", Value: " << (int32_t) new_words[n].second << " (new)\n";
+                n++;
+                lines++;
+            } else {
+                if (old_words[o].second != new_words[n].second) {
+                    os << "Address: " << new_words[n].first << ", Value: " << (int32_t) old_words[o].second
+                       << " -> " << (int32_t) new_words[n].second << "\n";
+                    lines++;
+                }
+                o++;
+                n++;
+            }
+        }
+    }
+    return lines;
+}
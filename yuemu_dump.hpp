@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Binary memory dumps. A dump holds the pages written since the program was
+// loaded or since the previous dump, so writing one costs what the program
+// wrote and not its footprint. A page goes in whole, with every word written
+// since the load, so a later dump's page replaces an earlier one. Layout,
+// all in host byte order:
+// header | per page: base address, word count, present bits | the written words in address order
+struct DumpHeader {
+    char magic[8]; // "YUEDUMP"
+    uint32_t version;
+    uint32_t page_count;
+    uint64_t instructions; // executed by every hart when the dump was taken
+};
+
+class MemoryDump {
+    public:
+        static constexpr uint32_t VERSION = 1;
+
+        using Words = std::vector<std::pair<uint32_t, uint32_t>>; // address and value, in address order
+
+        uint64_t instructions = 0;
+        std::map<uint32_t, Words> pages; // by base address
+
+        bool load(const std::string& path, std::ostream& err);
+
+        // lays a later dump over this one, its pages replace these
+        void merge(const MemoryDump& later);
+
+        // the text memory map the emulator prints, addresses from 0x100 on
+        void print(std::ostream& os) const;
+
+        // every word the new dump changed, added or dropped on the pages it holds,
+        // pages only this one holds count as unchanged unless all is set, then
+        // their words count as dropped. Returns the number of lines.
+        size_t print_diff(const MemoryDump& newer, std::ostream& os, bool all = false) const;
+};
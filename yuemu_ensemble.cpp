@@ -0,0 +1,566 @@
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+
+#include "yuemu.hpp"
+#include "yuemu_ensemble.hpp"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define YUEMU_ENSEMBLE_SIMD 1
+#include <immintrin.h>
+#else
+#define YUEMU_ENSEMBLE_SIMD 0
+#endif
+
+namespace {
+
+// dst = a op b in every lane whose mask is set, or in every lane when mask is
+// nullptr. n is a multiple of Ensemble::LANE_ALIGN.
+typedef void (*AluKernel)(Op op, uint32_t* dst, const uint32_t* a, const uint32_t* b, const uint32_t* mask, size_t n);
+
+template <typename F>
+void lanes_scalar(uint32_t* dst, const uint32_t* a, const uint32_t* b, const uint32_t* mask, size_t n, F f) {
+    if (mask == nullptr) {
+        for (size_t i=0; i<n; i++) {
+            dst[i] = f(a[i], b[i]);
+        }
+    } else {
+        for (size_t i=0; i<n; i++) {
+            if (mask[i] != 0) {
+                dst[i] = f(a[i], b[i]);
+            }
+        }
+    }
+}
+
+// shift counts wrap at 32 like the interpreter's shifts on x86-64
+void alu_scalar(Op op, uint32_t* dst, const uint32_t* a, const uint32_t* b, const uint32_t* mask, size_t n) {
+    switch (op) {
+        case Op::ADD: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return x + y; }); break;
+        case Op::SUB: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return x - y; }); break;
+        case Op::MUL: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return x * y; }); break;
+        case Op::DIV: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return x / y; }); break;
+        case Op::AND: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return x & y; }); break;
+        case Op::OR: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return x | y; }); break;
+        case Op::NAND: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return ~(x & y); }); break;
+        case Op::NOR: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return ~(x | y); }); break;
+        case Op::XOR: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return x ^ y; }); break;
+        case Op::LSHIFT: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return x << (y & 31); }); break;
+        case Op::RSHIFT: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return x >> (y & 31); }); break;
+        case Op::LT: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return (uint32_t) ((int32_t) x < (int32_t) y); }); break;
+        case Op::LTE: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return (uint32_t) ((int32_t) x <= (int32_t) y); }); break;
+        case Op::GT: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return (uint32_t) ((int32_t) x > (int32_t) y); }); break;
+        case Op::GTE: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return (uint32_t) ((int32_t) x >= (int32_t) y); }); break;
+        case Op::EQ: lanes_scalar(dst, a, b, mask, n, [](uint32_t x, uint32_t y) { return (uint32_t) (x == y); }); break;
+        default: break;
+    }
+}
+
+#if YUEMU_ENSEMBLE_SIMD
+// Same as alu_scalar, eight lanes at a time. Masked lanes keep their old
+// value through a blend. There's no vector divide, div stays scalar.
+__attribute__((target("avx2")))
+void alu_avx2(Op op, uint32_t* dst, const uint32_t* a, const uint32_t* b, const uint32_t* mask, size_t n) {
+    #define AVX2_LANES(expr) \
+        for (size_t i=0; i<n; i+=8) { \
+            __m256i x = _mm256_loadu_si256((const __m256i*) (a + i)); \
+            __m256i y = _mm256_loadu_si256((const __m256i*) (b + i)); \
+            __m256i res = expr; \
+            if (mask != nullptr) { \
+                __m256i keep = _mm256_loadu_si256((const __m256i*) (dst + i)); \
+                res = _mm256_blendv_epi8(keep, res, _mm256_loadu_si256((const __m256i*) (mask + i))); \
+            } \
+            _mm256_storeu_si256((__m256i*) (dst + i), res); \
+        }
+
+    const __m256i ones = _mm256_set1_epi32(-1);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i count_mask = _mm256_set1_epi32(31);
+    switch (op) {
+        case Op::ADD: AVX2_LANES(_mm256_add_epi32(x, y)); break;
+        case Op::SUB: AVX2_LANES(_mm256_sub_epi32(x, y)); break;
+        case Op::MUL: AVX2_LANES(_mm256_mullo_epi32(x, y)); break;
+        case Op::AND: AVX2_LANES(_mm256_and_si256(x, y)); break;
+        case Op::OR: AVX2_LANES(_mm256_or_si256(x, y)); break;
+        case Op::NAND: AVX2_LANES(_mm256_xor_si256(_mm256_and_si256(x, y), ones)); break;
+        case Op::NOR: AVX2_LANES(_mm256_xor_si256(_mm256_or_si256(x, y), ones)); break;
+        case Op::XOR: AVX2_LANES(_mm256_xor_si256(x, y)); break;
+        case Op::LSHIFT: AVX2_LANES(_mm256_sllv_epi32(x, _mm256_and_si256(y, count_mask))); break;
+        case Op::RSHIFT: AVX2_LANES(_mm256_srlv_epi32(x, _mm256_and_si256(y, count_mask))); break;
+        case Op::LT: AVX2_LANES(_mm256_and_si256(_mm256_cmpgt_epi32(y, x), one)); break;
+        case Op::LTE: AVX2_LANES(_mm256_andnot_si256(_mm256_cmpgt_epi32(x, y), one)); break;
+        case Op::GT: AVX2_LANES(_mm256_and_si256(_mm256_cmpgt_epi32(x, y), one)); break;
+        case Op::GTE: AVX2_LANES(_mm256_andnot_si256(_mm256_cmpgt_epi32(y, x), one)); break;
+        case Op::EQ: AVX2_LANES(_mm256_and_si256(_mm256_cmpeq_epi32(x, y), one)); break;
+        default: alu_scalar(op, dst, a, b, mask, n); break;
+    }
+    #undef AVX2_LANES
+}
+
+// Four lanes at a time. SSE has no per-lane shift counts, shifts stay scalar too.
+__attribute__((target("sse4.1")))
+void alu_sse41(Op op, uint32_t* dst, const uint32_t* a, const uint32_t* b, const uint32_t* mask, size_t n) {
+    #define SSE_LANES(expr) \
+        for (size_t i=0; i<n; i+=4) { \
+            __m128i x = _mm_loadu_si128((const __m128i*) (a + i)); \
+            __m128i y = _mm_loadu_si128((const __m128i*) (b + i)); \
+            __m128i res = expr; \
+            if (mask != nullptr) { \
+                __m128i keep = _mm_loadu_si128((const __m128i*) (dst + i)); \
+                res = _mm_blendv_epi8(keep, res, _mm_loadu_si128((const __m128i*) (mask + i))); \
+            } \
+            _mm_storeu_si128((__m128i*) (dst + i), res); \
+        }
+
+    const __m128i ones = _mm_set1_epi32(-1);
+    const __m128i one = _mm_set1_epi32(1);
+    switch (op) {
+        case Op::ADD: SSE_LANES(_mm_add_epi32(x, y)); break;
+        case Op::SUB: SSE_LANES(_mm_sub_epi32(x, y)); break;
+        case Op::MUL: SSE_LANES(_mm_mullo_epi32(x, y)); break;
+        case Op::AND: SSE_LANES(_mm_and_si128(x, y)); break;
+        case Op::OR: SSE_LANES(_mm_or_si128(x, y)); break;
+        case Op::NAND: SSE_LANES(_mm_xor_si128(_mm_and_si128(x, y), ones)); break;
+        case Op::NOR: SSE_LANES(_mm_xor_si128(_mm_or_si128(x, y), ones)); break;
+        case Op::XOR: SSE_LANES(_mm_xor_si128(x, y)); break;
+        case Op::LT: SSE_LANES(_mm_and_si128(_mm_cmpgt_epi32(y, x), one)); break;
+        case Op::LTE: SSE_LANES(_mm_andnot_si128(_mm_cmpgt_epi32(x, y), one)); break;
+        case Op::GT: SSE_LANES(_mm_and_si128(_mm_cmpgt_epi32(x, y), one)); break;
+        case Op::GTE: SSE_LANES(_mm_andnot_si128(_mm_cmpgt_epi32(y, x), one)); break;
+        case Op::EQ: SSE_LANES(_mm_and_si128(_mm_cmpeq_epi32(x, y), one)); break;
+        default: alu_scalar(op, dst, a, b, mask, n); break;
+    }
+    #undef SSE_LANES
+}
+#endif
+
+AluKernel select_alu() {
+#if YUEMU_ENSEMBLE_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return alu_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return alu_sse41;
+    }
+#endif
+    return alu_scalar;
+}
+
+const AluKernel alu = select_alu();
+
+bool is_alu(Op op) {
+    return (op >= Op::ADD && op <= Op::DIV) || (op >= Op::AND && op <= Op::EQ);
+}
+
+} // namespace
+
+Ensemble::Ensemble(uint32_t lanes, uint32_t ret_stack_capacity)
+    : lanes(lanes),
+      stride((lanes + LANE_ALIGN - 1) / LANE_ALIGN * LANE_ALIGN),
+      regs((size_t) 256 * stride, 0),
+      live_mask(stride, 0),
+      group_mask(stride, 0),
+      next_pc(stride, 0),
+      live(lanes) {
+    for (uint32_t i=0; i<lanes; i++) {
+        lane_state.emplace_back(ret_stack_capacity);
+        mems.emplace_back(new Memory());
+        live_mask[i] = ~0u;
+        reg(255)[i] = i;
+    }
+}
+
+bool Ensemble::load_program(const std::string& fpath) {
+    std::ifstream file(fpath, std::ios::binary);
+    if (!file) {
+        std::cerr << "Error: can't open program file: " << fpath << "\n";
+        return false;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return load_image((const uint8_t*) data.data(), data.size());
+}
+
+bool Ensemble::load_image(const uint8_t* image, uint64_t size) {
+    if (Executable::is_executable(image, size)) {
+        std::cerr << "Error: ensembles only run raw program images\n";
+        return false;
+    }
+    if (size % 4 != 0) {
+        std::cerr << "Error: program size " << size << " is not a multiple of 4 bytes\n";
+        return false;
+    } else if (size > 0xFFFFFFFC) {
+        std::cerr << "Error: program is too large for the 32-bit address space\n";
+        return false;
+    }
+
+    image_bytes = size;
+    code.clear();
+    for (uint64_t i=0; i<size; i+=4) {
+        code.push_back(decode((uint32_t) image[i] << 24 | image[i + 1] << 16 | image[i + 2] << 8 | image[i + 3]));
+    }
+    if (size > 0) {
+        for (auto& mem : mems) {
+            mem->write_program_words(0, image, size / 4);
+        }
+    }
+    return true;
+}
+
+void Ensemble::preset(uint32_t lane, const BatchEntry& presets) {
+    for (const auto& r : presets.regs) {
+        reg(r.first)[lane] = r.second;
+    }
+    for (const auto& word : presets.mem) {
+        mems[lane]->write(word.first, word.second);
+    }
+}
+
+void Ensemble::run() {
+    while (live > 0) {
+        const uint32_t* mask = live_mask.data();
+        if (!converged) {
+            // the lowest pc goes first so the lanes behind catch up
+            uint64_t low = UINT64_MAX;
+            for (uint32_t i=0; i<lanes; i++) {
+                if (live_mask[i] != 0 && lane_state[i].pc < low) {
+                    low = lane_state[i].pc;
+                }
+            }
+            pc = low;
+
+            uint32_t group = 0;
+            for (uint32_t i=0; i<lanes; i++) {
+                bool here = live_mask[i] != 0 && lane_state[i].pc == pc;
+                group_mask[i] = here ? ~0u : 0;
+                group += here;
+            }
+            if (group == live) {
+                converged = true;
+            } else {
+                mask = group_mask.data();
+                divergent_steps++;
+            }
+        }
+
+        if (pc == image_bytes) {
+            stop(mask, StopReason::FINISHED, 0);
+            continue;
+        }
+
+        DecodedOp op;
+        if (pc < image_bytes && pc % 4 == 0) {
+            op = code[pc / 4];
+        } else {
+            // lanes may have stored different code out here, run them one by one
+            uint32_t first = 0;
+            while (mask[first] == 0) {
+                first++;
+            }
+            if (converged) {
+                diverge();
+            }
+            std::fill(group_mask.begin(), group_mask.end(), 0);
+            group_mask[first] = ~0u;
+            mask = group_mask.data();
+            op = decode(mems[first]->read(pc));
+        }
+
+        steps++;
+        if (converged) {
+            uniform_steps++;
+        } else {
+            for (uint32_t i=0; i<lanes; i++) {
+                lane_state[i].executed += mask[i] & 1;
+            }
+        }
+        execute(op, mask, converged && live == lanes);
+    }
+    flush_uniform();
+}
+
+// runs op for the lanes in mask, all means that's every lane of the ensemble
+void Ensemble::execute(const DecodedOp& op, const uint32_t* mask, bool all) {
+    if (is_alu(op.op)) {
+        // padding lanes are computed along with the others, except by div which could trap on them
+        alu(op.op, reg(op.rd), reg(op.rs1), reg(op.rs2), (all && op.op != Op::DIV) ? nullptr : mask, stride);
+        advance(mask, pc + 4);
+        return;
+    }
+
+    switch (op.op) {
+        case Op::LOADI: {
+            uint32_t* rd = reg(op.rd);
+            for (uint32_t i=0; i<lanes; i++) {
+                rd[i] = mask[i] != 0 ? op.imm : rd[i];
+            }
+            advance(mask, pc + 4);
+            break;
+        }
+
+        case Op::LOADR:
+        case Op::LOADD: {
+            uint32_t* rd = reg(op.rd);
+            const uint32_t* raddr = reg(op.rs1);
+            for (uint32_t i=0; i<lanes; i++) {
+                if (mask[i] != 0) {
+                    rd[i] = mems[i]->read(op.op == Op::LOADR ? raddr[i] : op.imm);
+                }
+            }
+            advance(mask, pc + 4);
+            break;
+        }
+
+        case Op::STOREN:
+        case Op::STORED: {
+            const uint32_t* raddr = reg(op.rs1);
+            const uint32_t* rs = reg(op.rs2);
+            for (uint32_t i=0; i<lanes; i++) {
+                if (mask[i] == 0) {
+                    continue;
+                }
+                uint32_t addr = (op.op == Op::STOREN) ? raddr[i] : op.imm;
+                // instructions only sit at multiples of 4, the words between them are data
+                if (addr < image_bytes && addr % 4 == 0) {
+                    flush_uniform();
+                    lane_state[i].code_store = true;
+                    stop_lane(i, StopReason::INVALID, mems[i]->read(pc));
+                } else {
+                    mems[i]->write(addr, rs[i]);
+                }
+            }
+            advance(mask, pc + 4);
+            break;
+        }
+
+        case Op::JUMP:
+            advance(mask, pc + op.imm);
+            break;
+
+        case Op::BR:
+            for (uint32_t i=0; i<lanes; i++) {
+                if (mask[i] != 0 && !lane_state[i].ret_stack.push(pc + 4)) {
+                    flush_uniform();
+                    stop_lane(i, StopReason::STACK_OVERFLOW, 0);
+                }
+            }
+            advance(mask, pc + op.imm);
+            break;
+
+        case Op::JUMPDIR:
+        case Op::JUMPIF:
+        case Op::JUMPIFDIR:
+        case Op::BRIF:
+        case Op::RET: {
+            const uint32_t* rs = reg(op.rs1);
+            const uint32_t* rcond = reg(op.rs2);
+            for (uint32_t i=0; i<lanes; i++) {
+                if (mask[i] == 0) {
+                    continue;
+                }
+                ReturnStack& ret_stack = lane_state[i].ret_stack;
+                switch (op.op) {
+                    case Op::JUMPDIR: next_pc[i] = pc + rs[i]; break;
+                    case Op::JUMPIF: next_pc[i] = rcond[i] != 0 ? pc + op.imm : pc + 4; break;
+                    case Op::JUMPIFDIR: next_pc[i] = rcond[i] != 0 ? pc + rs[i] : pc + 4; break;
+                    case Op::BRIF:
+                        if (rcond[i] != 0) {
+                            if (!ret_stack.push(pc + 4)) {
+                                flush_uniform();
+                                stop_lane(i, StopReason::STACK_OVERFLOW, 0);
+                            }
+                            next_pc[i] = pc + op.imm;
+                        } else {
+                            next_pc[i] = pc + 4;
+                        }
+                        break;
+                    default: // ret, an empty return stack is ignored
+                        if (ret_stack.empty()) {
+                            next_pc[i] = pc + 4;
+                        } else {
+                            next_pc[i] = ret_stack.top();
+                            ret_stack.pop();
+                        }
+                        break;
+                }
+            }
+            branch(mask);
+            break;
+        }
+
+        case Op::END:
+            stop(mask, StopReason::END, 0);
+            break;
+
+        case Op::INVALID:
+            stop(mask, StopReason::INVALID, op.imm);
+            break;
+
+        default: // nop
+            advance(mask, pc + 4);
+            break;
+    }
+}
+
+// moves every lane in mask on to target
+void Ensemble::advance(const uint32_t* mask, uint32_t target) {
+    if (converged) {
+        pc = target;
+        return;
+    }
+    for (uint32_t i=0; i<lanes; i++) {
+        if (mask[i] != 0 && live_mask[i] != 0) {
+            lane_state[i].pc = target;
+        }
+    }
+}
+
+// moves every lane in mask on to its own next_pc, the lanes stay together if they all agree
+void Ensemble::branch(const uint32_t* mask) {
+    if (converged) {
+        bool uniform = true;
+        bool first = true;
+        uint32_t target = 0;
+        for (uint32_t i=0; i<lanes; i++) {
+            if (mask[i] == 0) {
+                continue;
+            }
+            if (first) {
+                target = next_pc[i];
+                first = false;
+            } else if (next_pc[i] != target) {
+                uniform = false;
+                break;
+            }
+        }
+        if (uniform) {
+            pc = target;
+            return;
+        }
+        diverge();
+    }
+    for (uint32_t i=0; i<lanes; i++) {
+        if (mask[i] != 0 && live_mask[i] != 0) {
+            lane_state[i].pc = next_pc[i];
+        }
+    }
+}
+
+// every live lane takes its own pc from here on
+void Ensemble::diverge() {
+    flush_uniform();
+    for (uint32_t i=0; i<lanes; i++) {
+        if (live_mask[i] != 0) {
+            lane_state[i].pc = pc;
+        }
+    }
+    converged = false;
+}
+
+void Ensemble::stop(const uint32_t* mask, StopReason reason, uint32_t invalid_instr) {
+    flush_uniform();
+    for (uint32_t i=0; i<lanes; i++) {
+        if (mask[i] != 0 && live_mask[i] != 0) {
+            stop_lane(i, reason, invalid_instr);
+        }
+    }
+}
+
+// the caller flushes the steps run together first
+void Ensemble::stop_lane(uint32_t lane, StopReason reason, uint32_t invalid_instr) {
+    live_mask[lane] = 0;
+    lane_state[lane].pc = pc;
+    lane_state[lane].reason = reason;
+    lane_state[lane].invalid_instr = invalid_instr;
+    live--;
+}
+
+void Ensemble::flush_uniform() {
+    if (uniform_steps == 0) {
+        return;
+    }
+    for (uint32_t i=0; i<lanes; i++) {
+        if (live_mask[i] != 0) {
+            lane_state[i].executed += uniform_steps;
+        }
+    }
+    uniform_steps = 0;
+}
+
+void Ensemble::print_results(std::ostream& os) const {
+    uint32_t ends = 0;
+    uint32_t finished = 0;
+    uint32_t invalid = 0;
+    uint32_t overflows = 0;
+
+    for (uint32_t i=0; i<lanes; i++) {
+        const Lane& lane = lane_state[i];
+        os << "=== [" << i << "] ";
+        if (lane.reason == StopReason::END) {
+            os << "end";
+            ends++;
+        } else if (lane.reason == StopReason::FINISHED) {
+            os << "finished";
+            finished++;
+        } else if (lane.reason == StopReason::STACK_OVERFLOW) {
+            os << "stack overflow";
+            overflows++;
+        } else {
+            os << "invalid";
+            invalid++;
+        }
+        os << ", " << lane.executed << " instructions\n";
+
+        if (lane.code_store) {
+            os << "Error: store into the program image at pc " << lane.pc << ": " << Yuemu::get_instr_as_hex(lane.invalid_instr) << "\n";
+        } else if (lane.reason == StopReason::INVALID) {
+            os << "Error: invalid instruction: 0x" << Yuemu::get_instr_as_hex(lane.invalid_instr) << "\n";
+        } else if (lane.reason == StopReason::STACK_OVERFLOW) {
+            os << "Error: return stack overflow at pc " << lane.pc << "\n";
+        }
+        mems[i]->for_each_word([&os](uint32_t addr, uint32_t val) {
+            if (addr >= 0x100) {
+                os << "Address: " << addr << ", Value: " << Yuemu::to_signed(val) << "\n";
+            }
+        });
+    }
+
+    os << "=== " << lanes << " lanes: " << ends << " end, " << finished << " finished, " << invalid << " invalid, " << overflows << " stack overflows, "
+       << steps << " steps, " << divergent_steps << " divergent\n";
+}
+
+bool load_ensemble_inputs(const std::string& path, std::vector<BatchEntry>& inputs) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Error: can't open ensemble inputs: " << path << "\n";
+        return false;
+    }
+
+    std::string line;
+    unsigned int line_no = 0;
+    while (std::getline(file, line)) {
+        line_no++;
+        line = line.substr(0, line.find('#'));
+
+        std::istringstream tokens(line);
+        std::string first;
+        if (!(tokens >> first)) {
+            continue;
+        }
+
+        BatchEntry entry;
+        std::string bad;
+        if (first != "-") {
+            std::istringstream all(line);
+            if (!parse_presets(all, entry, bad)) {
+                std::cerr << "Error: invalid input in " << path << " line " << line_no << ": " << bad << "\n";
+                return false;
+            }
+        } else if (tokens >> bad) {
+            std::cerr << "Error: invalid input in " << path << " line " << line_no << ": " << bad << "\n";
+            return false;
+        }
+        inputs.push_back(entry);
+    }
+    return true;
+}
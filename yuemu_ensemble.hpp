@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "yuemu_batch.hpp"
+#include "yuemu_decode.hpp"
+#include "yuemu_hart.hpp"
+#include "yuemu_memory.hpp"
+
+// Runs one program over many inputs in lock-step. Every lane is a complete
+// machine with its own pc, registers, return stack and memory, but the
+// registers of all lanes are stored together, register by register
+// (regs[reg * stride + lane]), so an ALU instruction is one pass of AVX2 or
+// SSE4.1 over every lane.
+//
+// While every lane is at the same pc the ensemble runs like a single machine.
+// When a jumpif, brif or a jump through a register sends lanes different
+// ways, each step picks the lowest pc any lane is at and runs it for the
+// lanes there, masking out the rest. The lanes behind catch up with the
+// ones ahead, so they meet again after loops and if/else diamonds.
+//
+// Lanes share the decoded program, so they can't modify it: a lane that
+// stores to an instruction of the loaded image, an address below its end
+// that is a multiple of 4, stops as invalid. A lane whose return stack
+// overflows stops on its own too. Lanes have no devices, their stores to the
+// device range land in their own memory like any other.
+class Ensemble {
+    public:
+        static constexpr uint32_t LANE_ALIGN = 8; // lanes are padded to whole AVX2 vectors
+
+        explicit Ensemble(uint32_t lanes, uint32_t ret_stack_capacity = ReturnStack::DEFAULT_CAPACITY);
+
+        bool load_program(const std::string& fpath);
+        bool load_image(const uint8_t* image, uint64_t size);
+
+        // every lane starts with its index in r255, presets may override it
+        void preset(uint32_t lane, const BatchEntry& presets);
+
+        void run();
+
+        uint32_t get_register(uint32_t lane, uint8_t reg) const { return regs[reg * stride + lane]; }
+        uint32_t read_memory(uint32_t lane, uint32_t addr) const { return mems[lane]->read(addr); }
+        StopReason lane_reason(uint32_t lane) const { return lane_state[lane].reason; }
+        uint64_t lane_instructions(uint32_t lane) const { return lane_state[lane].executed; }
+
+        // every lane's status and memory map in lane order, then a summary
+        void print_results(std::ostream& os) const;
+
+    private:
+        struct Lane {
+            uint32_t pc = 0; // only kept up to date while the lanes are apart
+            StopReason reason = StopReason::BUDGET;
+            uint32_t invalid_instr = 0;
+            bool code_store = false; // stopped because it stored into the program
+            uint64_t executed = 0;
+            ReturnStack ret_stack;
+
+            explicit Lane(uint32_t ret_stack_capacity) : ret_stack(ret_stack_capacity) {}
+        };
+
+        const uint32_t lanes;
+        const uint32_t stride;
+        uint32_t image_bytes = 0;
+        std::vector<DecodedOp> code; // the decoded image, by pc / 4
+
+        std::vector<uint32_t> regs;
+        std::vector<uint32_t> live_mask; // ~0 for every lane that hasn't stopped
+        std::vector<uint32_t> group_mask; // ~0 for the lanes running the current step while apart
+        std::vector<uint32_t> next_pc; // per lane targets of the current control instruction
+        std::vector<std::unique_ptr<Memory>> mems;
+        std::vector<Lane> lane_state;
+        uint32_t live = 0;
+
+        bool converged = true; // every live lane is at pc
+        uint32_t pc = 0;
+        uint64_t uniform_steps = 0; // steps run together, not yet added to each lane's count
+        uint64_t steps = 0;
+        uint64_t divergent_steps = 0;
+
+        uint32_t* reg(uint8_t r) { return &regs[(size_t) r * stride]; }
+
+        void execute(const DecodedOp& op, const uint32_t* mask, bool all);
+        void advance(const uint32_t* mask, uint32_t target);
+        void branch(const uint32_t* mask);
+        void diverge();
+        void stop(const uint32_t* mask, StopReason reason, uint32_t invalid_instr);
+        void stop_lane(uint32_t lane, StopReason reason, uint32_t invalid_instr);
+        void flush_uniform();
+};
+
+// one lane per line of the inputs file, in the batch manifest's preset syntax
+// without the program: "[rN=<value>]... [@<addr>=<value>]...", # starts a
+// comment and blank lines are skipped, a line with just "-" is a lane without presets
+bool load_ensemble_inputs(const std::string& path, std::vector<BatchEntry>& inputs);
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "yuemu_block_cache.hpp"
+#include "yuemu_jit.hpp"
+#include "yuemu_memory.hpp"
+
+enum class StopReason {
+    END, // ran the end instruction
+    FINISHED, // reached the end of the program
+    STOP_PC, // reached the stop pc
+    INVALID, // hit an invalid instruction
+    BUDGET, // used up the instruction budget of this run
+    STACK_OVERFLOW, // a br or brif found the return stack full
+    BREAKPOINT, // reached a breakpoint, before running the instruction there
+    WATCHPOINT, // an instruction read or wrote a watched address, after running it
+};
+
+// The guest return stack, a fixed-capacity array: br and brif push, ret
+// pops. A push onto a full stack fails and leaves the stack as it was, the
+// hart stops on STACK_OVERFLOW. The array is only touched as deep as the
+// guest actually calls.
+class ReturnStack {
+    public:
+        static constexpr uint32_t DEFAULT_CAPACITY = 1 << 16;
+
+        explicit ReturnStack(uint32_t capacity = DEFAULT_CAPACITY) : entries(new uint32_t[capacity]), max_size(capacity) {}
+
+        // false if the stack is full, overflowed() stays true afterwards
+        bool push(uint32_t ret_addr) {
+            if (count == max_size) {
+                overflow = true;
+                return false;
+            }
+            entries[count++] = ret_addr;
+            return true;
+        }
+
+        bool empty() const { return count == 0; }
+        uint32_t top() const { return entries[count - 1]; }
+        void pop() { count--; }
+        void clear() {
+            count = 0;
+            overflow = false;
+        }
+
+        uint32_t size() const { return count; }
+        uint32_t capacity() const { return max_size; }
+        bool overflowed() const { return overflow; }
+
+        // the entries bottom first
+        const uint32_t* data() const { return entries.get(); }
+
+    private:
+        std::unique_ptr<uint32_t[]> entries;
+        uint32_t max_size;
+        uint32_t count = 0;
+        bool overflow = false;
+};
+
+// Memory model when several harts share one guest memory:
+//  - every load and store of a word is atomic, no hart ever sees a torn word
+//  - a hart sees its own loads and stores in program order
+//  - stores are releases and loads are acquires: a hart that loads a value
+//    stored by another hart also sees every store that hart made before it,
+//    so a flag written after the data it guards is enough to pass a message
+//  - a store may still be delayed past a later load of another address, two
+//    harts can't build a lock out of plain stores and loads (Dekker)
+//  - code is coherent at block boundaries: after a store into code another
+//    hart has already translated, that hart runs the new instructions from
+//    its next block on
+// Free-running harts interleave however the host schedules their threads. In
+// lock-step mode the harts take turns on the calling thread, each running a
+// fixed number of instructions in hart order, so every run of the same
+// program interleaves the same way.
+
+// One hardware thread. pc, regs and ret_stack are its architectural state,
+// the rest is what it needs to execute on its own host thread: translated
+// blocks and compiled code are never shared between harts.
+struct Hart {
+    const uint32_t id;
+    unsigned int pc = 0;
+    uint32_t regs[256] = {0};
+    ReturnStack ret_stack;
+
+    BlockCache block_cache;
+    Block single_step; // runs the tail of a block that doesn't fit the budget
+    std::unique_ptr<Jit> jit; // only set when the JIT tier is enabled
+    uint64_t budget = 0; // instructions left in the current run
+    uint64_t run_budget = 0; // budget the current run started with
+    uint64_t executed = 0;
+
+    // why the hart last stopped, END, FINISHED, INVALID and STACK_OVERFLOW are final
+    StopReason reason = StopReason::BUDGET;
+    uint32_t invalid_instr = 0;
+    uint32_t watch_addr = 0; // the watched address of the last WATCHPOINT stop
+    bool watch_write = false; // and whether it was written
+
+    Hart(uint32_t id, const Memory& mem, uint32_t ret_stack_capacity) : id(id), ret_stack(ret_stack_capacity), block_cache(mem) {}
+
+    bool halted() const {
+        return reason == StopReason::END || reason == StopReason::FINISHED || reason == StopReason::INVALID
+            || reason == StopReason::STACK_OVERFLOW;
+    }
+
+    // stopped at the stop pc, a breakpoint or a watchpoint, it runs on from there
+    bool stopped() const {
+        return reason == StopReason::STOP_PC || reason == StopReason::BREAKPOINT || reason == StopReason::WATCHPOINT;
+    }
+};
@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+#include "yuemu_host_counters.hpp"
+
+namespace {
+
+const char* const PHASE_NAMES[] = {"load", "execute", "dump"};
+
+// the counters in report order, by perf event type and config
+struct CounterEvent {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+};
+
+#if defined(__linux__)
+const CounterEvent EVENTS[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+int open_event(const CounterEvent& event, bool inherit, uint64_t sample_period) {
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event.type;
+    attr.config = event.config;
+    attr.exclude_kernel = event.type == PERF_TYPE_HARDWARE; // what an unprivileged user may count
+    attr.exclude_hv = 1;
+    attr.inherit = inherit;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    if (sample_period > 0) {
+        attr.sample_period = sample_period;
+        attr.wakeup_events = 1;
+        attr.disabled = 1;
+    }
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#else
+const CounterEvent EVENTS[] = {
+    {"cycles", 0, 0}, {"instructions", 0, 0}, {"branch_misses", 0, 0},
+    {"cache_misses", 0, 0}, {"task_clock_ns", 0, 0}, {"page_faults", 0, 0},
+};
+#endif
+
+// only one instance samples at a time, the signal handler finds it here
+std::atomic<HostCounters*> sampling{nullptr};
+
+uint64_t wall_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+HostCounters::HostCounters(uint64_t sample_period) : sample_period(sample_period) {
+    for (size_t i=0; i<COUNTERS; i++) {
+        counters[i].name = EVENTS[i].name;
+    }
+    for (auto& count : op_samples) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    open_counters();
+    if (sample_period > 0) {
+        open_sampler();
+    }
+}
+
+HostCounters::~HostCounters() {
+#if defined(__linux__)
+    if (sample_fd >= 0) {
+        ioctl(sample_fd, PERF_EVENT_IOC_DISABLE, 0);
+        HostCounters* self = this;
+        sampling.compare_exchange_strong(self, nullptr);
+        close(sample_fd);
+    }
+    for (Counter& counter : counters) {
+        if (counter.fd >= 0) {
+            close(counter.fd);
+        }
+    }
+#endif
+}
+
+void HostCounters::open_counters() {
+    for (size_t i=0; i<COUNTERS; i++) {
+#if defined(__linux__)
+        // hart threads start after this, inherit counts them too
+        counters[i].fd = open_event(EVENTS[i], true, 0);
+        if (counters[i].fd < 0) {
+            counters[i].unavailable = std::strerror(errno);
+        }
+#else
+        counters[i].unavailable = "perf events need Linux";
+#endif
+    }
+}
+
+// Overflows of the sample event raise SIGPROF on this thread. Each overflow
+// disables the event again, the handler rearms it for one more.
+void HostCounters::open_sampler() {
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+    HostCounters* none = nullptr;
+    if (!sampling.compare_exchange_strong(none, this)) {
+        return;
+    }
+    sample_event = "cycles";
+    sample_fd = open_event(EVENTS[0], false, sample_period);
+    if (sample_fd < 0) {
+        sample_event = "task_clock_ns";
+        sample_fd = open_event(EVENTS[4], false, sample_period);
+    }
+    if (sample_fd < 0) {
+        sample_event = nullptr;
+        sampling.store(nullptr);
+        return;
+    }
+
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_sigaction = [](int signal, siginfo_t* info, void* context) { HostCounters::on_sample(signal, info, context); };
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+
+    struct f_owner_ex owner = {F_OWNER_TID, (pid_t) syscall(SYS_gettid)};
+    fcntl(sample_fd, F_SETFL, O_ASYNC | O_NONBLOCK);
+    fcntl(sample_fd, F_SETSIG, SIGPROF);
+    fcntl(sample_fd, F_SETOWN_EX, &owner);
+#endif
+}
+
+void HostCounters::on_sample(int, void*, void* context) {
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+    HostCounters* self = sampling.load(std::memory_order_acquire);
+    if (self == nullptr) {
+        return;
+    }
+    const ucontext_t* uc = (const ucontext_t*) context;
+#if defined(__x86_64__)
+    uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+#else
+    uintptr_t pc = uc->uc_mcontext.pc;
+#endif
+
+    // a pc past the last handler's label counts for it if it is close enough to be part of it
+    size_t op = OP_COUNT;
+    if (self->handlers_ready.load(std::memory_order_acquire)) {
+        const auto& pcs = self->handler_pcs;
+        auto after = std::upper_bound(pcs.begin(), pcs.end(), pc,
+            [](uintptr_t p, const std::pair<uintptr_t, uint32_t>& handler) { return p < handler.first; });
+        if (after != pcs.begin() && (after != pcs.end() || pc - pcs.back().first < 4096)) {
+            op = (after - 1)->second;
+        }
+    }
+    self->op_samples[op].fetch_add(1, std::memory_order_relaxed);
+    ioctl(self->sample_fd, PERF_EVENT_IOC_REFRESH, 1);
+#else
+    (void) context;
+#endif
+}
+
+void HostCounters::set_handlers(void* const* labels, size_t count) {
+    if (handlers_ready.load(std::memory_order_acquire)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(handlers_lock);
+    if (handlers_ready.load(std::memory_order_relaxed)) {
+        return;
+    }
+    for (size_t i=0; i<count; i++) {
+        handler_pcs.emplace_back((uintptr_t) labels[i], i);
+    }
+    std::sort(handler_pcs.begin(), handler_pcs.end());
+    handlers_ready.store(true, std::memory_order_release);
+}
+
+// scaled up for the time a multiplexed counter wasn't on the PMU
+uint64_t HostCounters::read_counter(const Counter& counter) const {
+#if defined(__linux__)
+    uint64_t values[3]; // value, time enabled, time running
+    if (counter.fd < 0 || read(counter.fd, values, sizeof(values)) != sizeof(values)) {
+        return counter.last;
+    }
+    if (values[2] != 0 && values[2] < values[1]) {
+        return (uint64_t) ((double) values[0] * values[1] / values[2]);
+    }
+    return values[0];
+#else
+    return counter.last;
+#endif
+}
+
+HostCounters::Phase HostCounters::enter(Phase phase) {
+    uint64_t now = wall_ns();
+    for (Counter& counter : counters) {
+        uint64_t reading = read_counter(counter);
+        if (running != IDLE && reading > counter.last) {
+            counter.totals[running] += reading - counter.last;
+        }
+        counter.last = reading;
+    }
+    if (running != IDLE) {
+        wall_totals[running] += now - wall_last;
+    }
+    wall_last = now;
+
+#if defined(__linux__)
+    if (sample_fd >= 0 && phase != running) {
+        if (phase == EXECUTE) {
+            ioctl(sample_fd, PERF_EVENT_IOC_REFRESH, 1);
+        } else if (running == EXECUTE) {
+            ioctl(sample_fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+#endif
+
+    Phase previous = running;
+    running = phase;
+    return previous;
+}
+
+bool HostCounters::write(const std::string& path, uint64_t guest_instructions) {
+    enter(running); // charges the running phase up to now
+
+    std::ofstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    file << "{\n  \"version\": " << FORMAT_VERSION << ",\n";
+    file << "  \"guest_instructions\": " << guest_instructions << ",\n";
+
+    file << "  \"unavailable\": {";
+    const char* separator = "";
+    for (const Counter& counter : counters) {
+        if (counter.fd < 0) {
+            file << separator << "\n    \"" << counter.name << "\": \"" << counter.unavailable << "\"";
+            separator = ",";
+        }
+    }
+    file << (*separator != 0 ? "\n  },\n" : "},\n");
+
+    file << "  \"phases\": {\n";
+    for (int p=0; p<PHASES; p++) {
+        file << "    \"" << PHASE_NAMES[p] << "\": {\"wall_ns\": " << wall_totals[p];
+        for (const Counter& counter : counters) {
+            file << ", \"" << counter.name << "\": ";
+            if (counter.fd < 0) {
+                file << "null";
+            } else {
+                file << counter.totals[p];
+            }
+        }
+        if (p == EXECUTE && guest_instructions > 0) {
+            file << ",\n      \"per_guest_instruction\": {\"wall_ns\": " << (double) wall_totals[p] / guest_instructions;
+            for (const Counter& counter : counters) {
+                if (counter.fd >= 0) {
+                    file << ", \"" << counter.name << "\": " << (double) counter.totals[p] / guest_instructions;
+                }
+            }
+            file << "}";
+        }
+        file << "}" << (p + 1 < PHASES ? "," : "") << "\n";
+    }
+    file << "  }";
+
+    if (sample_fd >= 0) {
+        uint64_t total = 0;
+        std::vector<std::pair<const char*, uint64_t>> categories;
+        for (size_t op=0; op<=OP_COUNT; op++) {
+            uint64_t count = op_samples[op].load(std::memory_order_relaxed);
+            total += count;
+            if (op == OP_COUNT || count == 0) {
+                continue;
+            }
+            const char* category = op_category((Op) op);
+            auto it = std::find_if(categories.begin(), categories.end(),
+                [category](const std::pair<const char*, uint64_t>& c) { return std::strcmp(c.first, category) == 0; });
+            if (it == categories.end()) {
+                categories.emplace_back(category, count);
+            } else {
+                it->second += count;
+            }
+        }
+
+        file << ",\n  \"samples\": {\"event\": \"" << sample_event << "\", \"period\": " << sample_period
+             << ", \"total\": " << total << ", \"outside_handlers\": " << op_samples[OP_COUNT].load(std::memory_order_relaxed) << ",\n";
+        file << "    \"categories\": {";
+        separator = "";
+        for (const auto& category : categories) {
+            file << separator << "\"" << category.first << "\": " << category.second;
+            separator = ", ";
+        }
+        file << "},\n    \"ops\": {";
+        separator = "";
+        for (size_t op=0; op<OP_COUNT; op++) {
+            uint64_t count = op_samples[op].load(std::memory_order_relaxed);
+            if (count != 0) {
+                file << separator << "\"" << op_name((Op) op) << "\": " << count;
+                separator = ", ";
+            }
+        }
+        file << "}}";
+    }
+    file << "\n}\n";
+    return (bool) file.flush();
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "yuemu_decode.hpp"
+
+// Host performance counters around the emulator's phases: loading the
+// program, executing it and dumping memory and reports. Each counter is a
+// Linux perf event counting this process, hart threads included: host
+// cycles, instructions, branch misses and cache misses, plus task clock and
+// page faults which the kernel counts in software. A counter the host can't
+// open (no perf events, a VM without a PMU, perf_event_paranoid) is left out
+// and its reason goes into the report, the others still count.
+//
+// With a sample period the thread that created the counters also takes a
+// signal every period host cycles, or nanoseconds of task clock without a
+// cycle counter, while it executes. The signal handler files the host pc
+// under the run loop handler it falls in, so the samples say which ops the
+// host time goes to. Handlers are told apart by their label addresses, a pc
+// counts for the closest handler label below it, so the split is only as
+// good as the compiler's code layout, and it needs threaded dispatch. Hart
+// threads and compiled blocks aren't sampled.
+class HostCounters {
+    public:
+        static constexpr int FORMAT_VERSION = 1;
+
+        enum Phase { LOAD, EXECUTE, DUMP, PHASES, IDLE = PHASES };
+
+        // runs a scope in a phase and goes back to the phase before at its
+        // end, does nothing without counters
+        class Scope {
+            public:
+                Scope(HostCounters* counters, Phase phase)
+                    : counters(counters), previous(counters != nullptr ? counters->enter(phase) : IDLE) {}
+                ~Scope() {
+                    if (counters != nullptr) {
+                        counters->enter(previous);
+                    }
+                }
+                Scope(const Scope&) = delete;
+                Scope& operator=(const Scope&) = delete;
+
+            private:
+                HostCounters* counters;
+                Phase previous;
+        };
+
+        explicit HostCounters(uint64_t sample_period = 0);
+        ~HostCounters();
+        HostCounters(const HostCounters&) = delete;
+        HostCounters& operator=(const HostCounters&) = delete;
+
+        // charges what was counted since the last switch to the running phase
+        // and makes phase the running one, returns the one it replaced
+        Phase enter(Phase phase);
+
+        // label addresses of the quiet run loop's handlers, by op, only the first call counts
+        void set_handlers(void* const* labels, size_t count);
+
+        // every phase's counts and their rate per guest instruction, and the samples:
+        // {"version": 1, "guest_instructions": n, "unavailable": {counter: reason},
+        //  "phases": {phase: {"wall_ns": n, counter: n or null, "per_guest_instruction": {...}}},
+        //  "samples": {"event": e, "period": n, "total": n, "outside_handlers": n,
+        //              "categories": {category: n}, "ops": {op: n}}}
+        bool write(const std::string& path, uint64_t guest_instructions);
+
+    private:
+        static constexpr size_t COUNTERS = 6;
+
+        struct Counter {
+            const char* name;
+            int fd = -1;
+            std::string unavailable; // why fd is -1
+            uint64_t last = 0; // reading at the last phase switch
+            uint64_t totals[PHASES] = {0};
+        };
+
+        Counter counters[COUNTERS];
+        Phase running = IDLE;
+        uint64_t wall_last = 0;
+        uint64_t wall_totals[PHASES] = {0};
+
+        // sampling, the signal handler only reads handler_pcs once handlers_ready is set
+        int sample_fd = -1;
+        const char* sample_event = nullptr;
+        uint64_t sample_period;
+        std::mutex handlers_lock;
+        std::atomic<bool> handlers_ready{false};
+        std::vector<std::pair<uintptr_t, uint32_t>> handler_pcs; // label address and op, by address
+        std::atomic<uint64_t> op_samples[OP_COUNT + 1]; // the last one counts samples outside the handlers
+
+        void open_counters();
+        void open_sampler();
+        uint64_t read_counter(const Counter& counter) const;
+        static void on_sample(int signal, void* info, void* context);
+};
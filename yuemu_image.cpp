@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+#include "yuemu_image.hpp"
+
+void SymbolTable::add(uint32_t addr, std::string name) {
+    auto pos = std::upper_bound(symbols.begin(), symbols.end(), addr,
+        [](uint32_t a, const std::pair<uint32_t, std::string>& symbol) { return a < symbol.first; });
+    symbols.emplace(pos, addr, std::move(name));
+}
+
+// a symbol that shares its address with an earlier one only shows up through find()
+std::string SymbolTable::describe(uint32_t addr) const {
+    auto after = std::upper_bound(symbols.begin(), symbols.end(), addr,
+        [](uint32_t a, const std::pair<uint32_t, std::string>& symbol) { return a < symbol.first; });
+    if (after == symbols.begin()) {
+        return "";
+    }
+    uint32_t base = (after - 1)->first;
+    auto first = std::lower_bound(symbols.begin(), after, base,
+        [](const std::pair<uint32_t, std::string>& symbol, uint32_t a) { return symbol.first < a; });
+    if (addr == base) {
+        return first->second;
+    }
+    std::stringstream ss;
+    ss << first->second << "+0x" << std::uppercase << std::hex << addr - base;
+    return ss.str();
+}
+
+bool SymbolTable::find(const std::string& name, uint32_t& addr) const {
+    for (const auto& symbol : symbols) {
+        if (symbol.second == name) {
+            addr = symbol.first;
+            return true;
+        }
+    }
+    return false;
+}
+
+namespace {
+
+uint32_t read_be32(const uint8_t* p) {
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+} // namespace
+
+bool Executable::is_executable(const uint8_t* image, uint64_t size) {
+    return size >= 8 && std::memcmp(image, "YUEEXEC", 8) == 0;
+}
+
+bool Executable::parse(const uint8_t* image, uint64_t size, std::ostream& err) {
+    if (!is_executable(image, size)) {
+        err << "Error: not a yuemu executable\n";
+        return false;
+    } else if (size < HEADER_BYTES) {
+        err << "Error: executable header is cut short\n";
+        return false;
+    }
+    uint32_t version = read_be32(image + 8);
+    if (version != VERSION) {
+        err << "Error: unsupported executable version " << version << "\n";
+        return false;
+    }
+    entry = read_be32(image + 12);
+    halt_pc = read_be32(image + 16);
+    uint32_t segment_count = read_be32(image + 20);
+    uint32_t symbol_count = read_be32(image + 24);
+    uint32_t string_bytes = read_be32(image + 28);
+
+    uint64_t segments_offset = HEADER_BYTES;
+    uint64_t symbols_offset = segments_offset + 16 * (uint64_t) segment_count;
+    uint64_t strings_offset = symbols_offset + 8 * (uint64_t) symbol_count;
+    if (strings_offset + string_bytes > size) {
+        err << "Error: executable tables run past the end of the file\n";
+        return false;
+    }
+
+    segments.clear();
+    for (uint32_t i=0; i<segment_count; i++) {
+        const uint8_t* entry_bytes = image + segments_offset + 16 * i;
+        Segment segment;
+        uint32_t kind = read_be32(entry_bytes);
+        segment.addr = read_be32(entry_bytes + 4);
+        segment.words = read_be32(entry_bytes + 8);
+        uint64_t offset = read_be32(entry_bytes + 12);
+        if (kind > (uint32_t) SegmentKind::ZERO) {
+            err << "Error: segment " << i << " has unknown kind " << kind << "\n";
+            return false;
+        }
+        segment.kind = (SegmentKind) kind;
+
+        uint64_t stride = segment.kind == SegmentKind::CODE ? 4 : 1;
+        if (segment.words > 0 && segment.addr + stride * (segment.words - 1) > 0xFFFFFFFF) {
+            err << "Error: segment " << i << " runs past the end of the address space\n";
+            return false;
+        }
+        if (segment.kind == SegmentKind::ZERO) {
+            segment.data = nullptr;
+        } else if (offset + 4 * (uint64_t) segment.words > size) {
+            err << "Error: segment " << i << " runs past the end of the file\n";
+            return false;
+        } else {
+            segment.data = image + offset;
+        }
+        segments.push_back(segment);
+    }
+
+    symbols = SymbolTable();
+    const char* strings = (const char*) image + strings_offset;
+    for (uint32_t i=0; i<symbol_count; i++) {
+        const uint8_t* entry_bytes = image + symbols_offset + 8 * i;
+        uint32_t name = read_be32(entry_bytes + 4);
+        const void* name_end = name < string_bytes ? std::memchr(strings + name, 0, string_bytes - name) : nullptr;
+        if (name_end == nullptr) {
+            err << "Error: symbol " << i << " has no name in the string table\n";
+            return false;
+        }
+        symbols.add(read_be32(entry_bytes), std::string(strings + name));
+    }
+    return true;
+}
+
+std::pair<uint32_t, uint64_t> Executable::code_range() const {
+    uint32_t start = 0;
+    uint64_t end = 0;
+    for (const Segment& segment : segments) {
+        if (segment.kind != SegmentKind::CODE || segment.words == 0) {
+            continue;
+        }
+        uint64_t segment_end = segment.addr + 4 * (uint64_t) segment.words;
+        if (end == 0 || segment.addr < start) {
+            start = segment.addr;
+        }
+        end = std::max(end, segment_end);
+    }
+    return {start, end};
+}
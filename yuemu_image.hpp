@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Names for guest addresses, from the symbol table of an executable
+class SymbolTable {
+    public:
+        bool empty() const { return symbols.empty(); }
+
+        void add(uint32_t addr, std::string name);
+
+        // the symbol at or closest below addr as "name" or "name+0x1C", empty without one
+        std::string describe(uint32_t addr) const;
+
+        // address of the first symbol called name, false if there is none
+        bool find(const std::string& name, uint32_t& addr) const;
+
+        // every symbol, in address order
+        const std::vector<std::pair<uint32_t, std::string>>& all() const { return symbols; }
+
+    private:
+        std::vector<std::pair<uint32_t, std::string>> symbols; // in address order
+};
+
+// Executable container, the other program format next to raw images. Every
+// field is a big-endian word, like the instructions of a raw image:
+// header: magic "YUEEXEC\0" | version | entry pc | halt pc | segment count | symbol count | string bytes
+// per segment: kind | load address | word count | file offset of its words
+// per symbol: address | offset of its name in the strings
+// strings: NUL terminated names
+// The segment words follow anywhere after that, at their file offsets.
+//
+// Code goes at load address, + 4, + 8, ... like a raw image, data at one word
+// per address, and zero segments have no words in the file. Guest memory
+// reads 0 wherever nothing was loaded, so a zero segment only documents the
+// range and loading it costs nothing. The harts start at the entry pc and
+// halt when they reach the halt pc, like they do at the end of a raw image.
+class Executable {
+    public:
+        static constexpr uint32_t VERSION = 1;
+        static constexpr uint32_t HEADER_BYTES = 32;
+
+        enum class SegmentKind : uint32_t {
+            CODE = 0,
+            DATA = 1,
+            ZERO = 2,
+        };
+
+        struct Segment {
+            SegmentKind kind;
+            uint32_t addr;
+            uint32_t words;
+            const uint8_t* data; // big-endian words inside the image, nullptr for zero segments
+        };
+
+        uint32_t entry = 0;
+        uint32_t halt_pc = 0;
+        std::vector<Segment> segments;
+        SymbolTable symbols;
+
+        // whether an image starts like an executable rather than raw code
+        static bool is_executable(const uint8_t* image, uint64_t size);
+
+        // the segments point into image, it has to outlive their use
+        bool parse(const uint8_t* image, uint64_t size, std::ostream& err);
+
+        // first address and end of the code segments, 0 and 0 without any
+        std::pair<uint32_t, uint64_t> code_range() const;
+};
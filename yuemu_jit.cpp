@@ -0,0 +1,297 @@
+#include <cstring>
+#include <initializer_list>
+#include <vector>
+
+#include "yuemu_jit.hpp"
+
+#if defined(__x86_64__) && defined(__unix__)
+#define YUEMU_JIT_X86_64 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define YUEMU_JIT_X86_64 0
+#endif
+
+#if YUEMU_JIT_X86_64
+
+namespace {
+
+// host registers used by the generated code
+enum : uint8_t { EAX = 0, ECX = 1, EDX = 2, ESI = 6 };
+
+struct Emitter {
+    std::vector<uint8_t> buf;
+
+    void bytes(std::initializer_list<uint8_t> bs) {
+        buf.insert(buf.end(), bs);
+    }
+
+    void imm32(uint32_t val) {
+        for (int i=0; i<4; i++) {
+            buf.push_back(val >> (8 * i) & 0xFF);
+        }
+    }
+
+    void imm64(uint64_t val) {
+        for (int i=0; i<8; i++) {
+            buf.push_back(val >> (8 * i) & 0xFF);
+        }
+    }
+
+    // push rbx; push r12; push r13 (keeps calls 16-byte aligned)
+    // mov r12, rdi; mov rbx, [rdi]
+    void prologue() {
+        bytes({0x53, 0x41, 0x54, 0x41, 0x55});
+        bytes({0x49, 0x89, 0xFC});
+        bytes({0x48, 0x8B, 0x1F});
+    }
+
+    // pop r13; pop r12; pop rbx; ret
+    void epilogue() {
+        bytes({0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+    }
+
+    // mov r32, [rbx + 4*guest_reg]
+    void load_reg(uint8_t r32, uint8_t guest_reg) {
+        bytes({0x8B, (uint8_t) (0x83 | r32 << 3)});
+        imm32(guest_reg * 4);
+    }
+
+    // mov [rbx + 4*guest_reg], r32
+    void store_reg(uint8_t guest_reg, uint8_t r32) {
+        bytes({0x89, (uint8_t) (0x83 | r32 << 3)});
+        imm32(guest_reg * 4);
+    }
+
+    // mov dword [rbx + 4*guest_reg], val
+    void store_reg_imm(uint8_t guest_reg, uint32_t val) {
+        bytes({0xC7, 0x83});
+        imm32(guest_reg * 4);
+        imm32(val);
+    }
+
+    // mov r32, val
+    void mov_imm(uint8_t r32, uint32_t val) {
+        bytes({(uint8_t) (0xB8 + r32)});
+        imm32(val);
+    }
+
+    // cmp dword [rbx + 4*guest_reg], 0
+    void cmp_reg_zero(uint8_t guest_reg) {
+        bytes({0x83, 0xBB});
+        imm32(guest_reg * 4);
+        bytes({0x00});
+    }
+
+    // mov rdi, r12; mov rax, fn; call rax
+    void call(const void* fn) {
+        bytes({0x4C, 0x89, 0xE7});
+        bytes({0x48, 0xB8});
+        imm64((uint64_t) fn);
+        bytes({0xFF, 0xD0});
+    }
+
+    void return_pc(uint32_t pc) {
+        mov_imm(EAX, pc);
+        epilogue();
+    }
+
+    // emits a forward jump with a 32-bit displacement and returns where to patch it
+    size_t jump_forward(std::initializer_list<uint8_t> opcode) {
+        bytes(opcode);
+        imm32(0);
+        return buf.size();
+    }
+
+    void patch_here(size_t after_jump) {
+        uint32_t rel = buf.size() - after_jump;
+        std::memcpy(&buf[after_jump - 4], &rel, 4);
+    }
+
+    // eax = regs[rs1] op regs[rs2], then regs[rd] = eax
+    void alu(const DecodedOp& op, std::initializer_list<uint8_t> body) {
+        load_reg(EAX, op.rs1);
+        load_reg(ECX, op.rs2);
+        bytes(body);
+        store_reg(op.rd, EAX);
+    }
+
+    // regs[rd] = (signed compare of regs[rs1] and regs[rs2]) ? 1 : 0
+    void compare(const DecodedOp& op, uint8_t setcc) {
+        // cmp eax, ecx; setcc al; movzx eax, al
+        alu(op, {0x39, 0xC8, 0x0F, setcc, 0xC0, 0x0F, 0xB6, 0xC0});
+    }
+};
+
+} // namespace
+
+#endif
+
+Jit::Jit(const JitHelpers& helpers) : helpers(helpers) {
+#if YUEMU_JIT_X86_64
+    void* mapping = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping != MAP_FAILED) {
+        code = (uint8_t*) mapping;
+    }
+#endif
+}
+
+Jit::~Jit() {
+#if YUEMU_JIT_X86_64
+    if (code != nullptr) {
+        munmap(code, CODE_SIZE);
+    }
+#endif
+}
+
+bool Jit::supported() {
+    return YUEMU_JIT_X86_64;
+}
+
+JitCode Jit::compile(const Block& block) {
+#if YUEMU_JIT_X86_64
+    if (code == nullptr) {
+        return nullptr;
+    }
+
+    Emitter e;
+    e.prologue();
+
+    uint32_t pc = block.start_pc;
+    for (const DecodedOp& op : block.ops) {
+        // a fused op compiles as its first op, the second one follows as usual
+        switch (unfused(op.op)) {
+            case Op::LOADI: e.store_reg_imm(op.rd, op.imm); break;
+
+            case Op::LOADR:
+                e.load_reg(ESI, op.rs1);
+                e.call((const void*) helpers.load);
+                e.store_reg(op.rd, EAX);
+                break;
+
+            case Op::LOADD:
+                e.mov_imm(ESI, op.imm);
+                e.call((const void*) helpers.load);
+                e.store_reg(op.rd, EAX);
+                break;
+
+            case Op::STOREN:
+            case Op::STORED: {
+                if (op.op == Op::STOREN) {
+                    e.load_reg(ESI, op.rs1);
+                } else {
+                    e.mov_imm(ESI, op.imm);
+                }
+                e.load_reg(EDX, op.rs2);
+                e.call((const void*) helpers.store);
+
+                // test eax, eax; jz over; leave right after the store if it overwrote this block
+                e.bytes({0x85, 0xC0});
+                size_t over = e.jump_forward({0x0F, 0x84});
+                e.return_pc(pc + 4);
+                e.patch_here(over);
+                break;
+            }
+
+            case Op::ADD: e.alu(op, {0x01, 0xC8}); break; // add eax, ecx
+            case Op::SUB: e.alu(op, {0x29, 0xC8}); break; // sub eax, ecx
+            case Op::MUL: e.alu(op, {0x0F, 0xAF, 0xC1}); break; // imul eax, ecx
+            case Op::DIV: e.alu(op, {0x31, 0xD2, 0xF7, 0xF1}); break; // xor edx, edx; div ecx
+
+            case Op::AND: e.alu(op, {0x21, 0xC8}); break;
+            case Op::OR: e.alu(op, {0x09, 0xC8}); break;
+            case Op::NAND: e.alu(op, {0x21, 0xC8, 0xF7, 0xD0}); break; // and; not eax
+            case Op::NOR: e.alu(op, {0x09, 0xC8, 0xF7, 0xD0}); break; // or; not eax
+            case Op::XOR: e.alu(op, {0x31, 0xC8}); break;
+
+            case Op::LSHIFT: e.alu(op, {0xD3, 0xE0}); break; // shl eax, cl
+            case Op::RSHIFT: e.alu(op, {0xD3, 0xE8}); break; // shr eax, cl
+
+            case Op::LT: e.compare(op, 0x9C); break; // setl
+            case Op::LTE: e.compare(op, 0x9E); break; // setle
+            case Op::GT: e.compare(op, 0x9F); break; // setg
+            case Op::GTE: e.compare(op, 0x9D); break; // setge
+            case Op::EQ: e.compare(op, 0x94); break; // sete
+
+            case Op::NOP: break;
+
+            case Op::JUMP: e.return_pc(pc + op.imm); break;
+
+            case Op::JUMPDIR:
+                e.load_reg(EAX, op.rs1);
+                e.bytes({0x05}); // add eax, pc
+                e.imm32(pc);
+                e.epilogue();
+                break;
+
+            case Op::JUMPIF:
+                e.mov_imm(EAX, pc + 4);
+                e.mov_imm(ECX, pc + op.imm);
+                e.cmp_reg_zero(op.rs2);
+                e.bytes({0x0F, 0x45, 0xC1}); // cmovne eax, ecx
+                e.epilogue();
+                break;
+
+            case Op::JUMPIFDIR:
+                e.load_reg(ECX, op.rs1);
+                e.bytes({0x81, 0xC1}); // add ecx, pc
+                e.imm32(pc);
+                e.mov_imm(EAX, pc + 4);
+                e.cmp_reg_zero(op.rs2);
+                e.bytes({0x0F, 0x45, 0xC1}); // cmovne eax, ecx
+                e.epilogue();
+                break;
+
+            case Op::RET:
+                e.mov_imm(ESI, pc + 4);
+                e.call((const void*) helpers.pop_ret);
+                e.epilogue();
+                break;
+
+            case Op::BR:
+                e.mov_imm(ESI, pc + 4);
+                e.call((const void*) helpers.push_ret);
+                e.return_pc(pc + op.imm);
+                break;
+
+            case Op::BRIF: {
+                e.cmp_reg_zero(op.rs2);
+                size_t not_taken = e.jump_forward({0x0F, 0x84}); // je
+                e.mov_imm(ESI, pc + 4);
+                e.call((const void*) helpers.push_ret);
+                e.return_pc(pc + op.imm);
+                e.patch_here(not_taken);
+                e.return_pc(pc + 4);
+                break;
+            }
+
+            case Op::BLOCK_END: e.return_pc((uint32_t) block.end_pc); break;
+
+            // end and invalid instructions stay with the interpreter
+            default: return nullptr;
+        }
+        pc += 4;
+    }
+
+    if (used + e.buf.size() > CODE_SIZE) {
+        return nullptr;
+    }
+
+    // the buffer is only writable while a block is copied in
+    uint8_t* start = code + used;
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint8_t* first_page = (uint8_t*) ((uintptr_t) start & ~(uintptr_t) (page_size - 1));
+    size_t len = start + e.buf.size() - first_page;
+    if (mprotect(first_page, len, PROT_READ | PROT_WRITE) != 0) {
+        return nullptr;
+    }
+    std::memcpy(start, e.buf.data(), e.buf.size());
+    mprotect(first_page, len, PROT_READ | PROT_EXEC);
+
+    used += (e.buf.size() + 15) & ~(size_t) 15;
+    return (JitCode) start;
+#else
+    (void) block;
+    return nullptr;
+#endif
+}
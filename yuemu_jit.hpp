@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "yuemu_block_cache.hpp"
+
+// State handed to compiled blocks. The register file pointer is pinned in
+// rbx for the whole block, everything else goes through the helpers.
+struct JitContext {
+    uint32_t* regs;
+    void* emu;
+    void* hart; // hart running the block
+    Block* block; // block being executed, to notice when it overwrites itself
+};
+
+// Calls back into the interpreter for anything that touches more than registers
+struct JitHelpers {
+    uint32_t (*load)(JitContext* ctx, uint32_t addr);
+    uint32_t (*store)(JitContext* ctx, uint32_t addr, uint32_t val); // nonzero if the running block was overwritten
+    void (*push_ret)(JitContext* ctx, uint32_t ret_addr);
+    uint32_t (*pop_ret)(JitContext* ctx, uint32_t pc_if_empty);
+};
+
+// Compiles hot blocks to x86-64 machine code. A compiled block runs to its
+// end and returns the next guest pc.
+class Jit {
+    public:
+        static constexpr uint32_t HOT_THRESHOLD = 50;
+        static constexpr size_t CODE_SIZE = 16 << 20;
+
+        Jit(const JitHelpers& helpers);
+        ~Jit();
+        Jit(const Jit&) = delete;
+        Jit& operator=(const Jit&) = delete;
+
+        static bool supported();
+
+        // returns nullptr if the block can't be compiled or the code buffer is full
+        JitCode compile(const Block& block);
+
+    private:
+        JitHelpers helpers;
+        uint8_t* code = nullptr;
+        size_t used = 0;
+};
@@ -1,14 +1,392 @@
 #include "yuemu.hpp"
+#include "yuemu_batch.hpp"
+#include "yuemu_debugger.hpp"
+#include "yuemu_ensemble.hpp"
 #include <iostream>
+#include <sstream>
 #include <string>
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
+    YuemuOptions options;
+    std::string fpath;
+    std::string snapshot_path;
+    std::string restore_path;
+    uint32_t snapshot_pc = 0;
+    std::string batch_path;
+    std::string ensemble_path;
+    unsigned int batch_jobs = 0;
+    uint64_t batch_slice = BatchRunner::DEFAULT_SLICE;
+    bool seek = false;
+    uint64_t seek_index = 0;
+    bool debug = false;
+    std::string aot_build_path;
+    bool aot_verify = false;
+
+    for (int i=1; i<argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--jit") {
+            if (!Jit::supported()) {
+                std::cerr << "Warning: the JIT is not supported on this platform, interpreting only\n";
+            }
+            options.jit = true;
+        } else if (arg.rfind("--aot=", 0) == 0) {
+            options.aot_file = arg.substr(6);
+        } else if (arg.rfind("--aot-build=", 0) == 0) {
+            aot_build_path = arg.substr(12);
+        } else if (arg == "--aot-verify") {
+            aot_verify = true;
+        } else if (arg == "--no-fuse") {
+            options.fuse = false;
+        } else if (arg.rfind("--trace=", 0) == 0) {
+            try {
+                options.trace_level = std::stoi(arg.substr(8));
+            } catch (const std::exception&) {
+                std::cout << "Invalid trace level: " << arg.substr(8) << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--trace-file=", 0) == 0) {
+            options.trace_file = arg.substr(13);
+        } else if (arg == "--profile") {
+            options.profile = true;
+        } else if (arg.rfind("--profile=", 0) == 0) {
+            options.profile = true;
+            options.profile_file = arg.substr(10);
+        } else if (arg == "--cache") {
+            options.timing = true;
+        } else if (arg.rfind("--cache=", 0) == 0) {
+            options.timing = true;
+            std::string bad;
+            if (!options.timing_config.parse(arg.substr(8), bad)) {
+                std::cout << "Invalid cache configuration: " << bad << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--callgraph=", 0) == 0) {
+            options.profile = true;
+            options.callgraph_file = arg.substr(12);
+        } else if (arg.rfind("--ret-stack=", 0) == 0) {
+            try {
+                options.ret_stack_capacity = std::stoul(arg.substr(12), nullptr, 0);
+            } catch (const std::exception&) {
+                options.ret_stack_capacity = 0;
+            }
+            if (options.ret_stack_capacity == 0) {
+                std::cout << "Invalid return stack size: " << arg.substr(12) << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--input=", 0) == 0) {
+            options.input_file = arg.substr(8);
+        } else if (arg.rfind("--output=", 0) == 0) {
+            options.output_file = arg.substr(9);
+        } else if (arg.rfind("--dump=", 0) == 0) {
+            options.dump_file = arg.substr(7);
+        } else if (arg.rfind("--host-counters=", 0) == 0) {
+            options.host_counters_file = arg.substr(16);
+        } else if (arg.rfind("--host-sample=", 0) == 0) {
+            try {
+                options.host_sample_period = std::stoull(arg.substr(14), nullptr, 0);
+            } catch (const std::exception&) {
+                options.host_sample_period = 0;
+            }
+            if (options.host_sample_period == 0) {
+                std::cout << "Invalid sample period: " << arg.substr(14) << "\n";
+                return 1;
+            }
+        } else if (arg == "--record") {
+            options.record_interval = Recorder::DEFAULT_INTERVAL;
+        } else if (arg.rfind("--record=", 0) == 0) {
+            try {
+                options.record_interval = std::stoull(arg.substr(9), nullptr, 0);
+            } catch (const std::exception&) {
+                options.record_interval = 0;
+            }
+            if (options.record_interval == 0) {
+                std::cout << "Invalid checkpoint interval: " << arg.substr(9) << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--seek=", 0) == 0) {
+            try {
+                seek_index = std::stoull(arg.substr(7), nullptr, 0);
+            } catch (const std::exception&) {
+                std::cout << "Invalid instruction index: " << arg.substr(7) << "\n";
+                return 1;
+            }
+            seek = true;
+            if (options.record_interval == 0) {
+                options.record_interval = Recorder::DEFAULT_INTERVAL;
+            }
+        } else if (arg == "--debug") {
+            debug = true;
+        } else if (arg.rfind("--snapshot=", 0) == 0) {
+            snapshot_path = arg.substr(11);
+        } else if (arg.rfind("--snapshot-pc=", 0) == 0) {
+            try {
+                snapshot_pc = std::stoul(arg.substr(14), nullptr, 0);
+            } catch (const std::exception&) {
+                std::cout << "Invalid snapshot pc: " << arg.substr(14) << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--restore=", 0) == 0) {
+            restore_path = arg.substr(10);
+        } else if (arg.rfind("--harts=", 0) == 0) {
+            try {
+                options.harts = std::stoul(arg.substr(8));
+            } catch (const std::exception&) {
+                options.harts = 0;
+            }
+            if (options.harts == 0) {
+                std::cout << "Invalid hart count: " << arg.substr(8) << "\n";
+                return 1;
+            }
+        } else if (arg == "--lockstep") {
+            options.lockstep_quantum = 1;
+        } else if (arg.rfind("--lockstep=", 0) == 0) {
+            try {
+                options.lockstep_quantum = std::stoull(arg.substr(11), nullptr, 0);
+            } catch (const std::exception&) {
+                options.lockstep_quantum = 0;
+            }
+            if (options.lockstep_quantum == 0) {
+                std::cout << "Invalid lock-step quantum: " << arg.substr(11) << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--batch=", 0) == 0) {
+            batch_path = arg.substr(8);
+        } else if (arg.rfind("--ensemble=", 0) == 0) {
+            ensemble_path = arg.substr(11);
+        } else if (arg.rfind("--jobs=", 0) == 0) {
+            try {
+                batch_jobs = std::stoul(arg.substr(7));
+            } catch (const std::exception&) {
+                std::cout << "Invalid job count: " << arg.substr(7) << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--slice=", 0) == 0) {
+            try {
+                batch_slice = std::stoull(arg.substr(8), nullptr, 0);
+            } catch (const std::exception&) {
+                std::cout << "Invalid slice: " << arg.substr(8) << "\n";
+                return 1;
+            }
+            if (batch_slice == 0) {
+                std::cout << "Invalid slice: " << arg.substr(8) << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--", 0) == 0) {
+            std::cout << "Unknown option: " << arg << "\n";
+            return 1;
+        } else {
+            fpath = arg;
+        }
+    }
+
+    // every program in the manifest runs in its own instance, the output is collected per program
+    if (!batch_path.empty()) {
+        if (!options.trace_file.empty() || !options.profile_file.empty() || !options.callgraph_file.empty() || !options.output_file.empty()
+                || !options.dump_file.empty() || !snapshot_path.empty() || !restore_path.empty() || !fpath.empty() || options.record_interval > 0
+                || !options.host_counters_file.empty() || debug || !options.aot_file.empty() || !aot_build_path.empty()) {
+            std::cout << "--batch can't be combined with a program, snapshots, recording, --debug, --aot or a trace, profile, call graph, output, dump or host counters file\n";
+            return 1;
+        }
+        BatchRunner batch(options, batch_jobs, batch_slice);
+        if (!batch.load_manifest(batch_path)) {
+            return 1;
+        }
+        batch.run();
+        return batch.print_results(std::cout) ? 0 : 1;
+    }
+
+    // one program over every line of the inputs file, each line in a lane of its own
+    if (!ensemble_path.empty()) {
+        if (fpath.empty() || options.jit || options.harts > 1 || options.trace_level >= 10 || !options.trace_file.empty()
+                || options.profile || options.timing || !options.input_file.empty() || !options.output_file.empty() || !snapshot_path.empty() || !restore_path.empty()
+                || options.record_interval > 0 || !options.dump_file.empty() || !options.host_counters_file.empty() || debug
+                || !options.aot_file.empty() || !aot_build_path.empty()) {
+            std::cout << "--ensemble needs a program and can't be combined with other run modes\n";
+            return 1;
+        }
+        std::vector<BatchEntry> inputs;
+        if (!load_ensemble_inputs(ensemble_path, inputs)) {
+            return 1;
+        }
+        if (inputs.empty()) {
+            std::cout << "No lanes in " << ensemble_path << "\n";
+            return 1;
+        }
+        Ensemble ensemble(inputs.size(), options.ret_stack_capacity);
+        if (!ensemble.load_program(fpath)) {
+            return 1;
+        }
+        for (size_t i=0; i<inputs.size(); i++) {
+            ensemble.preset(i, inputs[i]);
+        }
+        ensemble.run();
+        ensemble.print_results(std::cout);
+        return 0;
+    }
+
+    if (fpath.empty() && restore_path.empty()) {
         std::cout << "Please provide the program file path as an argument\n";
+        std::cout << "Usage: yuemu [--jit] [--aot=<lib> [--aot-verify]] [--no-fuse] [--trace=<level>] [--trace-file=<path>] [--profile[=<path>]]\n";
+        std::cout << "             [--callgraph=<path>] [--cache[=<level>=<size>/<ways>/<line>/<latency>,...,mem=<latency>]]\n";
+        std::cout << "             [--ret-stack=<entries>] [--input=<path>] [--output=<path>] [--dump=<path>]\n";
+        std::cout << "             [--harts=<n> [--lockstep[=<instructions>]]] [--record[=<interval>]] [--seek=<index>]\n";
+        std::cout << "             [--host-counters=<path> [--host-sample=<period>]] [--debug]\n";
+        std::cout << "             [--snapshot=<path> --snapshot-pc=<pc>] <program>\n";
+        std::cout << "       yuemu [options] --restore=<snapshot>\n";
+        std::cout << "       yuemu --aot-build=<lib> <program>\n";
+        std::cout << "       yuemu [options] --batch=<manifest> [--jobs=<n>] [--slice=<instructions>]\n";
+        std::cout << "       yuemu --ensemble=<inputs> <program>\n";
+        return 1;
+    }
+
+    // snapshots and binary traces only know about a single hart
+    if (options.harts > 1 && (!options.trace_file.empty() || !snapshot_path.empty() || !restore_path.empty())) {
+        std::cout << "--harts can't be combined with snapshots or a trace file\n";
+        return 1;
+    }
+
+    // the call tree follows one return stack
+    if (options.harts > 1 && !options.callgraph_file.empty()) {
+        std::cout << "--callgraph needs a single hart\n";
+        return 1;
+    }
+
+    // the profiler counts in its own copy of the run loop, it can't share it with a trace
+    if (options.profile && (options.trace_level >= 10 || !options.trace_file.empty())) {
+        std::cout << "--profile can't be combined with tracing\n";
+        return 1;
+    }
+
+    // and so does the timing model
+    if (options.timing && (options.profile || options.trace_level >= 10 || !options.trace_file.empty())) {
+        std::cout << "--cache can't be combined with profiling or tracing\n";
+        return 1;
+    }
+
+    // the recording journals stores in its own copy of the run loop and follows a single hart
+    if (options.record_interval > 0 && (options.harts > 1 || options.profile || options.timing || options.trace_level >= 10
+            || !options.trace_file.empty())) {
+        std::cout << "--record and --seek need a single hart and can't be combined with profiling, --cache or tracing\n";
+        return 1;
+    }
+
+    // watchpoints are only checked by the quiet and the recording run loops
+    if (debug && (!snapshot_path.empty() || seek || options.profile || options.timing || options.trace_level >= 10 || !options.trace_file.empty())) {
+        std::cout << "--debug can't be combined with --snapshot, --seek, profiling, --cache or tracing\n";
+        return 1;
+    }
+
+    if (options.host_sample_period > 0 && options.host_counters_file.empty()) {
+        std::cout << "--host-sample needs --host-counters\n";
+        return 1;
+    }
+
+    // the translation is the whole run, a translated program is what later runs load
+    if (!aot_build_path.empty() && (!options.aot_file.empty() || aot_verify || debug || !snapshot_path.empty() || seek)) {
+        std::cout << "--aot-build can't be combined with --aot, --aot-verify, --debug, --snapshot or --seek\n";
+        return 1;
+    }
+
+    // both runs would write the same files
+    if (aot_verify && (options.aot_file.empty() || !options.output_file.empty() || !options.dump_file.empty() || !options.trace_file.empty()
+            || !options.profile_file.empty() || !options.callgraph_file.empty() || !options.host_counters_file.empty() || !snapshot_path.empty()
+            || seek || debug)) {
+        std::cout << "--aot-verify needs --aot and can't be combined with --debug, --snapshot, --seek or an output, dump, trace, profile, call graph or host counters file\n";
         return 1;
     }
 
-    std::string fpath(argv[1]);
-    Yuemu yuemu(fpath);
+    if (!options.aot_file.empty() && (options.record_interval > 0 || options.profile || options.timing || options.trace_level >= 10
+            || !options.trace_file.empty())) {
+        std::cerr << "Warning: translated blocks only run quietly, the translated program is unused while recording, profiling, timing or tracing\n";
+    }
+
+    if (options.jit && options.record_interval > 0) {
+        std::cerr << "Warning: compiled blocks can't be recorded, the JIT is off while recording\n";
+    }
+
+    if (options.jit && options.trace_level >= 10) {
+        std::cerr << "Warning: compiled blocks can't be traced, the JIT is off while tracing\n";
+    }
+
+    Yuemu yuemu(options);
+    bool loaded = restore_path.empty() ? yuemu.load_program(fpath) : yuemu.restore_snapshot(restore_path);
+    if (!loaded) {
+        return 1;
+    }
+
+    if (!aot_build_path.empty()) {
+        size_t blocks = yuemu.build_aot(aot_build_path);
+        if (blocks == 0) {
+            return 1;
+        }
+        std::cout << "Translated " << blocks << " blocks to " << aot_build_path << "\n";
+        return 0;
+    }
+
+    // the same program interpreted, both runs have to print the same and end in the same state
+    if (aot_verify) {
+        YuemuOptions interpreted_options = options;
+        interpreted_options.aot_file.clear();
+        interpreted_options.jit = false;
+        Yuemu interpreted(interpreted_options);
+        if (!(restore_path.empty() ? interpreted.load_program(fpath) : interpreted.restore_snapshot(restore_path))) {
+            return 1;
+        }
+        std::ostringstream expected;
+        std::ostringstream actual;
+        interpreted.set_output(expected, expected);
+        yuemu.set_output(actual, actual);
+        interpreted.run();
+        yuemu.run();
+        std::cout << actual.str();
+
+        bool same = expected.str() == actual.str() && interpreted.get_pc() == yuemu.get_pc()
+            && interpreted.instructions_executed() == yuemu.instructions_executed();
+        for (int r=0; r<256 && same; r++) {
+            same = interpreted.get_register(r) == yuemu.get_register(r);
+        }
+        if (!same) {
+            std::cerr << "Error: the translated run differs from the interpreted one\n";
+            return 1;
+        }
+        std::cerr << "The translated run matches the interpreted one\n";
+        return 0;
+    }
+
+    // run up to the snapshot pc, save the machine there and stop
+    if (!snapshot_path.empty()) {
+        yuemu.set_stop_pc(snapshot_pc);
+        if (yuemu.run() != Yuemu::StopReason::STOP_PC) {
+            std::cerr << "Error: the program never reached pc " << snapshot_pc << ", no snapshot saved\n";
+            return 1;
+        }
+        if (!yuemu.save_snapshot(snapshot_path)) {
+            return 1;
+        }
+        std::cout << "Saved snapshot at pc " << snapshot_pc << " to " << snapshot_path << "\n";
+        return 0;
+    }
+
+    // the prompt runs the program, as far as it is told to
+    if (debug) {
+        Debugger debugger(yuemu, std::cin, std::cout);
+        debugger.run();
+        return 0;
+    }
+
+    yuemu.run();
+
+    // back (or on) to an instruction of the recorded run and show the machine there
+    if (seek) {
+        if (!yuemu.seek(seek_index)) {
+            std::cerr << "Error: the program halted after " << yuemu.position() << " instructions, before " << seek_index << "\n";
+            return 1;
+        }
+        std::cout << "\nAfter instruction " << seek_index << "\n----------------\n";
+        std::cout << "PC: " << yuemu.get_pc() << "\n";
+        for (int r=0; r<8; r++) {
+            std::cout << "[" << r << "]: " << Yuemu::to_signed(yuemu.get_register(r)) << "\n";
+        }
+    }
     return 0;
 }
@@ -0,0 +1,57 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "yuemu_dump.hpp"
+
+// Prints memory dumps as the text memory map the emulator prints, or the
+// words that changed between two of them. Several dumps in a row are laid
+// over each other, oldest first, so incremental dumps add up to the memory
+// at the last one. --diff-all compares the whole memory of two dumps of
+// the same program, a page only the old one holds counts as dropped.
+int main(int argc, char* argv[]) {
+    bool diff = false;
+    bool diff_all = false;
+    std::vector<std::string> paths;
+
+    for (int i=1; i<argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--diff") {
+            diff = true;
+        } else if (arg == "--diff-all") {
+            diff = true;
+            diff_all = true;
+        } else if (arg.rfind("--", 0) == 0) {
+            std::cout << "Unknown option: " << arg << "\n";
+            return 1;
+        } else {
+            paths.push_back(arg);
+        }
+    }
+
+    if (paths.empty() || (diff && paths.size() != 2)) {
+        std::cout << "Usage: yuemu_memdump <dump> [<later dump> ...]\n";
+        std::cout << "       yuemu_memdump --diff|--diff-all <old dump> <new dump>\n";
+        return 1;
+    }
+
+    std::vector<MemoryDump> dumps(paths.size());
+    for (size_t i=0; i<paths.size(); i++) {
+        if (!dumps[i].load(paths[i], std::cerr)) {
+            return 1;
+        }
+    }
+
+    if (diff) {
+        std::cout << "Instructions: " << dumps[0].instructions << " -> " << dumps[1].instructions << "\n";
+        size_t lines = dumps[0].print_diff(dumps[1], std::cout, diff_all);
+        std::cout << lines << " words changed\n";
+        return 0;
+    }
+
+    for (size_t i=1; i<dumps.size(); i++) {
+        dumps[0].merge(dumps[i]);
+    }
+    dumps[0].print(std::cout);
+    return 0;
+}
@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <cstring>
+
+#include "yuemu_memory.hpp"
+
+#if defined(__unix__)
+#include <sys/mman.h>
+#endif
+
+// Byte swaps count big-endian words from src into every 4th word of dst
+static void swap_words(uint32_t* dst, const uint8_t* src, size_t count) {
+    for (size_t i=0; i<count; i++) {
+        uint32_t word;
+        std::memcpy(&word, src + 4 * i, 4);
+        dst[4 * i] = __builtin_bswap32(word);
+    }
+}
+
+Memory::Page Memory::zero_page = {};
+
+Memory::Table Memory::empty_table = [] {
+    Table table;
+    for (uint32_t i=0; i<TABLE_ENTRIES; i++) {
+        table.pages[i] = (uintptr_t) &zero_page | CLEAN;
+    }
+    return table;
+}();
+
+Memory::Memory() {
+    for (uint32_t i=0; i<DIR_ENTRIES; i++) {
+        dir[i] = &empty_table;
+    }
+}
+
+Memory::~Memory() {
+    for (uint32_t d=0; d<DIR_ENTRIES; d++) {
+        Table* table = dir[d];
+        if (table == &empty_table) {
+            continue;
+        }
+        for (uint32_t t=0; t<TABLE_ENTRIES; t++) {
+            Page* page = page_of(table->pages[t]);
+            bool is_adopted = (uint8_t*) page >= adopted && (uint8_t*) page < adopted + adopted_len;
+            if (page != &zero_page && !is_adopted) {
+                delete page;
+            }
+        }
+        delete table;
+    }
+
+#if defined(__unix__)
+    if (adopted != nullptr) {
+        munmap(adopted, adopted_len);
+    }
+#endif
+}
+
+size_t Memory::page_count() const {
+    size_t count = 0;
+    for_each_page([&count](uint32_t, const void*) {
+        count++;
+    });
+    return count;
+}
+
+void Memory::adopt_pages(void* region, size_t region_len, const uint32_t* base_addrs, size_t count) {
+    adopted = (uint8_t*) region;
+    adopted_len = region_len;
+
+    for (size_t i=0; i<count; i++) {
+        uint32_t addr = base_addrs[i];
+        Table*& table = dir[addr >> (OFFSET_BITS + TABLE_BITS)];
+        if (table == &empty_table) {
+            table = new Table(empty_table);
+        }
+        table->pages[addr >> OFFSET_BITS & TABLE_MASK] = (uintptr_t) (adopted + i * sizeof(Page)) | CLEAN;
+    }
+}
+
+void Memory::write_program_words(uint32_t addr, const uint8_t* src, size_t count) {
+    while (count > 0) {
+        Page* page = find_page(addr);
+        if (page == &zero_page) {
+            page = allocate_page(addr);
+        }
+
+        // words that still fit into this page
+        uint32_t offset = addr & OFFSET_MASK;
+        size_t n = std::min<size_t>(count, (PAGE_WORDS - offset + 3) / 4);
+
+        swap_words(page->words + offset, src, n);
+
+        for (size_t i=0; i<n; i++) {
+            uint32_t o = offset + 4 * i;
+            page->present[o >> 6] |= uint64_t(1) << (o & 63);
+        }
+
+        addr += 4 * n;
+        src += 4 * n;
+        count -= n;
+    }
+}
+
+void Memory::write_data_words(uint32_t addr, const uint8_t* src, size_t count) {
+    while (count > 0) {
+        Page* page = find_page(addr);
+        if (page == &zero_page) {
+            page = allocate_page(addr);
+        }
+
+        uint32_t offset = addr & OFFSET_MASK;
+        size_t n = std::min<size_t>(count, PAGE_WORDS - offset);
+        for (size_t i=0; i<n; i++) {
+            uint32_t word;
+            std::memcpy(&word, src + 4 * i, 4);
+            page->words[offset + i] = __builtin_bswap32(word);
+            page->present[(offset + i) >> 6] |= uint64_t(1) << ((offset + i) & 63);
+        }
+
+        addr += n;
+        src += 4 * n;
+        count -= n;
+    }
+}
+
+void Memory::restore(uint32_t addr, uint32_t val, bool was_written) {
+    if (was_written) {
+        write(addr, val);
+        return;
+    }
+    Page* page = find_page(addr);
+    if (page == &zero_page) {
+        return;
+    }
+    mark_dirty(addr);
+    uint32_t offset = addr & OFFSET_MASK;
+    __atomic_store_n(&page->words[offset], 0, __ATOMIC_RELEASE);
+    __atomic_fetch_and(&page->present[offset >> 6], ~(uint64_t(1) << (offset & 63)), __ATOMIC_RELAXED);
+}
+
+// another hart may install the same table or page at the same time, whoever
+// loses the compare-and-swap uses the winner's and frees its own
+Memory::Table* Memory::allocate_table(uint32_t addr) {
+    Table** table_slot = &dir[addr >> (OFFSET_BITS + TABLE_BITS)];
+    Table* table = __atomic_load_n(table_slot, __ATOMIC_ACQUIRE);
+    if (table == &empty_table) {
+        Table* fresh = new Table(empty_table);
+        if (__atomic_compare_exchange_n(table_slot, &table, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            table = fresh;
+        } else {
+            delete fresh;
+        }
+    }
+    return table;
+}
+
+Memory::Page* Memory::allocate_page(uint32_t addr) {
+    Table* table = allocate_table(addr);
+
+    // a new page starts out clean, and watched if the zero page was watched there
+    uintptr_t* page_slot = &table->pages[addr >> OFFSET_BITS & TABLE_MASK];
+    uintptr_t entry = __atomic_load_n(page_slot, __ATOMIC_ACQUIRE);
+    if (page_of(entry) == &zero_page) {
+        Page* fresh = new Page(); // value-initialized, so unwritten words still read as 0
+        uintptr_t fresh_entry = (uintptr_t) fresh | CLEAN | (entry & WATCHED);
+        if (__atomic_compare_exchange_n(page_slot, &entry, fresh_entry, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            entry = fresh_entry;
+        } else {
+            delete fresh;
+        }
+    }
+    return page_of(entry);
+}
+
+// harts writing the same clean page race to clear its tag, only the one that
+// cleared it lists it. Writes to a watched page come through here every time.
+Memory::Page* Memory::mark_dirty(uint32_t addr) {
+    Page* page = allocate_page(addr);
+    uintptr_t* page_slot = &find_table(addr)->pages[addr >> OFFSET_BITS & TABLE_MASK];
+    if ((__atomic_load_n(page_slot, __ATOMIC_ACQUIRE) & CLEAN) != 0
+            && (__atomic_fetch_and(page_slot, ~CLEAN, __ATOMIC_ACQ_REL) & CLEAN) != 0) {
+        std::lock_guard<std::mutex> guard(dirty_lock);
+        dirty_pages.push_back(addr & ~OFFSET_MASK);
+    }
+    return page;
+}
+
+void Memory::set_watched(uint32_t addr, bool watched) {
+    if (!watched && find_table(addr) == &empty_table) {
+        return;
+    }
+    uintptr_t* page_slot = &allocate_table(addr)->pages[addr >> OFFSET_BITS & TABLE_MASK];
+    if (watched) {
+        __atomic_fetch_or(page_slot, WATCHED, __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_and(page_slot, ~WATCHED, __ATOMIC_RELEASE);
+    }
+}
+
+std::vector<uint32_t> Memory::take_dirty_pages() {
+    std::vector<uint32_t> pages;
+    {
+        std::lock_guard<std::mutex> guard(dirty_lock);
+        pages.swap(dirty_pages);
+    }
+    for (uint32_t base : pages) {
+        __atomic_fetch_or(&find_table(base)->pages[base >> OFFSET_BITS & TABLE_MASK], CLEAN, __ATOMIC_RELEASE);
+    }
+    std::sort(pages.begin(), pages.end());
+    return pages;
+}
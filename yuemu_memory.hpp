@@ -0,0 +1,194 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Sparse guest memory covering the whole 32-bit address space, one 32-bit word
+// per address. An address is split into a directory index, a table index and a
+// page offset. Pages are allocated on the first write to them; everything else
+// points at a shared zero page, so reads never allocate and never branch.
+//
+// Several harts may read and write one Memory at the same time. Every guest
+// word access is atomic, loads are acquires and stores are releases, which
+// costs nothing over plain moves on x86-64. Missing tables and pages are
+// installed with a compare-and-swap, the losing thread frees its copy.
+//
+// A table entry also tells whether its page is clean, written by neither
+// store nor restore since the last take_dirty_pages(). The zero page always
+// counts as clean, so a write only tests one bit where it used to compare
+// with the zero page, and the first write to a clean page lists it as dirty
+// on its way through the slow path. Loading a program doesn't dirty pages.
+//
+// A second tag marks pages with a watchpoint on them. Writes test both tags
+// with the same instruction, so every write to a watched page takes the slow
+// path and the rest cost what they did. Reads mask the tags off like before,
+// watched() is how the run loop tells a watched page from the others.
+class Memory {
+    public:
+        static constexpr uint32_t OFFSET_BITS = 12;
+        static constexpr uint32_t TABLE_BITS = 10;
+        static constexpr uint32_t DIR_BITS = 32 - TABLE_BITS - OFFSET_BITS;
+
+        static constexpr uint32_t PAGE_WORDS = 1u << OFFSET_BITS;
+        static constexpr uint32_t TABLE_ENTRIES = 1u << TABLE_BITS;
+        static constexpr uint32_t DIR_ENTRIES = 1u << DIR_BITS;
+        static constexpr uint32_t OFFSET_MASK = PAGE_WORDS - 1;
+        static constexpr uint32_t TABLE_MASK = TABLE_ENTRIES - 1;
+
+        Memory();
+        ~Memory();
+        Memory(const Memory&) = delete;
+        Memory& operator=(const Memory&) = delete;
+
+        uint32_t read(uint32_t addr) const {
+            const Page* page = find_page(addr);
+            return __atomic_load_n(&page->words[addr & OFFSET_MASK], __ATOMIC_ACQUIRE);
+        }
+
+        void write(uint32_t addr, uint32_t val) {
+            uintptr_t entry = __atomic_load_n(&find_table(addr)->pages[addr >> OFFSET_BITS & TABLE_MASK], __ATOMIC_ACQUIRE);
+            Page* page = (Page*) entry;
+            if ((entry & TAGS) != 0) {
+                page = mark_dirty(addr);
+            }
+            uint32_t offset = addr & OFFSET_MASK;
+            __atomic_store_n(&page->words[offset], val, __ATOMIC_RELEASE);
+
+            // the present bits are shared by 64 words, only the first write to a word needs the atomic or
+            uint64_t bit = uint64_t(1) << (offset & 63);
+            if ((__atomic_load_n(&page->present[offset >> 6], __ATOMIC_RELAXED) & bit) == 0) {
+                __atomic_fetch_or(&page->present[offset >> 6], bit, __ATOMIC_RELAXED);
+            }
+        }
+
+        // whether the page holding addr is tagged as watched
+        bool watched(uint32_t addr) const {
+            return (__atomic_load_n(&find_table(addr)->pages[addr >> OFFSET_BITS & TABLE_MASK], __ATOMIC_ACQUIRE) & WATCHED) != 0;
+        }
+
+        // tags or untags the page holding addr, the tag stays through writes,
+        // restores and take_dirty_pages() but not through adopt_pages()
+        void set_watched(uint32_t addr, bool watched);
+
+        // whether addr has been written since the memory was made
+        bool written(uint32_t addr) const {
+            const Page* page = find_page(addr);
+            uint32_t offset = addr & OFFSET_MASK;
+            return (__atomic_load_n(&page->present[offset >> 6], __ATOMIC_RELAXED) >> (offset & 63)) & 1;
+        }
+
+        // puts a word back the way it was before a write, an address that had
+        // never been written reads as 0 and leaves the memory dump again
+        void restore(uint32_t addr, uint32_t val, bool was_written);
+
+        // writes count big-endian words from src to addr, addr + 4, addr + 8, ...
+        // which is how a program image is laid out in guest memory
+        void write_program_words(uint32_t addr, const uint8_t* src, size_t count);
+
+        // writes count big-endian words from src to addr, addr + 1, addr + 2, ...
+        // which is how an executable lays out its data segments
+        void write_data_words(uint32_t addr, const uint8_t* src, size_t count);
+
+        // base addresses of the pages written since the last call, in address
+        // order, and marks them clean again. Call it while no hart runs.
+        std::vector<uint32_t> take_dirty_pages();
+
+        // the words of the page at base and which of them have been written
+        const uint32_t* page_words(uint32_t base) const { return find_page(base)->words; }
+        const uint64_t* page_present(uint32_t base) const { return find_page(base)->present; }
+
+        // snapshot support: pages are saved and restored as raw page_bytes() blobs
+        static size_t page_bytes() { return sizeof(Page); }
+        size_t page_count() const;
+
+        // calls f(base_addr, data) for every allocated page, in address order
+        template <typename F>
+        void for_each_page(F f) const {
+            for (uint32_t d=0; d<DIR_ENTRIES; d++) {
+                const Table* table = dir[d];
+                if (table == &empty_table) {
+                    continue;
+                }
+                for (uint32_t t=0; t<TABLE_ENTRIES; t++) {
+                    const Page* page = page_of(table->pages[t]);
+                    if (page != &zero_page) {
+                        f((d << (TABLE_BITS + OFFSET_BITS)) | (t << OFFSET_BITS), (const void*) page);
+                    }
+                }
+            }
+        }
+
+        // on an empty Memory, uses count pages stored back to back in a private
+        // file mapping as guest memory in place, so writes copy only the host
+        // pages they touch. Memory unmaps the region when it is destroyed.
+        void adopt_pages(void* region, size_t region_len, const uint32_t* base_addrs, size_t count);
+
+        // calls f(addr, val) for every word that has been written, in address order
+        template <typename F>
+        void for_each_word(F f) const {
+            for (uint32_t d=0; d<DIR_ENTRIES; d++) {
+                const Table* table = dir[d];
+                if (table == &empty_table) {
+                    continue;
+                }
+                for (uint32_t t=0; t<TABLE_ENTRIES; t++) {
+                    const Page* page = page_of(table->pages[t]);
+                    if (page == &zero_page) {
+                        continue;
+                    }
+                    uint32_t base = (d << (TABLE_BITS + OFFSET_BITS)) | (t << OFFSET_BITS);
+                    for (uint32_t w=0; w<PAGE_WORDS/64; w++) {
+                        uint64_t bits = page->present[w];
+                        while (bits != 0) {
+                            uint32_t offset = w * 64 + __builtin_ctzll(bits);
+                            f(base + offset, page->words[offset]);
+                            bits &= bits - 1;
+                        }
+                    }
+                }
+            }
+        }
+
+    private:
+        struct Page {
+            uint32_t words[PAGE_WORDS];
+            uint64_t present[PAGE_WORDS / 64]; // which words have been written, for the memory dump
+        };
+
+        // tag a table entry, pages are aligned so the low bits are free
+        static constexpr uintptr_t CLEAN = 1;
+        static constexpr uintptr_t WATCHED = 2;
+        static constexpr uintptr_t TAGS = CLEAN | WATCHED;
+
+        struct Table {
+            uintptr_t pages[TABLE_ENTRIES]; // Page pointers, with CLEAN set while the page is clean and WATCHED while watched
+        };
+
+        static Page* page_of(uintptr_t entry) { return (Page*) (entry & ~TAGS); }
+
+        static Page zero_page;
+        static Table empty_table;
+
+        Table* dir[DIR_ENTRIES];
+
+        // mappings handed over by adopt_pages, their pages aren't deleted one by one
+        uint8_t* adopted = nullptr;
+        size_t adopted_len = 0;
+
+        std::mutex dirty_lock; // only taken by the first write to a clean page
+        std::vector<uint32_t> dirty_pages;
+
+        Table* find_table(uint32_t addr) const {
+            return __atomic_load_n(&dir[addr >> (OFFSET_BITS + TABLE_BITS)], __ATOMIC_ACQUIRE);
+        }
+
+        Page* find_page(uint32_t addr) const {
+            return page_of(__atomic_load_n(&find_table(addr)->pages[addr >> OFFSET_BITS & TABLE_MASK], __ATOMIC_ACQUIRE));
+        }
+
+        Table* allocate_table(uint32_t addr);
+        Page* allocate_page(uint32_t addr);
+        Page* mark_dirty(uint32_t addr);
+};
@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <map>
+
+#include "yuemu_decode.hpp"
+#include "yuemu_profile.hpp"
+
+Profiler::Profiler(uint32_t code_start, uint64_t code_bytes, bool calls)
+    : code_start(code_start),
+      slots(code_bytes / 4),
+      pc_counts(slots, 0),
+      taken_counts(slots, 0),
+      not_taken_counts(slots, 0),
+      page_loads(PAGES, 0),
+      page_stores(PAGES, 0),
+      calls_enabled(calls) {
+    call_nodes.push_back(CallNode{0, 0, 0, 0, 0});
+}
+
+// a br or brif names its target in the instruction, so the site is enough to
+// find the child, unless the program rewrote the branch since
+void Profiler::enter(uint32_t site, uint32_t target) {
+    call_nodes[call_current].self += executed - call_mark;
+    call_mark = executed;
+
+    uint64_t key = (uint64_t) call_current << 32 | site;
+    auto it = call_children.find(key);
+    if (it == call_children.end() || call_nodes[it->second].target != target) {
+        uint32_t node = call_nodes.size();
+        call_nodes.push_back(CallNode{call_current, site, target, 0, 0});
+        call_children[key] = node;
+        call_current = node;
+    } else {
+        call_current = it->second;
+    }
+    call_nodes[call_current].calls++;
+}
+
+// a ret at the root pops an address pushed before profiling started, it stays at the root
+void Profiler::leave() {
+    call_nodes[call_current].self += executed - call_mark;
+    call_mark = executed;
+    call_current = call_nodes[call_current].parent;
+}
+
+// self counts with the node still running charged up to now
+std::vector<uint64_t> Profiler::call_self() const {
+    std::vector<uint64_t> self(call_nodes.size());
+    for (size_t i=0; i<call_nodes.size(); i++) {
+        self[i] = call_nodes[i].self;
+    }
+    self[call_current] += executed - call_mark;
+    return self;
+}
+
+// the children of every node, in the order they were first called
+std::vector<std::vector<uint32_t>> Profiler::call_tree() const {
+    std::vector<std::vector<uint32_t>> children(call_nodes.size());
+    for (size_t i=1; i<call_nodes.size(); i++) {
+        children[call_nodes[i].parent].push_back(i);
+    }
+    return children;
+}
+
+// A recursive call's inclusive count is already part of the outermost call
+// of the same site on its path, so only the outermost one adds it.
+std::vector<Profiler::CallSite> Profiler::call_sites() const {
+    std::vector<uint64_t> self = call_self();
+    std::vector<uint64_t> inclusive = self;
+    for (size_t i=call_nodes.size() - 1; i>0; i--) {
+        inclusive[call_nodes[i].parent] += inclusive[i];
+    }
+
+    std::vector<std::vector<uint32_t>> children = call_tree();
+
+    // depth first, on_path counts the open calls of every site on the way down
+    std::vector<CallSite> sites;
+    std::unordered_map<uint64_t, size_t> site_index;
+    std::unordered_map<uint64_t, uint32_t> on_path;
+    std::vector<std::pair<uint32_t, size_t>> path{{0, 0}};
+    while (!path.empty()) {
+        uint32_t node = path.back().first;
+        if (path.back().second == children[node].size()) {
+            if (node != 0) {
+                on_path[(uint64_t) call_nodes[node].site << 32 | call_nodes[node].target]--;
+            }
+            path.pop_back();
+            continue;
+        }
+
+        uint32_t child = children[node][path.back().second++];
+        const CallNode& c = call_nodes[child];
+        uint64_t key = (uint64_t) c.site << 32 | c.target;
+        auto it = site_index.find(key);
+        if (it == site_index.end()) {
+            it = site_index.emplace(key, sites.size()).first;
+            sites.push_back(CallSite{c.site, c.target, 0, 0, 0});
+        }
+        CallSite& site = sites[it->second];
+        site.calls += c.calls;
+        site.exclusive += self[child];
+        if (on_path[key]++ == 0) {
+            site.inclusive += inclusive[child];
+        }
+        path.emplace_back(child, 0);
+    }
+    return sites;
+}
+
+namespace {
+
+// indexes of the nonzero entries of counts, busiest first, at most limit of them
+template <typename Count>
+std::vector<uint32_t> top_indexes(size_t size, Count count, size_t limit) {
+    std::vector<uint32_t> indexes;
+    for (size_t i=0; i<size; i++) {
+        if (count(i) != 0) {
+            indexes.push_back(i);
+        }
+    }
+    auto busier = [&count](uint32_t a, uint32_t b) {
+        return count(a) != count(b) ? count(a) > count(b) : a < b;
+    };
+    if (indexes.size() > limit) {
+        std::partial_sort(indexes.begin(), indexes.begin() + limit, indexes.end(), busier);
+        indexes.resize(limit);
+    } else {
+        std::sort(indexes.begin(), indexes.end(), busier);
+    }
+    return indexes;
+}
+
+double percent(uint64_t part, uint64_t whole) {
+    return whole == 0 ? 0 : 100.0 * part / whole;
+}
+
+} // namespace
+
+std::string Profiler::symbol(uint32_t addr) const {
+    std::string name = symbols != nullptr ? symbols->describe(addr) : "";
+    return name.empty() ? name : "  " + name;
+}
+
+void Profiler::print_report(std::ostream& os) const {
+    uint64_t all = executed;
+    os << "\nProfile\n----------------\n";
+    os << "Instructions: " << all << ", outside the program: " << outside << "\n";
+    os << std::fixed << std::setprecision(2);
+
+    os << "\nOpcodes:\n";
+    auto opcode = [this](size_t i) { return opcode_counts[i]; };
+    for (uint32_t byte : top_indexes(256, opcode, 256)) {
+        os << "  " << std::setw(10) << std::left << op_name(decode(byte << 24).op) << std::right
+           << " 0x" << std::hex << std::uppercase << std::setw(2) << std::setfill('0') << byte << std::dec << std::setfill(' ')
+           << std::setw(16) << opcode_counts[byte] << std::setw(8) << percent(opcode_counts[byte], all) << "%\n";
+    }
+
+    os << "\nHot pcs:\n";
+    auto pc = [this](size_t i) { return pc_counts[i]; };
+    for (uint32_t slot : top_indexes(slots, pc, REPORT_ROWS)) {
+        os << "  pc " << std::setw(10) << code_start + 4 * slot << std::setw(16) << pc_counts[slot]
+           << std::setw(8) << percent(pc_counts[slot], all) << "%" << symbol(code_start + 4 * slot) << "\n";
+    }
+
+    os << "\nBranches:\n";
+    auto branch = [this](size_t i) { return taken_counts[i] + not_taken_counts[i]; };
+    for (uint32_t slot : top_indexes(slots, branch, REPORT_ROWS)) {
+        os << "  pc " << std::setw(10) << code_start + 4 * slot << "  taken " << std::setw(14) << taken_counts[slot]
+           << "  not taken " << std::setw(14) << not_taken_counts[slot]
+           << std::setw(8) << percent(taken_counts[slot], taken_counts[slot] + not_taken_counts[slot]) << "% taken"
+           << symbol(code_start + 4 * slot) << "\n";
+    }
+
+    os << "\nMemory pages:\n";
+    auto page = [this](size_t i) { return page_loads[i] + page_stores[i]; };
+    for (uint32_t p : top_indexes(PAGES, page, REPORT_ROWS)) {
+        os << "  page " << std::setw(10) << (p << Memory::OFFSET_BITS) << "  loads " << std::setw(14) << page_loads[p]
+           << "  stores " << std::setw(14) << page_stores[p] << "\n";
+    }
+
+    if (calls_enabled) {
+        os << "\nCalls:\n";
+        std::vector<CallSite> sites = call_sites();
+        auto inclusive = [&sites](size_t i) { return sites[i].inclusive; };
+        for (uint32_t i : top_indexes(sites.size(), inclusive, REPORT_ROWS)) {
+            const CallSite& site = sites[i];
+            os << "  pc " << std::setw(10) << site.site << " -> " << std::setw(10) << site.target
+               << "  calls " << std::setw(12) << site.calls << "  inclusive " << std::setw(14) << site.inclusive
+               << std::setw(8) << percent(site.inclusive, all) << "%  exclusive " << std::setw(14) << site.exclusive
+               << symbol(site.target) << "\n";
+        }
+    }
+    os.unsetf(std::ios::floatfield);
+}
+
+bool Profiler::write(const std::string& path) const {
+    std::ofstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    file << "yuemu-profile " << FORMAT_VERSION << "\n";
+    file << "instructions " << executed << "\n";
+    file << "outside " << outside << "\n";
+    for (uint32_t byte=0; byte<256; byte++) {
+        if (opcode_counts[byte] != 0) {
+            file << "opcode " << (byte >> 4) << " " << (byte & 0xF) << " " << op_name(decode(byte << 24).op) << " " << opcode_counts[byte] << "\n";
+        }
+    }
+    for (uint32_t slot=0; slot<slots; slot++) {
+        if (pc_counts[slot] != 0) {
+            file << "pc " << code_start + 4 * slot << " " << pc_counts[slot] << "\n";
+        }
+    }
+    for (uint32_t slot=0; slot<slots; slot++) {
+        if (taken_counts[slot] != 0 || not_taken_counts[slot] != 0) {
+            file << "branch " << code_start + 4 * slot << " " << taken_counts[slot] << " " << not_taken_counts[slot] << "\n";
+        }
+    }
+    for (uint32_t p=0; p<PAGES; p++) {
+        if (page_loads[p] != 0 || page_stores[p] != 0) {
+            file << "page " << (p << Memory::OFFSET_BITS) << " " << page_loads[p] << " " << page_stores[p] << "\n";
+        }
+    }
+    if (calls_enabled) {
+        std::vector<CallSite> sites = call_sites();
+        std::sort(sites.begin(), sites.end(), [](const CallSite& a, const CallSite& b) {
+            return a.site != b.site ? a.site < b.site : a.target < b.target;
+        });
+        for (const CallSite& site : sites) {
+            file << "call " << site.site << " " << site.target << " " << site.calls << " "
+                 << site.inclusive << " " << site.exclusive << "\n";
+        }
+    }
+    return (bool) file.flush();
+}
+
+// Calls from different sites to the same target share a frame name, their
+// paths are merged into one line.
+bool Profiler::write_folded(const std::string& path) const {
+    std::ofstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    std::vector<uint64_t> self = call_self();
+    std::vector<std::vector<uint32_t>> children = call_tree();
+
+    // depth first, frames holds the path down to the node on top of nodes
+    std::map<std::string, uint64_t> stacks;
+    std::string frames = "main";
+    std::vector<std::pair<uint32_t, size_t>> nodes{{0, 0}};
+    stacks[frames] += self[0];
+    while (!nodes.empty()) {
+        uint32_t node = nodes.back().first;
+        if (nodes.back().second == children[node].size()) {
+            frames.resize(node == 0 ? 0 : frames.rfind(';'));
+            nodes.pop_back();
+            continue;
+        }
+
+        uint32_t child = children[node][nodes.back().second++];
+        std::string name = symbols != nullptr ? symbols->describe(call_nodes[child].target) : "";
+        if (name.empty()) {
+            char frame[16];
+            snprintf(frame, sizeof(frame), ";0x%08X", call_nodes[child].target);
+            frames += frame;
+        } else {
+            frames += ";" + name;
+        }
+        stacks[frames] += self[child];
+        nodes.emplace_back(child, 0);
+    }
+
+    for (const auto& [stack, count] : stacks) {
+        if (count != 0) {
+            file << stack << " " << count << "\n";
+        }
+    }
+    return (bool) file.flush();
+}
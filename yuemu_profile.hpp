@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "yuemu_image.hpp"
+#include "yuemu_memory.hpp"
+
+// Execution counts gathered by the profiling run loop. Everything is a flat
+// array: per instruction slot of the loaded code, per opcode byte
+// (category << 4 | id) and per guest memory page, so counting an instruction
+// is an index and an increment. Instructions executed outside the loaded
+// program only go into the opcode counts and one shared outside counter.
+//
+// With calls on, br and brif build a call tree: one node per call path, each
+// with the instructions run in it between its calls and returns. The tree
+// follows a single return stack, so it only makes sense for a single hart.
+class Profiler {
+    public:
+        static constexpr uint32_t FORMAT_VERSION = 2;
+        static constexpr size_t REPORT_ROWS = 20; // hotspot rows per report section
+
+        // code_bytes from code_start are the code the pcs are counted for
+        Profiler(uint32_t code_start, uint64_t code_bytes, bool calls);
+
+        // the reports name pcs by these from then on, they have to outlive the profiler
+        void set_symbols(const SymbolTable* symbol_table) { symbols = symbol_table; }
+
+        void count(uint32_t pc, uint32_t instr) {
+            executed++;
+            uint32_t slot = (pc - code_start) / 4;
+            if (slot < slots) {
+                pc_counts[slot]++;
+            } else {
+                outside++;
+            }
+            opcode_counts[instr >> 24]++;
+        }
+
+        // jumpif, jumpif direct and brif
+        void branch(uint32_t pc, bool taken) {
+            uint32_t slot = (pc - code_start) / 4;
+            if (slot < slots) {
+                (taken ? taken_counts : not_taken_counts)[slot]++;
+            }
+        }
+
+        // a taken br or brif at site, after the instruction was counted
+        void call(uint32_t site, uint32_t target) {
+            if (calls_enabled) {
+                enter(site, target);
+            }
+        }
+
+        // a ret that popped a return address
+        void ret() {
+            if (calls_enabled) {
+                leave();
+            }
+        }
+
+        void load(uint32_t addr) { page_loads[addr >> Memory::OFFSET_BITS]++; }
+        void store(uint32_t addr) { page_stores[addr >> Memory::OFFSET_BITS]++; }
+
+        // opcodes, pcs, branches, pages and calls sorted by count, the busiest first
+        void print_report(std::ostream& os) const;
+
+        // every nonzero counter, in address order, one per line:
+        // yuemu-profile <FORMAT_VERSION>
+        // instructions <total>
+        // outside <count>
+        // opcode <category> <id> <name> <count>
+        // pc <pc> <count>
+        // branch <pc> <taken> <not taken>
+        // page <base address> <loads> <stores>
+        // call <site> <target> <calls> <inclusive> <exclusive>
+        bool write(const std::string& path) const;
+
+        // the call tree in folded stack format for flame graph tools, one line
+        // per call path that ran anything itself: "main;0x00000040;0x00000100 <count>"
+        // with a symbol in place of every target that has one
+        bool write_folded(const std::string& path) const;
+
+    private:
+        static constexpr uint32_t PAGES = 1u << (32 - Memory::OFFSET_BITS);
+
+        struct CallNode {
+            uint32_t parent;
+            uint32_t site; // pc of the br or brif
+            uint32_t target;
+            uint64_t calls;
+            uint64_t self; // instructions run in this node, not in its callees
+        };
+
+        // a call site summed over every path it was reached on
+        struct CallSite {
+            uint32_t site;
+            uint32_t target;
+            uint64_t calls;
+            uint64_t inclusive;
+            uint64_t exclusive;
+        };
+
+        const uint32_t code_start;
+        const uint32_t slots;
+        const SymbolTable* symbols = nullptr;
+        std::vector<uint64_t> pc_counts;
+        std::vector<uint64_t> taken_counts;
+        std::vector<uint64_t> not_taken_counts;
+        std::vector<uint64_t> page_loads;
+        std::vector<uint64_t> page_stores;
+        uint64_t opcode_counts[256] = {0};
+        uint64_t outside = 0;
+        uint64_t executed = 0;
+
+        const bool calls_enabled;
+        std::vector<CallNode> call_nodes; // the root first, parents before their children
+        std::unordered_map<uint64_t, uint32_t> call_children; // parent << 32 | site to node
+        uint32_t call_current = 0;
+        uint64_t call_mark = 0; // executed when call_current was last charged
+
+        void enter(uint32_t site, uint32_t target);
+        void leave();
+        std::vector<uint64_t> call_self() const;
+        std::vector<std::vector<uint32_t>> call_tree() const;
+        std::vector<CallSite> call_sites() const;
+        std::string symbol(uint32_t addr) const; // "  name+0x4" or nothing
+};
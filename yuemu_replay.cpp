@@ -0,0 +1,61 @@
+#include <algorithm>
+
+#include "yuemu_replay.hpp"
+
+void Recorder::checkpoint(const Hart& hart, Devices& devices) {
+    if (!checkpoints.empty()) {
+        compact(checkpoints.back().journal_size);
+    }
+    checkpoints.emplace_back();
+    Checkpoint& cp = checkpoints.back();
+    cp.index = hart.executed;
+    cp.pc = hart.pc;
+    std::copy(hart.regs, hart.regs + 256, cp.regs);
+    cp.ret_stack.assign(hart.ret_stack.data(), hart.ret_stack.data() + hart.ret_stack.size());
+    cp.devices = devices.save_state();
+    cp.journal_size = journal_entries.size();
+    advance(hart.executed);
+}
+
+// the last checkpoint stays even past index, the recording never goes back before its start
+uint64_t Recorder::rewind(uint64_t index, Hart& hart, Memory& mem, Devices& devices) {
+    while (checkpoints.size() > 1 && checkpoints.back().index > index) {
+        checkpoints.pop_back();
+    }
+    const Checkpoint& cp = checkpoints.back();
+
+    // newest first, an address written twice since the checkpoint ends up with its oldest word
+    for (size_t i=journal_entries.size(); i>cp.journal_size; i--) {
+        const UndoEntry& entry = journal_entries[i - 1];
+        mem.restore(entry.addr, entry.old_val, entry.written);
+        hart.block_cache.invalidate(entry.addr);
+    }
+    journal_entries.resize(cp.journal_size);
+
+    hart.pc = cp.pc;
+    std::copy(cp.regs, cp.regs + 256, hart.regs);
+    hart.ret_stack.clear();
+    for (uint32_t entry : cp.ret_stack) {
+        hart.ret_stack.push(entry);
+    }
+    hart.executed = cp.index;
+    hart.reason = StopReason::BUDGET;
+    devices.restore_state(cp.devices);
+    return cp.index;
+}
+
+uint64_t Recorder::checkpoint_before(uint64_t index) const {
+    auto after = std::lower_bound(checkpoints.begin(), checkpoints.end(), index,
+        [](const Checkpoint& cp, uint64_t i) { return cp.index < i; });
+    return after == checkpoints.begin() ? index : (after - 1)->index;
+}
+
+// keeps the first entry for every address written since from, the one that holds the word the checkpoint saw
+void Recorder::compact(size_t from) {
+    auto first = journal_entries.begin() + from;
+    std::stable_sort(first, journal_entries.end(),
+        [](const UndoEntry& a, const UndoEntry& b) { return a.addr < b.addr; });
+    auto last = std::unique(first, journal_entries.end(),
+        [](const UndoEntry& a, const UndoEntry& b) { return a.addr == b.addr; });
+    journal_entries.erase(last, journal_entries.end());
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "yuemu_devices.hpp"
+#include "yuemu_hart.hpp"
+#include "yuemu_memory.hpp"
+
+// Record and replay of a single hart. While recording, the run loop hands the
+// recorder every address a store is about to overwrite and the old word goes
+// into an undo journal. Every interval instructions the recorder takes a
+// checkpoint of pc, the registers, the return stack, the device state and the
+// journal length. A checkpoint never copies memory: memory at a checkpoint is
+// the current memory with the journal undone down to its length. Once an
+// interval is over only the first write to each address in it is still
+// needed, so its journal is cut down to those.
+//
+// Going back to instruction n undoes the journal to the last checkpoint at or
+// before n and restores it, the caller runs the rest forward again, never more
+// than interval instructions. The checkpoints after it are dropped, running on
+// takes them again. Everything before end() has been recorded once already,
+// running it again is a replay, see Devices for what changes then. Registers
+// or memory changed from outside while behind end() aren't part of the
+// recording, the replay goes on from whatever they hold.
+class Recorder {
+    public:
+        static constexpr uint64_t DEFAULT_INTERVAL = 1 << 20;
+
+        explicit Recorder(uint64_t interval) : interval(interval) {}
+
+        // before every store to addr while recording
+        void journal(const Memory& mem, uint32_t addr) {
+            journal_entries.push_back(UndoEntry{addr, mem.read(addr), mem.written(addr)});
+        }
+
+        bool started() const { return !checkpoints.empty(); }
+        uint64_t start() const { return checkpoints.front().index; }
+        uint64_t next_checkpoint() const { return checkpoints.back().index + interval; }
+        uint64_t end() const { return recorded_end; }
+
+        // the hart has executed index instructions
+        void advance(uint64_t index) {
+            if (index > recorded_end) {
+                recorded_end = index;
+            }
+        }
+
+        // the first one starts the recording
+        void checkpoint(const Hart& hart, Devices& devices);
+
+        // goes back to the last checkpoint at or before index, returns its index
+        uint64_t rewind(uint64_t index, Hart& hart, Memory& mem, Devices& devices);
+
+        // index of the last checkpoint before index, index itself if there is none
+        uint64_t checkpoint_before(uint64_t index) const;
+
+        size_t checkpoint_count() const { return checkpoints.size(); }
+        size_t journal_size() const { return journal_entries.size(); }
+
+    private:
+        struct UndoEntry {
+            uint32_t addr;
+            uint32_t old_val;
+            bool written; // whether addr had been written before
+        };
+
+        struct Checkpoint {
+            uint64_t index; // instructions the hart had executed
+            uint32_t pc;
+            uint32_t regs[256];
+            std::vector<uint32_t> ret_stack; // bottom first
+            Devices::State devices;
+            size_t journal_size;
+        };
+
+        const uint64_t interval;
+        uint64_t recorded_end = 0;
+        std::vector<Checkpoint> checkpoints;
+        std::vector<UndoEntry> journal_entries;
+
+        void compact(size_t from);
+};
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "yuemu.hpp"
+
+// Snapshot file layout, all in host byte order:
+// header | regs[256] | ret_stack (bottom first) | page base addresses | padding | pages
+// The page data starts at a PAGE_ALIGN boundary so it can be mapped straight
+// into guest memory on restore.
+namespace {
+
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+constexpr uint64_t PAGE_ALIGN = 1 << 16; // covers every common host page size
+
+struct SnapshotHeader {
+    char magic[8]; // "YUESNAP"
+    uint32_t version;
+    uint32_t pc;
+    uint32_t halt_pc;
+    uint32_t ret_stack_size;
+    uint32_t page_count;
+    uint32_t page_bytes;
+    uint64_t pages_offset;
+};
+
+} // namespace
+
+bool Yuemu::save_snapshot(const std::string& path) const {
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        *err << "Error: can't open snapshot file: " << path << "\n";
+        return false;
+    }
+
+    const Hart& hart = *harts[0];
+    std::vector<uint32_t> stack_entries(hart.ret_stack.data(), hart.ret_stack.data() + hart.ret_stack.size());
+
+    std::vector<uint32_t> page_addrs;
+    mem.for_each_page([&page_addrs](uint32_t base, const void*) {
+        page_addrs.push_back(base);
+    });
+
+    SnapshotHeader header = {};
+    std::memcpy(header.magic, "YUESNAP", 8);
+    header.version = SNAPSHOT_VERSION;
+    header.pc = hart.pc;
+    header.halt_pc = halt_pc;
+    header.ret_stack_size = stack_entries.size();
+    header.page_count = page_addrs.size();
+    header.page_bytes = Memory::page_bytes();
+
+    uint64_t meta_size = sizeof(header) + sizeof(hart.regs) + 4 * (stack_entries.size() + page_addrs.size());
+    header.pages_offset = (meta_size + PAGE_ALIGN - 1) / PAGE_ALIGN * PAGE_ALIGN;
+
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && std::fwrite(hart.regs, sizeof(hart.regs), 1, file) == 1;
+    ok = ok && std::fwrite(stack_entries.data(), 4, stack_entries.size(), file) == stack_entries.size();
+    ok = ok && std::fwrite(page_addrs.data(), 4, page_addrs.size(), file) == page_addrs.size();
+
+    std::vector<char> padding(header.pages_offset - meta_size, 0);
+    ok = ok && std::fwrite(padding.data(), 1, padding.size(), file) == padding.size();
+
+    mem.for_each_page([&ok, file](uint32_t, const void* data) {
+        ok = ok && std::fwrite(data, Memory::page_bytes(), 1, file) == 1;
+    });
+
+    ok = (std::fclose(file) == 0) && ok;
+    if (!ok) {
+        *err << "Error: can't write snapshot file: " << path << "\n";
+    }
+    return ok;
+}
+
+bool Yuemu::restore_snapshot(const std::string& path) {
+    HostCounters::Scope phase(host_counters.get(), HostCounters::LOAD);
+#if defined(__unix__)
+    if (mem.page_count() != 0) {
+        *err << "Error: snapshots can only be restored into an empty machine\n";
+        return false;
+    }
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *err << "Error: can't open snapshot file: " << path << "\n";
+        return false;
+    }
+
+    SnapshotHeader header;
+    bool ok = pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && std::memcmp(header.magic, "YUESNAP", 8) == 0
+        && header.version == SNAPSHOT_VERSION
+        && header.page_bytes == Memory::page_bytes()
+        && header.ret_stack_size <= harts[0]->ret_stack.capacity();
+
+    // the tables and the pages have to lie in the file before anything is
+    // allocated for them, touching a mapped page past its end would raise SIGBUS
+    Hart& hart = *harts[0];
+    uint64_t tables_end = sizeof(header) + sizeof(hart.regs) + 4 * ((uint64_t) header.ret_stack_size + header.page_count);
+    uint64_t pages_len = (uint64_t) header.page_count * header.page_bytes;
+    struct stat st;
+    ok = ok && fstat(fd, &st) == 0 && tables_end <= header.pages_offset && header.pages_offset <= (uint64_t) st.st_size
+        && pages_len <= (uint64_t) st.st_size - header.pages_offset;
+
+    std::vector<uint32_t> stack_entries;
+    std::vector<uint32_t> page_addrs;
+    if (ok) {
+        stack_entries.resize(header.ret_stack_size);
+        page_addrs.resize(header.page_count);
+
+        off_t offset = sizeof(header);
+        ok = pread(fd, hart.regs, sizeof(hart.regs), offset) == sizeof(hart.regs);
+        offset += sizeof(hart.regs);
+        ok = ok && pread(fd, stack_entries.data(), 4 * stack_entries.size(), offset) == (ssize_t) (4 * stack_entries.size());
+        offset += 4 * stack_entries.size();
+        ok = ok && pread(fd, page_addrs.data(), 4 * page_addrs.size(), offset) == (ssize_t) (4 * page_addrs.size());
+    }
+
+    // every page base starts a page and shows up once
+    if (ok) {
+        std::vector<uint32_t> sorted = page_addrs;
+        std::sort(sorted.begin(), sorted.end());
+        ok = std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end()
+            && std::all_of(sorted.begin(), sorted.end(), [](uint32_t addr) { return (addr & Memory::OFFSET_MASK) == 0; });
+    }
+
+    // pages stay in the file until written, MAP_PRIVATE keeps the file untouched
+    if (ok && pages_len > 0) {
+        void* region = mmap(nullptr, pages_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, header.pages_offset);
+        if (region == MAP_FAILED) {
+            ok = false;
+        } else {
+            mem.adopt_pages(region, pages_len, page_addrs.data(), page_addrs.size());
+        }
+    }
+    close(fd);
+
+    if (!ok) {
+        *err << "Error: invalid snapshot file: " << path << "\n";
+        return false;
+    }
+
+    hart.pc = header.pc;
+    halt_pc = header.halt_pc;
+    code_start = 0; // snapshots don't keep the code range, the profiler counts up to the halt pc
+    code_bytes = halt_pc;
+    for (uint32_t entry : stack_entries) {
+        hart.ret_stack.push(entry);
+    }
+    return open_aot();
+#else
+    *err << "Error: restoring snapshots needs mmap, can't restore " << path << "\n";
+    return false;
+#endif
+}
@@ -0,0 +1,127 @@
+#include <iomanip>
+#include <sstream>
+
+#include "yuemu_timing.hpp"
+
+namespace {
+
+bool power_of_two(uint64_t val) {
+    return val != 0 && (val & (val - 1)) == 0;
+}
+
+// a number with an optional K or M suffix
+bool parse_size(const std::string& text, uint32_t& val) {
+    uint64_t scale = 1;
+    std::string digits = text;
+    if (!digits.empty() && (digits.back() == 'K' || digits.back() == 'k')) {
+        scale = 1024;
+        digits.pop_back();
+    } else if (!digits.empty() && (digits.back() == 'M' || digits.back() == 'm')) {
+        scale = 1024 * 1024;
+        digits.pop_back();
+    }
+    if (digits.empty() || digits.find_first_not_of("0123456789") != std::string::npos || digits.size() > 9) {
+        return false;
+    }
+    uint64_t result = std::stoull(digits) * scale;
+    if (result > UINT32_MAX) {
+        return false;
+    }
+    val = result;
+    return true;
+}
+
+// "<size>/<ways>/<line>/<latency>" with sets that are a power of two
+bool parse_cache(const std::string& text, CacheConfig& cache) {
+    std::istringstream fields(text);
+    std::string size, ways, line, latency, extra;
+    if (!std::getline(fields, size, '/') || !std::getline(fields, ways, '/') || !std::getline(fields, line, '/')
+            || !std::getline(fields, latency, '/') || std::getline(fields, extra)) {
+        return false;
+    }
+    CacheConfig parsed;
+    if (!parse_size(size, parsed.size) || !parse_size(ways, parsed.ways) || !parse_size(line, parsed.line)
+            || !parse_size(latency, parsed.latency)) {
+        return false;
+    }
+    uint64_t set_size = (uint64_t) parsed.ways * parsed.line;
+    if (!power_of_two(parsed.size) || !power_of_two(parsed.line) || parsed.ways == 0
+            || parsed.size % set_size != 0 || !power_of_two(parsed.size / set_size)) {
+        return false;
+    }
+    cache = parsed;
+    return true;
+}
+
+} // namespace
+
+bool TimingConfig::parse(const std::string& spec, std::string& bad) {
+    std::istringstream items(spec);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+        size_t eq = item.find('=');
+        std::string level = item.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : item.substr(eq + 1);
+        bool ok;
+        if (level == "l1i") {
+            ok = parse_cache(value, l1i);
+        } else if (level == "l1d") {
+            ok = parse_cache(value, l1d);
+        } else if (level == "l2") {
+            ok = parse_cache(value, l2);
+        } else if (level == "mem") {
+            ok = parse_size(value, memory_latency);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            bad = item;
+            return false;
+        }
+    }
+    return true;
+}
+
+Cache::Cache(const CacheConfig& config)
+    : config(config),
+      line_bits(__builtin_ctz(config.line)),
+      set_mask(config.size / (config.ways * config.line) - 1),
+      lines((size_t) config.size / config.line, Way{0, 0, false}) {}
+
+TimingModel::TimingModel(const TimingConfig& config, uint32_t harts) : config(config), l2(config.l2) {
+    for (uint32_t i=0; i<harts; i++) {
+        cores.push_back(Core{Cache(config.l1i), Cache(config.l1d)});
+    }
+}
+
+namespace {
+
+void print_cache(std::ostream& os, const std::string& name, const CacheConfig& config, uint64_t hits, uint64_t misses) {
+    uint64_t accesses = hits + misses;
+    os << "  " << std::setw(4) << std::left << name << std::right
+       << " " << std::setw(8) << config.size << " x" << std::setw(3) << config.ways << " x" << std::setw(4) << config.line
+       << "  accesses " << std::setw(14) << accesses << "  misses " << std::setw(14) << misses
+       << std::setw(8) << (accesses == 0 ? 0 : 100.0 * misses / accesses) << "% miss\n";
+}
+
+} // namespace
+
+void TimingModel::print_report(std::ostream& os) const {
+    uint64_t l1i_hits = 0, l1i_misses = 0, l1d_hits = 0, l1d_misses = 0;
+    for (const Core& core : cores) {
+        l1i_hits += core.l1i.hits;
+        l1i_misses += core.l1i.misses;
+        l1d_hits += core.l1d.hits;
+        l1d_misses += core.l1d.misses;
+    }
+
+    os << "\nTiming\n----------------\n";
+    os << std::fixed << std::setprecision(2);
+    os << "Caches (addresses x ways x line):\n";
+    print_cache(os, "l1i", config.l1i, l1i_hits, l1i_misses);
+    print_cache(os, "l1d", config.l1d, l1d_hits, l1d_misses);
+    print_cache(os, "l2", config.l2, l2.hits, l2.misses);
+    os << "Instructions: " << instructions << ", estimated cycles: " << cycles
+       << ", cycles per instruction: " << (instructions == 0 ? 0 : (double) cycles / instructions) << "\n";
+    os.unsetf(std::ios::floatfield);
+}
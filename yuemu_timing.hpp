@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Sizes count guest addresses, one 32-bit word each. Instructions sit 4
+// addresses apart, so a 16 address line holds 4 instructions or 16 data words.
+struct CacheConfig {
+    uint32_t size; // addresses, a power of two
+    uint32_t ways;
+    uint32_t line; // addresses, a power of two
+    uint32_t latency; // cycles for a hit
+};
+
+struct TimingConfig {
+    CacheConfig l1i = {8192, 8, 16, 1};
+    CacheConfig l1d = {8192, 8, 16, 3};
+    CacheConfig l2 = {262144, 16, 16, 12};
+    uint32_t memory_latency = 100;
+
+    // a comma separated list of "<level>=<size>/<ways>/<line>/<latency>" with
+    // level l1i, l1d or l2 and "mem=<latency>", sizes may end in K or M,
+    // levels left out keep their defaults. A malformed item ends up in bad.
+    bool parse(const std::string& spec, std::string& bad);
+};
+
+// One set-associative cache with LRU replacement. Stores allocate like loads
+// and write back for free.
+class Cache {
+    public:
+        explicit Cache(const CacheConfig& config);
+
+        const CacheConfig config;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+
+        // true on a hit, a miss brings the line in
+        bool access(uint32_t addr) {
+            uint32_t line = addr >> line_bits;
+            uint32_t set = line & set_mask;
+            Way* ways = &lines[(size_t) set * config.ways];
+            clock++;
+            for (uint32_t i=0; i<config.ways; i++) {
+                if (ways[i].valid && ways[i].tag == line) {
+                    ways[i].used = clock;
+                    hits++;
+                    return true;
+                }
+            }
+            Way* victim = &ways[0];
+            for (uint32_t i=1; i<config.ways && victim->valid; i++) {
+                if (!ways[i].valid || ways[i].used < victim->used) {
+                    victim = &ways[i];
+                }
+            }
+            *victim = {line, clock, true};
+            misses++;
+            return false;
+        }
+
+    private:
+        struct Way {
+            uint32_t tag; // the whole line number
+            uint64_t used;
+            bool valid;
+        };
+
+        uint32_t line_bits;
+        uint32_t set_mask;
+        uint64_t clock = 0;
+        std::vector<Way> lines; // set by set, ways side by side
+};
+
+// An in-order machine without overlap: every instruction costs its fetch and
+// a load or store adds its data access, each at the latency of the level that
+// had the line, or the memory latency when none did. Every hart has its own
+// L1 caches in front of one shared L2.
+class TimingModel {
+    public:
+        TimingModel(const TimingConfig& config, uint32_t harts);
+
+        void fetch(uint32_t hart, uint32_t pc) {
+            instructions++;
+            cycles += access(cores[hart].l1i, pc);
+        }
+
+        void load(uint32_t hart, uint32_t addr) {
+            cycles += access(cores[hart].l1d, addr);
+        }
+
+        void store(uint32_t hart, uint32_t addr) {
+            cycles += access(cores[hart].l1d, addr);
+        }
+
+        // hit and miss counts per cache, cycles and cycles per instruction
+        void print_report(std::ostream& os) const;
+
+    private:
+        struct Core {
+            Cache l1i;
+            Cache l1d;
+        };
+
+        const TimingConfig config;
+        std::vector<Core> cores;
+        Cache l2;
+        uint64_t instructions = 0;
+        uint64_t cycles = 0;
+
+        uint32_t access(Cache& l1, uint32_t addr) {
+            if (l1.access(addr)) {
+                return l1.config.latency;
+            }
+            return l2.access(addr) ? l2.config.latency : config.memory_latency;
+        }
+};
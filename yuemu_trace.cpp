@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "yuemu_trace.hpp"
+
+TraceWriter::TraceWriter() : buffer(new TraceRecord[CAPACITY]) {}
+
+TraceWriter::~TraceWriter() {
+    close();
+}
+
+bool TraceWriter::open(const std::string& path, uint32_t read_instr_count) {
+    file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    TraceFileHeader header;
+    std::memcpy(header.magic, "YUETRACE", 8);
+    header.version = VERSION;
+    header.read_instr_count = read_instr_count;
+    std::fwrite(&header, sizeof(header), 1, file);
+
+    writer = std::thread(&TraceWriter::drain, this);
+    return true;
+}
+
+void TraceWriter::close() {
+    if (file == nullptr) {
+        return;
+    }
+
+    published_head.store(head, std::memory_order_release);
+    done.store(true, std::memory_order_release);
+    writer.join();
+
+    std::fclose(file);
+    file = nullptr;
+}
+
+void TraceWriter::wait_for_space() {
+    // the writer can only free space it knows about
+    published_head.store(head, std::memory_order_release);
+    while (true) {
+        tail_cache = tail.load(std::memory_order_acquire);
+        if (head - tail_cache < CAPACITY) {
+            return;
+        }
+        std::this_thread::yield();
+    }
+}
+
+void TraceWriter::drain() {
+    uint64_t pos = tail.load(std::memory_order_relaxed);
+    while (true) {
+        uint64_t end = published_head.load(std::memory_order_acquire);
+        if (end == pos) {
+            if (done.load(std::memory_order_acquire)) {
+                // close() publishes before setting done, so one more look finds the rest
+                if (published_head.load(std::memory_order_acquire) == pos) {
+                    break;
+                }
+                continue;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            continue;
+        }
+
+        // write up to the end of the buffer, the wrapped part goes next round
+        uint64_t start = pos & (CAPACITY - 1);
+        uint64_t count = std::min(end - pos, CAPACITY - start);
+        std::fwrite(&buffer[start], sizeof(TraceRecord), count, file);
+
+        pos += count;
+        tail.store(pos, std::memory_order_release);
+    }
+    std::fflush(file);
+}
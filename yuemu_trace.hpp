@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+
+// One executed instruction. Records are written in host byte order.
+struct TraceRecord {
+    uint32_t pc;
+    uint32_t instr; // raw instruction word
+    uint32_t value; // value written to rd or to memory, the new pc for control instructions
+    uint32_t addr; // memory address for loads and stores, 1 for a ret on an empty return stack
+};
+
+struct TraceFileHeader {
+    char magic[8]; // "YUETRACE"
+    uint32_t version;
+    uint32_t read_instr_count;
+};
+
+// Single-producer ring buffer of trace records. The emulator thread fills it
+// and a writer thread drains it to the trace file. The producer only
+// publishes its position every PUBLISH_INTERVAL records and only rereads the
+// consumer position when the buffer looks full, so recording a record is a
+// plain store in the common case.
+class TraceWriter {
+    public:
+        static constexpr uint32_t VERSION = 1;
+        static constexpr uint64_t CAPACITY = 1 << 20; // records, a power of two
+        static constexpr uint64_t PUBLISH_INTERVAL = 1024;
+
+        TraceWriter();
+        ~TraceWriter();
+        TraceWriter(const TraceWriter&) = delete;
+        TraceWriter& operator=(const TraceWriter&) = delete;
+
+        // writes the header and starts the writer thread
+        bool open(const std::string& path, uint32_t read_instr_count);
+
+        bool is_open() const { return file != nullptr; }
+
+        // publishes the remaining records, waits until they are written and closes the file
+        void close();
+
+        void record(uint32_t pc, uint32_t instr, uint32_t value, uint32_t addr) {
+            if (head - tail_cache == CAPACITY) {
+                wait_for_space();
+            }
+            buffer[head & (CAPACITY - 1)] = {pc, instr, value, addr};
+            head++;
+            if (head % PUBLISH_INTERVAL == 0) {
+                published_head.store(head, std::memory_order_release);
+            }
+        }
+
+    private:
+        std::unique_ptr<TraceRecord[]> buffer;
+        std::FILE* file = nullptr;
+        std::thread writer;
+
+        uint64_t head = 0; // producer only
+        uint64_t tail_cache = 0; // producer's last look at tail
+
+        alignas(64) std::atomic<uint64_t> published_head{0};
+        alignas(64) std::atomic<uint64_t> tail{0};
+        std::atomic<bool> done{false};
+
+        void wait_for_space();
+        void drain();
+};
@@ -0,0 +1,300 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "yuemu.hpp"
+#include "yuemu_decode.hpp"
+#include "yuemu_trace.hpp"
+
+// Turns a binary trace back into the text printed by --trace=10 (or 11).
+// Register values are rebuilt from the records, every register starts at 0
+// just like in the emulator. Memory is only known where the trace touched it.
+class TraceDecoder {
+    public:
+        TraceDecoder(uint32_t read_instr_count, int level, bool show_hex, const SymbolTable& symbols)
+            : read_instr_count(read_instr_count), level(level), show_hex(show_hex), symbols(symbols) {}
+
+        void print(const TraceRecord& rec);
+
+    private:
+        uint32_t read_instr_count;
+        int level;
+        bool show_hex;
+        const SymbolTable& symbols;
+        uint32_t regs[256] = {0};
+        std::unordered_map<uint32_t, uint32_t> mem;
+
+        void print_alu(const char* name, const DecodedOp& op, uint32_t res);
+        void print_registers(uint32_t pc_debug);
+};
+
+void TraceDecoder::print_alu(const char* name, const DecodedOp& op, uint32_t res) {
+    uint32_t rd = op.rd;
+    uint32_t rs1 = op.rs1;
+    uint32_t rs2 = op.rs2;
+    std::cout << name << ": rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << "\n";
+    std::cout << "+> val1=" << Yuemu::to_signed(regs[rs1]) << ", val2=" << Yuemu::to_signed(regs[rs2]) << ", res=" << Yuemu::to_signed(res) << "\n";
+    regs[rd] = res;
+}
+
+void TraceDecoder::print(const TraceRecord& rec) {
+    DecodedOp op = decode(rec.instr);
+    uint32_t pc_debug = rec.pc; // the register dump shows the new pc after taken jumps
+
+    if (show_hex) {
+        std::string symbol = symbols.describe(rec.pc);
+        std::cout << "[" << rec.pc << "] " << Yuemu::get_instr_as_hex(rec.instr) << "  " << disassemble(rec.instr);
+        if (!symbol.empty()) {
+            std::cout << "  <" << symbol << ">";
+        }
+        std::cout << "\n";
+    }
+
+    switch (op.op) {
+        case Op::LOADI: {
+            uint32_t rd = op.rd;
+            std::cout << "loadm: rd=" << rd << ", val=" << Yuemu::to_signed(rec.value) << "\n";
+            regs[rd] = rec.value;
+            break;
+        }
+
+        case Op::LOADR: {
+            uint32_t rd = op.rd;
+            uint32_t raddr = op.rs1;
+            regs[rd] = rec.value;
+            mem[rec.addr] = rec.value;
+            std::cout << "loadr: rd=" << rd << ", raddr=" << raddr << "\n";
+            std::cout << "+> value_of_addr=" << regs[raddr] << ", value_at_addr=" << mem[regs[raddr]] << "\n";
+            break;
+        }
+
+        case Op::STOREN: {
+            uint32_t raddr = op.rs1;
+            uint32_t rs = op.rs2;
+            mem[rec.addr] = rec.value;
+            std::cout << "storen: raddr=" << raddr << ", rs=" << rs << "\n";
+            std::cout << "+> value_at_rs=" << Yuemu::to_signed(rec.value) << "\n";
+            break;
+        }
+
+        case Op::STORED: {
+            uint32_t rs = op.rs2;
+            mem[rec.addr] = rec.value;
+            std::cout << "stored: addr=" << rec.addr << ", rs=" << rs << "\n";
+            std::cout << "+> value_at_rs=" << Yuemu::to_signed(rec.value) << "\n";
+            break;
+        }
+
+        case Op::LOADD: {
+            uint32_t rd = op.rd;
+            regs[rd] = rec.value;
+            mem[rec.addr] = rec.value;
+            std::cout << "loadd: rd=" << rd << ", raddr=" << rec.addr << "\n";
+            std::cout << "+> value_at_addr=" << rec.value << "\n";
+            break;
+        }
+
+        case Op::ADD: print_alu("add", op, rec.value); break;
+        case Op::SUB: print_alu("sub", op, rec.value); break;
+        case Op::MUL: print_alu("mul", op, rec.value); break;
+        case Op::DIV: print_alu("div", op, rec.value); break;
+        case Op::AND: print_alu("and", op, rec.value); break;
+        case Op::OR: print_alu("or", op, rec.value); break;
+        case Op::NAND: print_alu("nand", op, rec.value); break;
+        case Op::NOR: print_alu("nor", op, rec.value); break;
+        case Op::XOR: print_alu("xor", op, rec.value); break;
+        case Op::LSHIFT: print_alu("lshift", op, rec.value); break;
+        case Op::RSHIFT: print_alu("rshift", op, rec.value); break;
+        case Op::LT: print_alu("lt", op, rec.value); break;
+        case Op::LTE: print_alu("lte", op, rec.value); break;
+        case Op::GT: print_alu("gt", op, rec.value); break;
+        case Op::GTE: print_alu("gte", op, rec.value); break;
+        case Op::EQ: print_alu("eq", op, rec.value); break;
+
+        case Op::JUMP: {
+            pc_debug = rec.value;
+            std::cout << "jump: val=" << (int32_t) op.imm << "\n";
+            break;
+        }
+
+        case Op::JUMPDIR: {
+            uint32_t rs = op.rs1;
+            pc_debug = rec.value;
+            std::cout << "jumpdir: rs=" << rs << "\n";
+            std::cout << "+> value_at_rs=" << Yuemu::to_signed(regs[rs]) << "\n";
+            break;
+        }
+
+        case Op::JUMPIF: {
+            uint32_t rcond = op.rs2;
+            int32_t cond = regs[rcond];
+            if (cond != 0) {
+                pc_debug = rec.value;
+            }
+            std::cout << "jumpif: val=" << (int32_t) op.imm << ", rcond=" << rcond << "\n";
+            std::cout << "+> cond=" << cond << "\n";
+            break;
+        }
+
+        case Op::JUMPIFDIR: {
+            uint32_t rs = op.rs1;
+            uint32_t rcond = op.rs2;
+            int32_t cond = regs[rcond];
+            if (cond != 0) {
+                pc_debug = rec.value;
+            }
+            std::cout << "jumpif: rs=" << rs << ", rcond=" << rcond << "\n";
+            std::cout << "+> value_at_rs=" << Yuemu::to_signed(regs[rs]) << ", cond=" << cond << "\n";
+            break;
+        }
+
+        case Op::RET: {
+            std::cout << "ret\n";
+            if (rec.addr == 1) {
+                std::cout << "+> return stack empty, ignoring\n"; 
+            } else {
+                pc_debug = rec.value;
+                std::cout << "+> pc = " << rec.value << "\n";
+            }
+            break;
+        }
+
+        case Op::END: {
+            std::cout << "End of program\n";
+            return;
+        }
+
+        case Op::BR: {
+            pc_debug = rec.value;
+            std::cout << "br: val=" << (int32_t) op.imm << "\n";
+            break;
+        }
+
+        case Op::BRIF: {
+            uint32_t rcond = op.rs2;
+            int32_t cond = regs[rcond];
+            if (cond != 0) {
+                pc_debug = rec.value;
+            }
+            std::cout << "brif: val=" << (int32_t) op.imm << ", rcond=" << rcond << "\n";
+            std::cout << "+> cond=" << cond << "\n";
+            break;
+        }
+
+        case Op::NOP:
+        case Op::BLOCK_END:
+            break;
+
+        case Op::INVALID: {
+            std::cout << "Error: invalid instruction: 0x" << Yuemu::get_instr_as_hex(rec.instr) << "\n";
+            return;
+        }
+
+        // fused ops and breakpoints only exist in translated blocks, decode() never returns them for a trace word
+        case Op::BREAKPOINT:
+        case Op::LT_JUMPIF: case Op::LTE_JUMPIF: case Op::GT_JUMPIF: case Op::GTE_JUMPIF: case Op::EQ_JUMPIF:
+        case Op::LOADI_ADD: case Op::LOADI_SUB: case Op::LOADI_MUL: case Op::LOADI_AND: case Op::LOADI_OR:
+        case Op::LOADI_XOR: case Op::LOADI_LSHIFT: case Op::LOADI_RSHIFT:
+        case Op::ADD_LOADR: case Op::ADD_STOREN:
+            break;
+    }
+
+    if (level >= 11) {
+        print_registers(pc_debug);
+    }
+}
+
+void TraceDecoder::print_registers(uint32_t pc_debug) {
+    std::cout << "########\n";
+    std::cout << "PC: " << pc_debug;
+    std::string symbol = symbols.describe(pc_debug);
+    if (!symbol.empty()) {
+        std::cout << " (" << symbol << ")";
+    }
+    std::cout << ", Instruction Count: " << read_instr_count << "\n";
+    std::cout << "First 8 registers:\n";
+    for (int i=0; i<8; i++) {
+        std::cout << "[" << i << "]: " << Yuemu::to_signed(regs[i]) << "\n";
+    }
+    std::cout << "########\n";
+}
+
+int main(int argc, char* argv[]) {
+    int level = 10;
+    bool show_hex = false;
+    std::string fpath;
+    std::string program_path;
+
+    for (int i=1; i<argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--registers") {
+            level = 11;
+        } else if (arg == "--hex") {
+            show_hex = true;
+        } else if (arg.rfind("--program=", 0) == 0) {
+            program_path = arg.substr(10);
+        } else {
+            fpath = arg;
+        }
+    }
+
+    if (fpath.empty()) {
+        std::cout << "Usage: yuemu_tracedump [--registers] [--hex] [--program=<executable>] <trace file>\n";
+        return 1;
+    }
+
+    std::FILE* file = std::fopen(fpath.c_str(), "rb");
+    if (file == nullptr) {
+        std::cerr << "Error: can't open trace file: " << fpath << "\n";
+        return 1;
+    }
+
+    TraceFileHeader header;
+    if (std::fread(&header, sizeof(header), 1, file) != 1 || std::memcmp(header.magic, "YUETRACE", 8) != 0) {
+        std::cerr << "Error: not a yuemu trace file: " << fpath << "\n";
+        std::fclose(file);
+        return 1;
+    }
+    if (header.version != TraceWriter::VERSION) {
+        std::cerr << "Error: unsupported trace version " << header.version << "\n";
+        std::fclose(file);
+        return 1;
+    }
+
+    // the traced executable names the pcs, raw images have no symbols
+    SymbolTable symbols;
+    if (!program_path.empty()) {
+        std::ifstream program(program_path, std::ios::binary);
+        if (!program) {
+            std::cerr << "Error: can't open program file: " << program_path << "\n";
+            std::fclose(file);
+            return 1;
+        }
+        std::vector<char> data((std::istreambuf_iterator<char>(program)), std::istreambuf_iterator<char>());
+        Executable exe;
+        if (Executable::is_executable((const uint8_t*) data.data(), data.size())) {
+            if (!exe.parse((const uint8_t*) data.data(), data.size(), std::cerr)) {
+                std::fclose(file);
+                return 1;
+            }
+            symbols = exe.symbols;
+        }
+    }
+
+    TraceDecoder decoder(header.read_instr_count, level, show_hex, symbols);
+    TraceRecord records[4096];
+    size_t count;
+    while ((count = std::fread(records, sizeof(TraceRecord), 4096, file)) > 0) {
+        for (size_t i=0; i<count; i++) {
+            decoder.print(records[i]);
+        }
+    }
+
+    std::fclose(file);
+    return 0;
+}